@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <sstream>
+
+#include "admin.h"
+#include "common.h"
+#include "server-utils.h"
+
+// Longest command an admin may send.
+#define ADMIN_LINE_MAX 4096
+
+// Connection of an admin.
+typedef struct {
+    int fd;
+    // Received part of the next command.
+    std::string in;
+    // Answers that didn't fit in the socket yet.
+    std::string out;
+} Admin;
+
+static int listen_fd = -1;
+static std::string socket_path;
+static std::vector<Admin> admins;
+
+void admin_listen(const std::string& path) {
+    listen_fd = create_unix_listener(path);
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    socket_path = path;
+}
+
+bool admin_enabled() {
+    return listen_fd >= 0;
+}
+
+void admin_poll_fds(std::vector<pollfd>& pollfds) {
+    if (listen_fd < 0) return;
+    pollfds.push_back({listen_fd, POLLIN, 0});
+    for (const Admin& a : admins) {
+        pollfds.push_back({a.fd, (short)(POLLIN | (a.out.empty() ? 0 : POLLOUT)), 0});
+    }
+}
+
+// Parses the command line. Returns false with the reason in why if it
+// isn't valid.
+static bool parse_command(const std::string& line, AdminCommand& cmd, std::string& why) {
+    std::istringstream iss(line);
+    std::string word, arg, rest;
+    iss >> word;
+    if (word == "SET") {
+        std::string param;
+        iss >> param >> arg;
+        cmd.op = AdminOp::SET;
+        cmd.param = param.size() == 1 ? param[0] : 0;
+        int minv = 1, maxv;
+        switch (cmd.param) {
+        case 'K': maxv = 10000; break;
+        case 'N': maxv = 8; break;
+        case 'M': maxv = 12341234; break;
+        default:
+            why = "unknown parameter: " + param;
+            return false;
+        }
+        if (!parse_int(arg.c_str(), minv, maxv, cmd.value)) {
+            why = "invalid " + param + ": " + arg;
+            return false;
+        }
+    } else if (word == "COEFF") {
+        std::string source;
+        iss >> source >> arg;
+        if (source == "FILE" && !arg.empty()) {
+            cmd.op = AdminOp::COEFF_FILE;
+            cmd.path = arg;
+        } else if (source == "SEED") {
+            cmd.op = AdminOp::COEFF_SEED;
+            if (!parse_uint64(arg.c_str(), cmd.seed)) {
+                why = "invalid seed: " + arg;
+                return false;
+            }
+        } else {
+            why = "usage: COEFF FILE path | COEFF SEED seed";
+            return false;
+        }
+    } else if (word == "DRAIN") {
+        cmd.op = AdminOp::DRAIN;
+    } else if (word == "STATS") {
+        cmd.op = AdminOp::STATS;
+    } else if (word == "SHOW") {
+        cmd.op = AdminOp::SHOW;
+    } else if (word == "RANK") {
+        cmd.op = AdminOp::RANK;
+        if (!(iss >> cmd.player_id)) {
+            why = "usage: RANK player_id";
+            return false;
+        }
+    } else {
+        why = "unknown command: " + word;
+        return false;
+    }
+    if (iss >> rest) {
+        why = "unexpected argument: " + rest;
+        return false;
+    }
+    return true;
+}
+
+// Writes what is queued for a. Returns false if the connection is broken.
+static bool flush_admin(Admin& a) {
+    while (!a.out.empty()) {
+        ssize_t n = send(a.fd, a.out.data(), a.out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        a.out.erase(0, n);
+    }
+    return true;
+}
+
+// Reads the commands of a and runs the whole ones. Returns false if the
+// connection was closed or broken.
+static bool serve_admin(Admin& a,
+                        const std::function<bool(const AdminCommand&, std::string&)>& apply) {
+    char buf[1024];
+    ssize_t n = recv(a.fd, buf, sizeof buf, MSG_DONTWAIT);
+    if (n == 0) return false;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    a.in.append(buf, n);
+    size_t start = 0, end;
+    while ((end = a.in.find('\n', start)) != std::string::npos) {
+        std::string line = a.in.substr(start, end - start);
+        start = end + 1;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.find_first_not_of(" \t") == std::string::npos) continue;
+        AdminCommand cmd;
+        std::string answer;
+        if (!parse_command(line, cmd, answer) || !apply(cmd, answer)) {
+            a.out += "ERROR " + answer + "\n";
+        } else {
+            a.out += answer + "OK\n";
+        }
+    }
+    a.in.erase(0, start);
+    if (a.in.size() > ADMIN_LINE_MAX) {
+        a.out += "ERROR command too long\n";
+        flush_admin(a);
+        return false;
+    }
+    return true;
+}
+
+void admin_handle(const std::vector<pollfd>& pollfds, size_t first,
+                  const std::function<bool(const AdminCommand&, std::string&)>& apply) {
+    if (listen_fd < 0) return;
+    // The connections accepted now weren't polled yet.
+    size_t polled = admins.size();
+    bool incoming = pollfds[first].revents & POLLIN;
+    for (size_t i = 0, f = first + 1; i < polled; i++, f++) {
+        short revents = pollfds[f].revents;
+        Admin& a = admins[i];
+        bool ok = !(revents & (POLLERR | POLLNVAL));
+        if (ok && (revents & (POLLIN | POLLHUP))) ok = serve_admin(a, apply);
+        if (ok) ok = flush_admin(a);
+        if (!ok) {
+            close(a.fd);
+            admins.erase(admins.begin() + i);
+            i--;
+            polled--;
+        }
+    }
+    if (incoming) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            admins.push_back({fd, "", ""});
+        }
+    }
+}
+
+void admin_close() {
+    if (listen_fd < 0) return;
+    for (const Admin& a : admins) close(a.fd);
+    admins.clear();
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    listen_fd = -1;
+}
@@ -0,0 +1,63 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <poll.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Control channel of a running server on a unix domain socket. Commands
+// are lines, every answer ends with a line "OK" or "ERROR reason":
+//   SET K|N|M value     changes the parameter from the next game on
+//   COEFF FILE path     takes the coefficients of the next games from path
+//   COEFF SEED seed     generates the coefficients of the next games
+//   DRAIN               stops accepting players, exits after the game
+//   STATS               the statistics, as printed on SIGUSR1
+//   SHOW                the parameters of this and the next game
+//   RANK player_id      the standing of player_id on the leaderboard (-L)
+// N and the coefficient file of the next game may be changed in any order,
+// they are checked together when it starts; if they don't match, it keeps
+// N and the coefficients of the last game.
+// The connections are served by the main loop, but only with non-blocking
+// reads and writes, so an admin never stops the games.
+
+enum class AdminOp { SET, COEFF_FILE, COEFF_SEED, DRAIN, STATS, SHOW, RANK };
+
+// Parsed command.
+typedef struct {
+    AdminOp op;
+    // Parameter of SET: 'K', 'N' or 'M'.
+    char param;
+    // Value of SET.
+    int value;
+    // Seed of COEFF SEED.
+    uint64_t seed;
+    // File of COEFF FILE.
+    std::string path;
+    // Player of RANK.
+    std::string player_id;
+} AdminCommand;
+
+// Starts listening for admin connections on the unix socket path. Exits
+// with error on failure.
+void admin_listen(const std::string& path);
+
+// Returns true if the server has an admin socket.
+bool admin_enabled();
+
+// Appends the descriptors of the listener and the admin connections to
+// pollfds.
+void admin_poll_fds(std::vector<pollfd>& pollfds);
+
+// Accepts new admins and runs their commands, given the events polled for
+// the descriptors from admin_poll_fds, which start at pollfds[first].
+// apply runs a valid command and returns false if it can't be done. It
+// sets answer to the lines before "OK", or to the reason of the error.
+void admin_handle(const std::vector<pollfd>& pollfds, size_t first,
+                  const std::function<bool(const AdminCommand&, std::string&)>& apply);
+
+// Closes the listener and the connections and removes the socket file.
+void admin_close();
+
+#endif // ADMIN_H
@@ -0,0 +1,501 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "err.h"
+#include "common.h"
+
+// Proxy between the players and the server that makes the network worse:
+// it delays what passes through, limits the bandwidth, splits the data
+// into fragments written one by one and resets connections in the middle
+// of a write. Every connection gets the same conditions, the random
+// choices come from the seed, so a run can be repeated.
+
+using Clock     = std::chrono::steady_clock;
+using TimePoint = Clock::time_point;
+
+// Bytes read from a socket at once.
+#define READ_SIZE 65536
+// A direction stops reading once this much waits to be written, so a slow
+// reader slows down the writer on the other side.
+#define QUEUE_MAX (1 << 20)
+// Time between the fragments of one read, so the reader gets them in
+// separate reads.
+static constexpr auto FRAGMENT_GAP = std::chrono::microseconds(1000);
+
+// Options given on the command line.
+struct Options {
+    int port = 0;
+    std::string server;
+    std::string server_port;
+    // Delay added to every byte in each direction, and its random part.
+    int delay_ms = 0;
+    int jitter_ms = 0;
+    // Bytes per second of each direction of a connection, 0 for no limit.
+    double bandwidth = 0;
+    // Largest fragment, 0 to write what was read at once.
+    int fragment = 0;
+    // Probability that a read is followed by a reset of the connection,
+    // in the middle of writing it.
+    double reset = 0;
+    uint64_t seed = 1;
+};
+
+// Data waiting to be written, from due on.
+typedef struct {
+    TimePoint due;
+    std::string data;
+    // The connection is reset after this many bytes of data, -1 if not.
+    long reset_at;
+} Chunk;
+
+// One direction of a connection.
+typedef struct {
+    int from, to;
+    std::deque<Chunk> chunks;
+    size_t queued;
+    // Written part of chunks.front().
+    size_t offset;
+    // When the bandwidth allows the next write.
+    TimePoint next_write;
+    // from was closed, to is shut down once everything is written.
+    bool eof;
+    bool shut;
+    uint64_t bytes;
+} Pipe;
+
+// Proxied connection: up goes from the player to the server, down back.
+typedef struct {
+    int id;
+    Pipe up, down;
+    // The server isn't connected yet, the connection to ai is in progress.
+    bool connecting;
+    const struct addrinfo* ai;
+} Link;
+
+// What write_pipe ended with.
+typedef enum {
+    WRITE_OK,
+    WRITE_RESET,        // A reset chosen by read_pipe.
+    WRITE_ERROR,        // The other side failed.
+} WriteResult;
+
+// Totals printed on exit or SIGUSR1.
+struct Totals {
+    uint64_t links = 0;
+    uint64_t refused = 0;           // The server couldn't be connected.
+    uint64_t bytes_up = 0, bytes_down = 0;
+    uint64_t fragments = 0;
+    uint64_t resets = 0;            // Chosen by -x.
+    uint64_t peer_errors = 0;       // A player or the server failed a write.
+};
+
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_sigusr1(int) {
+    stats_requested = 1;
+}
+
+static void on_sigint(int) {
+    stop_requested = 1;
+}
+
+// Prints usage of the proxy.
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog
+              << " -p port -s server -P server_port [-d delay] [-j jitter] "
+              << "[-b bandwidth] [-f fragment] [-x reset] [-g seed]\n"
+              << "  accepts players on port and connects each of them to the "
+              << "server, through a worse network:\n"
+              << "  -d delay     ms added in each direction, -j up to jitter ms more\n"
+              << "  -b bandwidth bytes per second of each direction\n"
+              << "  -f fragment  writes at most fragment bytes at once, "
+              << "1 ms apart\n"
+              << "  -x reset     probability (0-1) that a read ends with a reset "
+              << "of the connection in the middle of writing it\n";
+}
+
+// Parses the arguments and checks if they're valid. If they're not then
+// print an error and exit with code 1.
+static void parse_args(int argc, char** argv, Options& opts) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:P:d:j:b:f:x:g:")) != -1) {
+        switch (opt) {
+        case 'p':
+            if (!parse_int(optarg, 0, 65535, opts.port)) fatal("invalid port: %s", optarg);
+            break;
+        case 's':
+            opts.server = optarg;
+            break;
+        case 'P':
+            opts.server_port = optarg;
+            break;
+        case 'd':
+            if (!parse_int(optarg, 0, 600000, opts.delay_ms)) fatal("invalid delay: %s", optarg);
+            break;
+        case 'j':
+            if (!parse_int(optarg, 0, 600000, opts.jitter_ms)) fatal("invalid jitter: %s", optarg);
+            break;
+        case 'b': {
+            int bandwidth;
+            if (!parse_int(optarg, 1, 2000000000, bandwidth)) {
+                fatal("invalid bandwidth: %s", optarg);
+            }
+            opts.bandwidth = bandwidth;
+            break;
+        }
+        case 'f':
+            if (!parse_int(optarg, 1, READ_SIZE, opts.fragment)) {
+                fatal("invalid fragment: %s", optarg);
+            }
+            break;
+        case 'x': {
+            char* end;
+            opts.reset = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || opts.reset < 0 || opts.reset > 1) {
+                fatal("invalid reset probability: %s", optarg);
+            }
+            break;
+        }
+        case 'g':
+            if (!parse_uint64(optarg, opts.seed)) fatal("invalid seed: %s", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            fatal("invalid argument");
+        }
+    }
+    if (opts.server.empty() || opts.server_port.empty()) {
+        usage(argv[0]);
+        fatal("-s and -P are required");
+    }
+}
+
+// Listens on port of all addresses, IPv4 ones too where IPv6 is
+// available. Exits with error on failure.
+static int listen_on(int port) {
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    int yes = 1, no = 0;
+    if (fd >= 0) {
+        struct sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof no);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof addr) == 0 && listen(fd, SOMAXCONN) == 0) {
+            return fd;
+        }
+        close(fd);
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) syserr("socket()");
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof addr) < 0) syserr("bind()");
+    if (listen(fd, SOMAXCONN) < 0) syserr("listen()");
+    return fd;
+}
+
+// Resolves the server address. Exits with error on failure.
+static struct addrinfo* resolve_server(const Options& opts) {
+    struct addrinfo hints{};
+    struct addrinfo* res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int ret = getaddrinfo(opts.server.c_str(), opts.server_port.c_str(), &hints, &res);
+    if (ret != 0) {
+        fatal("cannot resolve %s:%s: %s", opts.server.c_str(), opts.server_port.c_str(),
+              gai_strerror(ret));
+    }
+    return res;
+}
+
+// Makes fd non-blocking, with every write sent at once.
+static void set_socket_options(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+}
+
+// Starts a non-blocking connection to ai, or to the first address after it
+// that takes one, and sets ai to it. Returns the socket, -1 if no address
+// is left.
+static int connect_server(const struct addrinfo*& ai) {
+    for (; ai; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype, 0);
+        if (fd < 0) continue;
+        set_socket_options(fd);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+static Pipe new_pipe(int from, int to) {
+    return Pipe{from, to, {}, 0, 0, TimePoint{}, false, false, 0};
+}
+
+// Reads what is available from p.from and schedules it, split into
+// fragments. Returns false if p.from was closed.
+static bool read_pipe(Pipe& p, const Options& opts, std::mt19937_64& rng,
+                      Totals& totals, TimePoint now) {
+    char buf[READ_SIZE];
+    ssize_t n = read(p.from, buf, sizeof buf);
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (n == 0) return false;
+    TimePoint due = now + std::chrono::milliseconds(opts.delay_ms);
+    if (opts.jitter_ms > 0) {
+        due += std::chrono::microseconds(rng() % (opts.jitter_ms * 1000 + 1));
+    }
+    // Data is never reordered, a later read isn't due before an earlier one.
+    if (!p.chunks.empty()) due = std::max(due, p.chunks.back().due);
+    long reset_at = -1;
+    if (opts.reset > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < opts.reset) {
+        reset_at = (long)(rng() % n);
+    }
+    for (ssize_t off = 0; off < n;) {
+        ssize_t len = n - off;
+        if (opts.fragment > 0) len = std::min<ssize_t>(len, 1 + rng() % opts.fragment);
+        long chunk_reset = reset_at >= off && reset_at < off + len ? reset_at - off : -1;
+        p.chunks.push_back({due, std::string(buf + off, len), chunk_reset});
+        p.queued += len;
+        off += len;
+        totals.fragments++;
+        due += FRAGMENT_GAP;
+    }
+    return true;
+}
+
+// Writes the chunks of p that are due. Returns whether the link should be
+// reset, because of a reset chosen by read_pipe or an error.
+static WriteResult write_pipe(Pipe& p, const Options& opts, TimePoint now) {
+    while (!p.chunks.empty()) {
+        Chunk& c = p.chunks.front();
+        if (c.due > now || p.next_write > now) return WRITE_OK;
+        size_t end = c.reset_at >= 0 ? (size_t)c.reset_at : c.data.size();
+        ssize_t n = end > p.offset ? send(p.to, c.data.data() + p.offset, end - p.offset,
+                                          MSG_NOSIGNAL) : 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? WRITE_OK : WRITE_ERROR;
+        }
+        p.offset += n;
+        p.bytes += n;
+        if (opts.bandwidth > 0) {
+            p.next_write = std::max(p.next_write, now) +
+                           std::chrono::microseconds((int64_t)(n * 1e6 / opts.bandwidth));
+        }
+        if (p.offset == end && c.reset_at >= 0) return WRITE_RESET;
+        if (p.offset < c.data.size()) return WRITE_OK;
+        p.queued -= c.data.size();
+        p.chunks.pop_front();
+        p.offset = 0;
+    }
+    if (p.eof && !p.shut) {
+        shutdown(p.to, SHUT_WR);
+        p.shut = true;
+    }
+    return WRITE_OK;
+}
+
+// Returns the time p has to be written at next, if it waits for one.
+static bool pipe_timer(const Pipe& p, TimePoint& at) {
+    if (p.chunks.empty()) return false;
+    at = std::max(p.chunks.front().due, p.next_write);
+    return true;
+}
+
+// Closes both sockets of link, with a reset if reset is set.
+static void close_link(Link& link, bool reset) {
+    if (reset) {
+        struct linger hard{1, 0};
+        setsockopt(link.up.from, SOL_SOCKET, SO_LINGER, &hard, sizeof hard);
+        setsockopt(link.up.to, SOL_SOCKET, SO_LINGER, &hard, sizeof hard);
+    }
+    close(link.up.from);
+    close(link.up.to);
+}
+
+static void print_totals(const Totals& totals, size_t open_links) {
+    std::cerr << "links " << totals.links << "\n"
+              << "links_open " << open_links << "\n"
+              << "refused " << totals.refused << "\n"
+              << "bytes_up " << totals.bytes_up << "\n"
+              << "bytes_down " << totals.bytes_down << "\n"
+              << "fragments " << totals.fragments << "\n"
+              << "resets " << totals.resets << "\n"
+              << "peer_errors " << totals.peer_errors << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    parse_args(argc, argv, opts);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, on_sigusr1);
+    signal(SIGINT, on_sigint);
+    signal(SIGTERM, on_sigint);
+
+    int listen_fd = listen_on(opts.port);
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+    if (getsockname(listen_fd, (struct sockaddr*)&addr, &len) < 0) syserr("getsockname()");
+    int bound = addr.ss_family == AF_INET6 ?
+                ntohs(((struct sockaddr_in6*)&addr)->sin6_port) :
+                ntohs(((struct sockaddr_in*)&addr)->sin_port);
+    std::cout << "Proxying port " << bound << " to " << opts.server << ":" <<
+                 opts.server_port << ".\n";
+    std::cout.flush();
+    struct addrinfo* server_ai = resolve_server(opts);
+
+    std::mt19937_64 rng(opts.seed);
+    std::vector<std::unique_ptr<Link>> links;
+    std::vector<struct pollfd> fds;
+    Totals totals;
+    int next_id = 1;
+    while (!stop_requested) {
+        TimePoint now = Clock::now();
+        TimePoint wake = now + std::chrono::hours(1);
+        fds.clear();
+        fds.push_back({listen_fd, POLLIN, 0});
+        for (auto& link : links) {
+            if (link->connecting) {
+                // Only the connection to the server is waited for.
+                fds.push_back({link->up.from, 0, 0});
+                fds.push_back({link->up.to, POLLOUT, 0});
+                fds.push_back({-1, 0, 0});
+                fds.push_back({-1, 0, 0});
+                continue;
+            }
+            for (Pipe* p : {&link->up, &link->down}) {
+                TimePoint at;
+                bool timer = pipe_timer(*p, at);
+                // A due pipe waits for POLLOUT instead.
+                if (timer && at > now) wake = std::min(wake, at);
+                short events = 0;
+                if (!p->eof && p->queued < QUEUE_MAX) events |= POLLIN;
+                fds.push_back({p->from, events, 0});
+                fds.push_back({p->to, (short)(timer && at <= now ? POLLOUT : 0), 0});
+            }
+        }
+        int timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                            wake - now + std::chrono::microseconds(999)).count();
+        if (poll(fds.data(), fds.size(), std::max(timeout, 0)) < 0 && errno != EINTR) {
+            syserr("poll()");
+        }
+        now = Clock::now();
+        if (stats_requested) {
+            stats_requested = 0;
+            print_totals(totals, links.size());
+        }
+
+        size_t polled = links.size();
+        for (size_t i = 0, f = 1; i < polled; i++, f += 4) {
+            Link& link = *links[i];
+            if (link.connecting) {
+                if (!(fds[f + 1].revents & (POLLOUT | POLLERR | POLLHUP))) continue;
+                int err = 0;
+                socklen_t len = sizeof err;
+                if (getsockopt(link.up.to, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+                if (err == 0) {
+                    link.connecting = false;
+                    totals.links++;
+                    continue;
+                }
+                close(link.up.to);
+                link.ai = link.ai->ai_next;
+                int server = connect_server(link.ai);
+                if (server >= 0) {
+                    link.up.to = link.down.from = server;
+                    continue;
+                }
+                errno = err;
+                error("cannot connect to the server %s:%s", opts.server.c_str(),
+                      opts.server_port.c_str());
+                totals.refused++;
+                close(link.up.from);
+                links.erase(links.begin() + i);
+                i--;
+                polled--;
+                continue;
+            }
+            bool reset = false, failed = false;
+            Pipe* pipes[2] = {&link.up, &link.down};
+            for (int d = 0; d < 2; d++) {
+                Pipe& p = *pipes[d];
+                if ((fds[f + 2 * d].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                    !read_pipe(p, opts, rng, totals, now)) {
+                    p.eof = true;
+                }
+                uint64_t before = p.bytes;
+                WriteResult result = write_pipe(p, opts, now);
+                if (result == WRITE_RESET) reset = true;
+                if (result == WRITE_ERROR) failed = true;
+                (d == 0 ? totals.bytes_up : totals.bytes_down) += p.bytes - before;
+            }
+            bool done = link.up.shut && link.down.shut;
+            if (failed) {
+                totals.peer_errors++;
+                std::cout << "Link " << link.id << " failed after " << link.up.bytes <<
+                             " bytes up and " << link.down.bytes << " down.\n";
+            } else if (reset) {
+                totals.resets++;
+                std::cout << "Link " << link.id << " reset after " << link.up.bytes <<
+                             " bytes up and " << link.down.bytes << " down.\n";
+            }
+            if (reset || failed || done) {
+                close_link(link, reset || failed);
+                links.erase(links.begin() + i);
+                i--;
+                polled--;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int player = accept(listen_fd, nullptr, nullptr);
+            if (player >= 0) {
+                const struct addrinfo* ai = server_ai;
+                int server = connect_server(ai);
+                if (server < 0) {
+                    error("cannot connect to the server %s:%s", opts.server.c_str(),
+                          opts.server_port.c_str());
+                    totals.refused++;
+                    close(player);
+                } else {
+                    set_socket_options(player);
+                    auto link = std::make_unique<Link>();
+                    link->id = next_id++;
+                    link->up = new_pipe(player, server);
+                    link->down = new_pipe(server, player);
+                    link->connecting = true;
+                    link->ai = ai;
+                    links.push_back(std::move(link));
+                }
+            }
+        }
+    }
+    print_totals(totals, links.size());
+    freeaddrinfo(server_ai);
+    return 0;
+}
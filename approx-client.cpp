@@ -8,88 +8,267 @@
 #include <poll.h>
 #include <vector>
 #include <cstring>
+#include <chrono>
 
 #include "err.h"
 #include "common.h"
 #include "client-utils.h"
 
+// Options given on the command line.
+struct Options {
+    std::vector<std::string> player_ids;
+    std::string server;
+    std::string port;
+    bool force4 = false;
+    bool force6 = false;
+    bool auto_mode = false;
+    Heuristic heuristic = Heuristic::GREEDY;
+    int window = 1;
+    // PUTs played instead of the ones of the strategy, empty if none.
+    Script plan;
+    // STATE isn't printed.
+    bool quiet = false;
+    // Delay between connection attempts to the addresses of the server.
+    int stagger_ms = CONNECT_STAGGER_MS;
+    // PUTs of -i sent instead of the input from STDIN, empty if none.
+    Script script;
+    // Number of sessions with ids generated from the first player id.
+    int count = 0;
+    // Number of games played by every session.
+    int games = 1;
+};
+
 // Prints usage of the client.
 static void usage(const char* prog) {
     std::cerr << "Usage: " << prog
-              << " -u player_id -s server -p port "
-              << "[-4] [-6] [-a]\n";
+              << " -u player_id [-u player_id ...] -s server [-p port] "
+              << "[-4] [-6] [-a] [-S greedy|gain|cost] [-w window] "
+              << "[-c count] [-r games] [-P plan] [-i script] [-q] [-d delay]\n"
+              << "  -c count   play count sessions with ids player_id1 ... "
+              << "player_id<count>\n"
+              << "  -r games   play games games in every session, "
+              << "reconnecting after SCORING\n"
+              << "  -P plan    plays the PUTs of plan (from approx-solve -o), "
+              << "one after every answer, implies -a\n"
+              << "  -i script  sends the PUTs of script (lines like the input) "
+              << "instead of reading STDIN, one after every answer\n"
+              << "  -q         doesn't print STATE, which is long for a big K\n"
+              << "  -d delay   starts a connection attempt to the next address "
+              << "of the server every delay ms (default 250) until one connects\n"
+              << "  -s unix:path connects to the unix domain socket path, "
+              << "-p is not used then\n"
+              << "  -s shm:path  the same, but the messages go through shared memory\n"
+              << "  more than one session or game requires -a\n";
 }
 
 
 // Parses the arguments and checks if they're valid. If they're then
 // corresponding variables are set. If they're not then print an error
 // and exit with code 1.
-static void parse_args(int argc, char** argv, std::string& player_id,
-                       std::string& server, std::string& port, bool& force4,
-                       bool& force6, bool& auto_mode) {
+static void parse_args(int argc, char** argv, Options& opts) {
     int opt;
-    while ((opt = getopt(argc, argv, "u:s:p:46a")) != -1) {
+    while ((opt = getopt(argc, argv, "u:s:p:46aS:w:c:r:P:i:qd:")) != -1) {
         switch (opt) {
         case 'u':
-            player_id = optarg;
+            opts.player_ids.push_back(optarg);
             break;
         case 's':
-            server = optarg;
+            opts.server = optarg;
             break;
         case 'p':
-            port = optarg;
+            opts.port = optarg;
             break;
         case '4':
-            force4 = true;
+            opts.force4 = true;
             break;
         case '6':
-            force6 = true;
+            opts.force6 = true;
             break;
         case 'a':
-            auto_mode = true;
+            opts.auto_mode = true;
+            break;
+        case 'S':
+            if (!parse_heuristic(optarg, opts.heuristic)) {
+                usage(argv[0]);
+                fatal("unknown heuristic: %s", optarg);
+            }
+            break;
+        case 'w':
+            if (!parse_int(optarg, 1, 1000000, opts.window)) {
+                usage(argv[0]);
+                fatal("invalid window: %s", optarg);
+            }
+            break;
+        case 'c':
+            if (!parse_int(optarg, 1, 100000, opts.count)) {
+                usage(argv[0]);
+                fatal("invalid count: %s", optarg);
+            }
+            break;
+        case 'r':
+            if (!parse_int(optarg, 1, 1000000000, opts.games)) {
+                usage(argv[0]);
+                fatal("invalid number of games: %s", optarg);
+            }
+            break;
+        case 'P':
+            load_script(optarg, opts.plan);
+            opts.auto_mode = true;
+            break;
+        case 'i':
+            load_script(optarg, opts.script);
+            break;
+        case 'q':
+            opts.quiet = true;
+            break;
+        case 'd':
+            if (!parse_int(optarg, 0, 60000, opts.stagger_ms)) {
+                usage(argv[0]);
+                fatal("invalid delay: %s", optarg);
+            }
             break;
         default:
             usage(argv[0]);
             fatal("invalid argument");
         }
     }
-    if (server.empty()) {
+    if (opts.server.empty()) {
         usage(argv[0]);
         fatal("missing -s parameter");
     }
-    if (port.empty()) {
+    bool is_unix = opts.server.rfind(UNIX_PREFIX, 0) == 0 ||
+                   opts.server.rfind(SHM_PREFIX, 0) == 0;
+    if (opts.port.empty() && !is_unix) {
         usage(argv[0]);
         fatal("missing -p parameter");
     }
     // Port validation: must be a number in [1, 65535]
     char* endptr = nullptr;
-    long port_num = strtol(port.c_str(), &endptr, 10);
-    if (*endptr != '\0' || port_num < 1 || port_num > 65535) {
+    long port_num = strtol(opts.port.c_str(), &endptr, 10);
+    if (!is_unix && (*endptr != '\0' || port_num < 1 || port_num > 65535)) {
         usage(argv[0]);
         fatal("invalid port: must be an integer in [1, 65535]");
     }
-    if (!is_valid_player_id(player_id)) {
+    if (opts.player_ids.empty()) opts.player_ids.push_back("");
+    if (opts.count > 0) {
+        std::string base = opts.player_ids[0];
+        opts.player_ids.clear();
+        for (int i = 1; i <= opts.count; i++) {
+            opts.player_ids.push_back(base + std::to_string(i));
+        }
+    }
+    for (const std::string& player_id : opts.player_ids) {
+        if (!is_valid_player_id(player_id)) {
+            usage(argv[0]);
+            fatal("invalid player_id, it should contain only digits and letters");
+        }
+    }
+    if (opts.player_ids.size() > 1 && !opts.auto_mode) {
         usage(argv[0]);
-        fatal("invalid player_id, it should contain only digits and letters");
+        fatal("more than one session requires -a");
+    }
+    if (opts.games > 1 && !opts.auto_mode) {
+        usage(argv[0]);
+        fatal("more than one game requires -a");
+    }
+    if (!opts.script.empty() && opts.auto_mode) {
+        usage(argv[0]);
+        fatal("-i can't be used with -a or -P");
+    }
+}
+
+// Returns the port of the address ai.
+static int addr_port(const struct addrinfo* ai) {
+    if (ai->ai_family == AF_INET) {
+        return ntohs(((struct sockaddr_in*)ai->ai_addr)->sin_port);
+    } else if (ai->ai_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6*)ai->ai_addr)->sin6_port);
+    }
+    return 0;
+}
+
+// Returns the address of ai as "[ip]:port", or "unix:path" for unix
+// domain sockets.
+static std::string addr_name(const struct addrinfo* ai) {
+    if (ai->ai_family == AF_UNIX) return sockaddr_to_ip(ai->ai_addr);
+    return "[" + sockaddr_to_ip(ai->ai_addr) + "]:" + std::to_string(addr_port(ai));
+}
+
+// Delay between connection attempts, set by -d.
+static int stagger_ms = CONNECT_STAGGER_MS;
+
+// Connections made so far and the time they took to establish, in seconds.
+static size_t connects = 0;
+static double connect_secs = 0;
+
+// Prepares session s for a game on the connection sock_fd to winner, made
+// in secs seconds, and sends HELLO. A shared memory session is left
+// attaching instead, for attach_session once its socket is readable.
+static void begin_session(Session& s, int sock_fd, const struct addrinfo* winner,
+                          double secs) {
+    connects++;
+    connect_secs += secs;
+    std::cout << s.prefix << "Connected to " << addr_name(winner) << " in " <<
+                 secs * 1000 << " ms.\n";
+    session_reset(s, sock_fd);
+    if (s.use_shm) {
+        s.attaching = true;
+        return;
+    }
+    send_HELLO(s);
+}
+
+// Attaches the rings of the shared memory session s and sends HELLO.
+// Returns false if the game can't be played.
+static bool attach_session(Session& s) {
+    s.attaching = false;
+    if (!session_attach_shm(s)) return false;
+    send_HELLO(s);
+    return true;
+}
+
+// Connects session s to the server at one of the addresses ai and sends
+// HELLO. Exits on error.
+static void start_session(Session& s, struct addrinfo* ai) {
+    auto start = std::chrono::steady_clock::now();
+    const struct addrinfo* winner;
+    int sock_fd = connect_any(ai, stagger_ms, winner);
+    double secs = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+    begin_session(s, sock_fd, winner, secs);
+    if (s.attaching && !attach_session(s)) exit(1);
+}
+
+// Handles the messages that the server of session s sent. Prints the error
+// and returns false if the server disconnected or sent a bad message.
+static bool handle_server_data(Session& s, struct addrinfo* ai) {
+    if (!receive_data(s)) return false;
+    const char* msg;
+    size_t len;
+    while (!s.finished && receive_msg(s, msg, len)) {
+        if (!handle_message(s, msg, len)) {
+            errno = 0;
+            error("%sbad message from %s, %s: %.*s", s.prefix.c_str(),
+                  addr_name(ai).c_str(), s.player_id.c_str(), (int)len, msg);
+            s.failed = true;
+            return false;
+        }
     }
+    return true;
 }
 
 // Event loop representing play of the player that sends PUT
 // messages when inputted via STDIN.
-void input_play(int fd, std::vector <double>& coeffs,
-                std::vector <double>& state_vector, struct addrinfo* ai,
-                std::string& player_id) {
+void input_play(Session& s, struct addrinfo* ai) {
     struct pollfd poll_fds[2];
 
     poll_fds[0].fd = STDIN_FILENO;
     poll_fds[0].events = POLLIN;
-    
-    poll_fds[1].fd = fd;
-    poll_fds[1].events = POLLIN;
-    std::vector<std::pair<int, double>> pending_puts;
-    bool exit = false;
-    while (!exit) {
+
+    poll_fds[1].fd = s.fd;
+    while (!s.finished) {
         for (int i = 0; i < 2; i++) poll_fds[i].revents = 0;
+        poll_fds[1].events = session_events(s);
 
         int result = poll(poll_fds, 2, -1);
         if (result < 0) {
@@ -100,127 +279,220 @@ void input_play(int fd, std::vector <double>& coeffs,
                 int point;
                 double value;
                 if (get_input_from_stdin(point, value)) {
-                    if (coeffs.empty()) {
-                        pending_puts.push_back(std::make_pair(point, value));
+                    if (s.coeffs.empty()) {
+                        s.pending_puts.push_back(std::make_pair(point, value));
                     }
                     else {
-                        send_PUT(point, value, fd);
+                        send_PUT(s, point, value);
                     }
                 }
             }
-            if (poll_fds[1].revents & POLLIN) {
-                std::string msg = receive_msg(fd);
-                if (msg.empty()) continue;
-                if (!handle_message(msg, coeffs, false, state_vector, fd,
-                                    pending_puts, exit)) {
-                    int port = 0;
-                    if (ai->ai_family == AF_INET) {
-                        port = ntohs(((struct sockaddr_in*)ai->ai_addr)->sin_port);
-                    } else if (ai->ai_family == AF_INET6) {
-                        port = ntohs(((struct sockaddr_in6*)ai->ai_addr)->sin6_port);
-                    }
-                    fatal("bad message from [%s]:%d, %s: %s", sockaddr_to_ip(ai->ai_addr),
-                        port, player_id.c_str(), msg.c_str());
-                }
+            if ((poll_fds[1].revents & POLLIN) && !handle_server_data(s, ai)) {
+                exit(1);
             }
+            if (poll_fds[1].revents & (POLLIN | POLLOUT)) flush_output(s);
+        }
+    }
+    session_close(s);
+}
+
+// Event loop of the player that plays the script of -i. The first PUT is
+// sent after COEFF and every next one after the answer to the previous
+// one, so the server never answers with PENALTY for sending too early.
+void script_play(Session& s, struct addrinfo* ai, const Script& script) {
+    struct pollfd poll_fd = {s.fd, POLLIN, 0};
+    size_t sent = 0;
+    while (!s.finished) {
+        poll_fd.events = session_events(s);
+        if (poll(&poll_fd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            syserr("poll()");
+        }
+        if (!handle_server_data(s, ai)) exit(1);
+        if (poll_fd.revents & (POLLIN | POLLOUT)) flush_output(s);
+        if (!s.coeffs.empty() && sent < script.size() && s.answers == sent) {
+            send_script_PUT(s, script, sent++);
         }
     }
+    session_close(s);
 }
 
-// Event loop for a player with auto mode, which is automatic 
-// strategy for sending best PUT messages.
-void auto_play(int fd, std::vector <double>& coeffs,
-                std::vector <double>& state_vector, struct addrinfo* ai,
-                std::string& player_id) 
-{
-    struct pollfd poll_fd;
-    poll_fd.fd = fd;
-    poll_fd.events = POLLIN;
-    bool exit = false;
-    std::vector<std::pair<int, double>> pending_puts;
-
-    while (!exit) {
-        poll_fd.revents = 0;
-        int result = poll(&poll_fd, 1, -1);
+// Event loop for players with auto mode, which is automatic strategy
+// for sending best PUT messages. All sessions are played at once, each
+// of them plays the given number of games, reconnecting after SCORING.
+// The connections are made without blocking the loop. A session whose
+// connection can't be made or breaks before SCORING goes on with its next
+// game. Returns the number of games that failed that way.
+size_t auto_play(std::vector<Session>& sessions, struct addrinfo* ai, int games) {
+    using Clock = std::chrono::steady_clock;
+    std::vector<int> played(sessions.size(), 0);
+    std::vector<Clock::time_point> connect_start(sessions.size());
+    std::vector<struct pollfd> poll_fds;
+    // First descriptor of every session in poll_fds.
+    std::vector<size_t> first(sessions.size());
+    size_t active = sessions.size();
+    size_t failed = 0;
+
+    auto connect = [&](size_t i) {
+        sessions[i].fd = -1;
+        sessions[i].connecting = true;
+        connector_start(sessions[i].connector, ai, stagger_ms);
+        connect_start[i] = Clock::now();
+    };
+    // Ends the game of session i, and starts the next one if there is any.
+    auto next_game = [&](size_t i) {
+        Session& s = sessions[i];
+        if (s.fd >= 0) session_close(s);
+        if (s.failed || !s.finished) failed++;
+        if (++played[i] < games) {
+            connect(i);
+        } else {
+            active--;
+        }
+    };
+    for (size_t i = 0; i < sessions.size(); i++) connect(i);
+
+    while (active > 0) {
+        poll_fds.clear();
+        int timeout = -1;
+        for (size_t i = 0; i < sessions.size(); i++) {
+            Session& s = sessions[i];
+            first[i] = poll_fds.size();
+            if (s.connecting) {
+                int t = connector_timeout(s.connector);
+                if (t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+                poll_fds.insert(poll_fds.end(), s.connector.attempts.begin(),
+                                s.connector.attempts.end());
+            } else if (s.fd >= 0) {
+                poll_fds.push_back({s.fd, session_events(s), 0});
+            }
+        }
+        for (struct pollfd& p : poll_fds) p.revents = 0;
+        int result = poll(poll_fds.data(), poll_fds.size(), timeout);
         if (result < 0) {
+            if (errno == EINTR) continue;
             syserr("poll()");
         }
-        else if (result > 0) {
-            if (poll_fd.revents & POLLIN) {
-                std::string msg = receive_msg(fd);
-                if (msg.empty()) continue;
-                if (!handle_message(msg, coeffs, true, state_vector, fd,
-                                    pending_puts, exit)) {
-                    int port = 0;
-                    if (ai->ai_family == AF_INET) {
-                        port = ntohs(((struct sockaddr_in*)ai->ai_addr)->sin_port);
-                    } else if (ai->ai_family == AF_INET6) {
-                        port = ntohs(((struct sockaddr_in6*)ai->ai_addr)->sin6_port);
-                    }
-                    fatal("bad message from [%s]:%d, %s: %s", sockaddr_to_ip(ai->ai_addr),
-                        port, player_id.c_str(), msg.c_str());
+        for (size_t i = 0; i < sessions.size(); i++) {
+            Session& s = sessions[i];
+            if (s.connecting) {
+                std::vector<struct pollfd>& attempts = s.connector.attempts;
+                for (size_t a = 0; a < attempts.size(); a++) {
+                    attempts[a].revents = poll_fds[first[i] + a].revents;
+                }
+                int fd;
+                const struct addrinfo* winner;
+                if (!connector_step(s.connector, fd, winner)) {
+                    error("%scannot connect to the server", s.prefix.c_str());
+                    s.connecting = false;
+                    s.failed = true;
+                    next_game(i);
+                } else if (fd >= 0) {
+                    s.connecting = false;
+                    double secs = std::chrono::duration<double>(
+                                        Clock::now() - connect_start[i]).count();
+                    begin_session(s, fd, winner, secs);
                 }
+                continue;
+            }
+            short revents = s.fd >= 0 ? poll_fds[first[i]].revents : 0;
+            if (!(revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))) continue;
+            if (s.attaching) {
+                if (attach_session(s)) continue;
+                s.failed = true;
+            } else if (handle_server_data(s, ai) && !s.finished) {
+                if (revents & (POLLIN | POLLOUT)) flush_output(s);
+                continue;
             }
+            next_game(i);
         }
     }
+    return failed;
 }
 
 int main(int argc, char* argv[]) {
-    std::string player_id, server, port;
-    bool force4     = false;
-    bool force6     = false;
-    bool auto_mode  = false;
-    std::vector <double> coeffs;
-    std::vector <double> state_vector;
-
-    parse_args(argc, argv, player_id, server, port, force4, force6, auto_mode);
-    
+    Options opts;
+    parse_args(argc, argv, opts);
+
     struct addrinfo hints;
-    struct addrinfo *result;
+    struct addrinfo *result = nullptr;
+    // Address of the unix domain socket, given as an addrinfo so that the
+    // rest of the client doesn't care about the transport.
+    struct addrinfo unix_ai;
+    struct sockaddr_un unix_addr;
     memset(&hints, 0, sizeof hints);
     hints.ai_socktype = SOCK_STREAM;
-    if (force4 && !force6) {
+    if (opts.force4 && !opts.force6) {
         hints.ai_family = AF_INET;
     }
-    else if (!force4 && force6) {
+    else if (!opts.force4 && opts.force6) {
         hints.ai_family = AF_INET6;
     }
     else {
         hints.ai_family = AF_UNSPEC;
     }
-    int gai = getaddrinfo(server.c_str(), port.c_str(), &hints, &result);
-    if (gai != 0) {
-        fatal("getaddrinfo(%s): %s", server.c_str(), gai_strerror(gai));
+    struct addrinfo* ai;
+    bool use_shm = opts.server.rfind(SHM_PREFIX, 0) == 0;
+    if (use_shm || opts.server.rfind(UNIX_PREFIX, 0) == 0) {
+        std::string path = opts.server.substr(opts.server.find(':') + 1);
+        memset(&unix_ai, 0, sizeof unix_ai);
+        socklen_t len;
+        if (!make_unix_addr(path, unix_addr, len)) {
+            fatal("invalid unix socket path: %s", path.c_str());
+        }
+        unix_ai.ai_family = AF_UNIX;
+        unix_ai.ai_socktype = SOCK_STREAM;
+        unix_ai.ai_addr = (struct sockaddr*)&unix_addr;
+        unix_ai.ai_addrlen = len;
+        ai = &unix_ai;
+    } else {
+        int gai = getaddrinfo(opts.server.c_str(), opts.port.c_str(), &hints, &result);
+        if (gai != 0) {
+            fatal("getaddrinfo(%s): %s", opts.server.c_str(), gai_strerror(gai));
+        }
+        ai = result;
     }
-    struct addrinfo* ai = result;
+    signal(SIGPIPE, SIG_IGN);
+    stagger_ms = opts.stagger_ms;
 
-    int sock_fd = socket(ai->ai_family, ai->ai_socktype, 0);
-    if (sock_fd < 0) {
-        syserr("socket()");
+    std::vector<Session> sessions(opts.player_ids.size());
+    for (size_t i = 0; i < sessions.size(); i++) {
+        Session& s = sessions[i];
+        s.player_id = opts.player_ids[i];
+        if (sessions.size() > 1) s.prefix = "[" + s.player_id + "] ";
+        s.auto_mode = opts.auto_mode;
+        s.print_state = !opts.quiet;
+        s.use_shm = use_shm;
+        s.strategy.heuristic = opts.heuristic;
+        s.strategy.window = opts.window;
+        s.plan = opts.plan.empty() ? nullptr : &opts.plan;
+        s.fd = -1;
+        s.connecting = false;
+        if (!opts.auto_mode) start_session(s, ai);
     }
-    if (connect(sock_fd, ai->ai_addr, (socklen_t)ai->ai_addrlen) == -1) {
-        syserr("connect()");
+
+    size_t failed = 0;
+    if (opts.auto_mode) {
+        auto start = std::chrono::steady_clock::now();
+        failed = auto_play(sessions, ai, opts.games);
+        double secs = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start).count();
+        if (sessions.size() > 1 || opts.games > 1) {
+            size_t total = sessions.size() * (size_t)opts.games;
+            std::cout << "Played " << total << " games in " << secs << " s, " <<
+                        total * 60 / secs << " games per minute, " <<
+                        (connects ? connect_secs * 1000 / connects : 0) <<
+                        " ms to connect on average, " << failed << " failed.\n";
+        }
     }
-    int port_int = 0;
-    if (ai->ai_family == AF_INET) {
-        port_int = ntohs(((struct sockaddr_in*)ai->ai_addr)->sin_port);
-    } else if (ai->ai_family == AF_INET6) {
-        port_int = ntohs(((struct sockaddr_in6*)ai->ai_addr)->sin6_port);
+    else if (!opts.script.empty()) {
+        script_play(sessions[0], ai, opts.script);
+    }
+    else {
+        input_play(sessions[0], ai);
     }
-    std::cout << "Connected to [" << sockaddr_to_ip(ai->ai_addr) << "]:" << 
-                port_int << ".\n";
-    signal(SIGPIPE, SIG_IGN);
-
-    send_HELLO(player_id, sock_fd);
-    if (auto_mode) auto_play(sock_fd, coeffs, state_vector, ai, player_id);
-    else input_play(sock_fd, coeffs, state_vector, ai, player_id);
 
+    if (result) freeaddrinfo(result);
 
-    close(sock_fd);
-    freeaddrinfo(result);
-    
-    return 0;
+    return failed > 0 ? 1 : 0;
 }
-
-
-
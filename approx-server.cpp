@@ -5,16 +5,32 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <fstream>
+#include <sstream>
 #include <vector>
+#include <unordered_map>
 #include <poll.h>
 #include <chrono>
 #include <fcntl.h>
-#include <sstream>
+#include <csignal>
+#include <sys/un.h>
+#include <algorithm>
+#include <cerrno>
 
 
 #include "err.h" 
 #include "common.h"
 #include "server-utils.h"
+#include "server-stats.h"
+#include "rate-limit.h"
+#include "thread-pool.h"
+#include "shm-ring.h"
+#include "handoff.h"
+#include "cluster.h"
+#include "leaderboard.h"
+#include "spectator.h"
+#include "trace.h"
+#include "admin.h"
+#include "mem-account.h"
 
 
 using Clock     = std::chrono::steady_clock;
@@ -27,31 +43,880 @@ struct Client {
     TimePoint hello_deadline;      // Deadline for receiving HELLO message (for timeout).
     TimePoint next_action;         // Time when the next timer action should occur.
     TimerAction action = TimerAction::NONE; // What timer action (if any) is scheduled.
-    int last_bad_point;       // Point index for last BAD_PUT (for delayed response).
-    double last_bad_value;  // Value for last BAD_PUT (for delayed response).
     std::string ip;                // Client's IP address (for diagnostics).
     int port;                // Client's port number (for diagnostics).
+    bool parked = false;           // Accepted between games, waits for the next one.
+    short revents = 0;             // Events reported by the last poll().
+    bool ready = false;            // Used up its budget, has messages left to handle.
+    TimePoint ready_since;         // When the server noticed the messages being handled.
+    TimePoint state_due;           // When STATE would be sent without any queueing.
+    ClientClass cls = CLASS_NORMAL; // Class of the client for the statistics.
+    TokenBucket bucket{};          // Rate limit of the connection.
+    bool shedding = false;         // The last message was over the rate limit.
+    uint64_t coalesced = 0;        // Shed PUTs after the answered one, in a row.
+    // When the client last sent a message or got the answer it waited for.
+    TimePoint last_active;
+};
+
+// Connection of a finished game that is closed once its output is written.
+struct Closing {
+    int fd;
+    TimePoint deadline;            // The connection is closed at this time at the latest.
+    short revents = 0;             // Events reported by the last poll().
+};
+
+// Phase of the server: either a game is running or the server waits
+// for the pause between games to pass.
+enum class Phase { PLAYING, ROLLOVER };
+
+// Parameters of the next game, changed on the admin socket and applied
+// when it starts.
+struct NextGame {
+    int K, N, M;
+    std::string coeff_file;
+    bool generated;
+    uint64_t seed;
+    bool coeff_changed = false;    // The coefficient source is swapped.
 };
 
+// Everything the main loop knows about the server.
+struct Server {
+    int listen_fd;
+    int unix_fd = -1;              // Listener of the unix domain socket, if any.
+    std::string unix_path;
+    int shm_fd = -1;               // Listener of the shared memory transport, if any.
+    std::string shm_path;
+    int K, N, M;
+    int PUT_count = 0;             // Number of correct PUTs in the current game.
+    Phase phase = Phase::PLAYING;
+    TimePoint next_game;           // Start of the next game, valid in ROLLOVER.
+    std::vector<Client> clients;
+    std::vector<Closing> closing;
+    RateLimit conn_limit{};        // Rate limit of every connection.
+    RateLimit ip_limit{};          // Rate limit shared by connections from one IP.
+    ShedPolicy policy = ShedPolicy::DROP;
+    int threads = 2;               // Number of workers of the thread pool.
+    std::string coeff_file;
+    bool generated = false;        // The coefficients come from the generator.
+    uint64_t seed = 0;             // Seed of the generator.
+    int handoff_fd = -1;           // Listener for a new process taking over, if any.
+    std::string handoff_path;
+    std::string leaderboard_path;  // Files of the leaderboard, if any.
+    int spectator_port = -1;       // Port of the spectator stream, -1 without one.
+    std::string trace_path;        // File the trace is written to, if any.
+    std::string admin_path;        // Admin socket, if any.
+    NextGame next;
+    bool draining = false;         // No new players, exit after the game.
+    MemoryLimit mem_limit{};       // Limits of the memory, 0 for none.
+    TimePoint next_mem_check;      // When the memory is accounted next.
+    // State not allocated yet of the players after HELLO, in bytes. The
+    // engine allocates it with the first PUT.
+    size_t mem_reserved = 0;
+    int workers = 0;               // Worker processes of the cluster, 0 without one.
+    int coordinator_fd = -1;       // Socket to the coordinator, in a worker.
+    TimePoint next_health;         // When the worker reports its health next.
+    // Buckets of the source IPs, with the number of their connections.
+    std::unordered_map<std::string, std::pair<TokenBucket, int>> ip_buckets;
+};
+
+// Pause between two games.
+static constexpr auto GAME_PAUSE = std::chrono::seconds(1);
+
+// Time for HELLO after a player joins (or the game starts).
+static constexpr auto HELLO_TIMEOUT = std::chrono::microseconds(HELLO_TIMEOUT_US);
+
+// How often a worker of a cluster reports its health to the coordinator.
+static constexpr auto HEALTH_INTERVAL = std::chrono::seconds(1);
+
+// How often the memory of the connections is accounted, and how long a
+// client must be silent to be dropped when the heap is over the limit.
+static constexpr auto MEM_CHECK_INTERVAL = std::chrono::milliseconds(100);
+static constexpr auto MEM_IDLE = std::chrono::seconds(1);
+
+// Number of messages and bytes a client may have handled in one iteration
+// of the main loop. The rest waits for the next iteration, so one flooding
+// client can't delay the others and the timers.
+static constexpr int MSG_BUDGET = 16;
+static constexpr size_t BYTE_BUDGET = 4096;
+
+// Set by the SIGUSR1 handler, asks the main loop to print the statistics.
+static volatile sig_atomic_t stats_requested = 0;
+
+static void on_sigusr1(int) {
+    stats_requested = 1;
+}
+
+// Set by the SIGUSR2 handler, asks the main loop to start or stop tracing.
+static volatile sig_atomic_t trace_requested = 0;
+
+static void on_sigusr2(int) {
+    trace_requested = 1;
+}
+
+// Socket to the coordinator, for the hooks of a worker.
+static int coordinator_sock = -1;
+
+static void report_scoring(const SharedMsg& scoring) {
+    cluster_report_scoring(coordinator_sock, *scoring);
+}
+
+static void report_coeff(long offset, int skip) {
+    cluster_report_coeff(coordinator_sock, offset, skip);
+}
+
+// Forgets the bucket of ip once it has no connections.
+static void release_ip(Server& srv, const std::string& ip) {
+    auto it = srv.ip_buckets.find(ip);
+    if (it != srv.ip_buckets.end() && --it->second.second == 0) {
+        srv.ip_buckets.erase(it);
+    }
+}
+
+// Prints the number of penalties of c that were charged without an answer.
+static void report_coalesced(Client& c) {
+    if (c.coalesced == 0) return;
+    std::cout << "Coalesced " << c.coalesced << " shed PUTs of " <<
+                c.data.player_id << ".\n";
+    c.coalesced = 0;
+}
+
+// Closes the connection of the i-th client and forgets everything
+// about them, including their PUTs in this game.
+static void drop_client(Server& srv, size_t i) {
+    release_ip(srv, srv.clients[i].ip);
+    spectator_leave(srv.clients[i].fd);
+    close(srv.clients[i].fd);
+    srv.PUT_count -= srv.clients[i].data.PUT_count;
+    erase_player(srv.clients[i].fd);
+    srv.clients.erase(srv.clients.begin() + i);
+}
+
+// Closes the i-th connection of a finished game.
+static void finish_closing(Server& srv, size_t i) {
+    close(srv.closing[i].fd);
+    erase_player(srv.closing[i].fd);
+    srv.closing.erase(srv.closing.begin() + i);
+}
+
+// Sends the answer scheduled by the timer of c.
+static void fire_action(Client& c) {
+    TraceSpan span("fire_action", c.fd);
+    if (c.action == TimerAction::SEND_STATE) {
+        send_STATE(c.fd, c.data);
+    } else if (c.action == TimerAction::BAD_PUT) {
+        send_BAD_PUT(c.data.last_bad_point, c.data.last_bad_value, c.fd, c.data);
+    }
+    c.action = TimerAction::NONE;
+}
+
+// Ends the current game: answers the PUTs that are still waiting for their
+// timers, sends SCORING and hands the connections over to be closed once
+// their output is written. The next game starts after GAME_PAUSE.
+static void end_game(Server& srv, TimePoint now) {
+    TraceSpan span("end_game");
+    std::vector<int> fds;
+    std::vector<PlayerData> players;
+    for (Client& c : srv.clients) {
+        if (c.parked) continue;
+        report_coalesced(c);
+        fire_action(c);
+        fds.push_back(c.fd);
+        players.push_back(std::move(c.data));
+    }
+    send_SCORING(fds, std::move(players));
+
+    std::vector<Client> parked;
+    for (Client& c : srv.clients) {
+        if (c.parked) {
+            parked.push_back(std::move(c));
+        } else {
+            release_ip(srv, c.ip);
+            shutdown(c.fd, SHUT_RD);
+            srv.closing.push_back({c.fd, now + GAME_PAUSE});
+        }
+    }
+    srv.clients = std::move(parked);
+    srv.PUT_count = 0;
+    srv.phase = Phase::ROLLOVER;
+    srv.next_game = now + GAME_PAUSE;
+}
+
+// Reads the degree of the polynomials of coeff_file from its first row to
+// N. Returns false with the reason in why if it has no valid row.
+static bool coeff_file_degree(const std::string& coeff_file, int& N, std::string& why) {
+    std::ifstream in(coeff_file);
+    std::string line;
+    if (!in || !std::getline(in, line)) {
+        why = "cannot read coefficient file " + coeff_file;
+        return false;
+    }
+    std::istringstream iss(line);
+    std::string command, coeff;
+    int count = 0;
+    iss >> command;
+    while (iss >> coeff) count++;
+    if (command != "COEFF" || count < 2 || count > 9) {
+        why = coeff_file + " has no rows of coefficients";
+        return false;
+    }
+    N = count - 1;
+    return true;
+}
+
+// Applies the changes asked for on the admin socket, between two games.
+static void apply_next_game(Server& srv) {
+    NextGame& next = srv.next;
+    // N and the coefficient file may be changed in any order, so they are
+    // checked together once the game starts.
+    bool file = next.coeff_changed ? !next.generated : !srv.generated;
+    int degree;
+    std::string why;
+    if (file && (next.coeff_changed || next.N != srv.N)) {
+        if (!coeff_file_degree(next.coeff_file, degree, why)) {
+            degree = -1;
+        } else if (degree != next.N) {
+            why = next.coeff_file + " has polynomials of degree " + std::to_string(degree) +
+                  ", not " + std::to_string(next.N);
+        }
+        if (degree != next.N) {
+            error("%s, keeping N and the coefficients of the last game", why.c_str());
+            next.coeff_changed = false;
+            next.coeff_file = srv.coeff_file;
+            next.generated = srv.generated;
+            next.seed = srv.seed;
+            next.N = srv.N;
+        }
+    }
+    if (next.coeff_changed) {
+        next.coeff_changed = false;
+        if (next.generated) {
+            close_coeff_file();
+            use_coeff_generator(next.seed);
+        } else if (!switch_coeff_file(next.coeff_file)) {
+            error("cannot open coefficient file: %s, keeping the old one",
+                  next.coeff_file.c_str());
+            next.coeff_file = srv.coeff_file;
+            next.generated = srv.generated;
+            next.seed = srv.seed;
+            // The rows of the old file have the old N.
+            next.N = srv.N;
+        }
+        srv.coeff_file = next.coeff_file;
+        srv.generated = next.generated;
+        srv.seed = next.seed;
+    }
+    if (next.K != srv.K || next.N != srv.N || next.M != srv.M) {
+        std::cout << "Next game with K " << next.K << ", N " << next.N <<
+                     ", M " << next.M << ".\n";
+    }
+    srv.K = next.K;
+    srv.N = next.N;
+    srv.M = next.M;
+}
+
+// Starts a new game with the players that connected during the pause.
+static void start_game(Server& srv, TimePoint now) {
+    srv.phase = Phase::PLAYING;
+    apply_next_game(srv);
+    spectator_game(srv.K, srv.N, srv.M);
+    for (Client& c : srv.clients) {
+        c.parked = false;
+        c.hello_deadline = now + HELLO_TIMEOUT;
+    }
+}
+
+// Accepts a pending connection on the listening socket listen_fd, if
+// there is one. In a worker of a cluster listen_fd is the socket to the
+// coordinator, which passes the connections it accepted.
+static void accept_client(Server& srv, int listen_fd) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char tag = 0;
+    int new_fd;
+    if (listen_fd == srv.coordinator_fd) {
+        if (!cluster_receive(listen_fd, new_fd, tag)) {
+            std::cout << "The coordinator is gone, exiting.\n";
+            std::cout.flush();
+            _exit(0);
+        }
+        if (new_fd < 0 || getpeername(new_fd, (struct sockaddr*)&addr, &addrlen) < 0) {
+            if (new_fd >= 0) close(new_fd);
+            return;
+        }
+    } else {
+        new_fd = accept(listen_fd, (struct sockaddr*)&addr, &addrlen);
+    }
+    if (new_fd < 0) return;
+    // Set new client socket to non-blocking.
+    fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL, 0) | O_NONBLOCK);
+    Client nc;
+    nc.fd = new_fd;
+    nc.hello_deadline = Clock::now() + HELLO_TIMEOUT;
+    nc.last_active = Clock::now();
+    nc.ip = sockaddr_to_ip((struct sockaddr*)&addr);
+    nc.port = 0;
+    if (addr.ss_family == AF_UNIX) {
+        // Peers of a unix socket have no address, all of them share the
+        // path of the listener.
+        nc.ip = UNIX_PREFIX + srv.unix_path;
+    } else if (addr.ss_family == AF_INET) {
+        nc.port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        nc.port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+    }
+    nc.data = add_player(new_fd);
+    if (listen_fd == srv.shm_fd || tag == FROM_SHM) {
+        nc.ip = SHM_PREFIX + srv.shm_path;
+        if (!attach_shm(new_fd)) {
+            error("cannot set up shared memory for a new client");
+            erase_player(new_fd);
+            close(new_fd);
+            return;
+        }
+    }
+    srv.ip_buckets[nc.ip].second++;
+    // Players that come between games wait for the next one, their
+    // HELLO timeout starts with the game.
+    if (srv.phase == Phase::ROLLOVER) {
+        nc.parked = true;
+        server_stats.players_parked++;
+    }
+    srv.clients.push_back(nc);
+    std::cout << "New client [" << nc.ip << "]:" << nc.port << ".\n";
+}
+
+// Checks the rate limits of c for the message msg received at time now.
+// Returns true if the message should be handled, otherwise sheds it
+// according to the policy of the server and sets erase if c should be
+// disconnected. Shed messages are not parsed, except for the PENALTY
+// that starts a row of coalesced ones.
+static bool admit_msg(Server& srv, Client& c, const std::string& msg,
+                      TimePoint now, bool& erase) {
+    // A token is taken only from both buckets, a message that one of them
+    // sheds costs the other nothing.
+    TokenBucket& ip_bucket = srv.ip_buckets[c.ip].first;
+    bool conn_ready = bucket_ready(c.bucket, srv.conn_limit, now);
+    if (bucket_ready(ip_bucket, srv.ip_limit, now) && conn_ready) {
+        bucket_take(c.bucket, srv.conn_limit);
+        bucket_take(ip_bucket, srv.ip_limit);
+        if (c.shedding) report_coalesced(c);
+        c.shedding = false;
+        return true;
+    }
+    switch (srv.policy) {
+    case ShedPolicy::DROP:
+        server_stats.shed_dropped++;
+        break;
+    case ShedPolicy::COALESCE:
+        if (msg.compare(0, 4, "PUT ") != 0 || !c.data.after_HELLO) {
+            server_stats.shed_dropped++;
+        } else if (!c.shedding) {
+            if (!send_shed_PENALTY(msg, c.data, c.fd)) {
+                server_stats.shed_dropped++;
+            }
+        } else {
+            c.coalesced++;
+            server_stats.shed_coalesced++;
+        }
+        break;
+    case ShedPolicy::DISCONNECT:
+        server_stats.shed_disconnects++;
+        error("rate limit exceeded by [%s]:%d, disconnecting", c.ip.c_str(),
+              c.port);
+        erase = true;
+        break;
+    }
+    c.shedding = true;
+    return false;
+}
+
+// Returns the bytes a player allocates after HELLO.
+static size_t player_bytes(const Server& srv) {
+    return (size_t)(srv.K + srv.N + 2) * sizeof(int64_t);
+}
+
+// Checks if the heap has room for the player of c, if msg is their HELLO.
+// The room is reserved only once the HELLO is accepted. Returns false if
+// c should be disconnected.
+static bool admit_hello(Server& srv, Client& c, const std::string& msg) {
+    if (srv.mem_limit.total == 0 || c.data.after_HELLO ||
+        msg.compare(0, 6, "HELLO ") != 0) {
+        return true;
+    }
+    if (heap_bytes() + srv.mem_reserved + player_bytes(srv) <= srv.mem_limit.total) {
+        return true;
+    }
+    server_stats.mem_hello_refused++;
+    error("memory limit reached, refusing HELLO from [%s]:%d", c.ip.c_str(), c.port);
+    return false;
+}
+
+// Accounts the memory of the connections. Drops the ones over the limit of
+// a connection and, while the heap is over the total limit, the heaviest
+// of the clients that were silent for MEM_IDLE. A client waiting for the
+// answer to its PUT isn't idle.
+static void check_memory(Server& srv, TimePoint now) {
+    std::vector<std::pair<size_t, size_t>> idle;
+    std::vector<size_t> shed;
+    uint64_t total = 0, game = 0, max = 0;
+    srv.mem_reserved = 0;
+    for (size_t i = 0; i < srv.clients.size(); ++i) {
+        const Client& c = srv.clients[i];
+        if (c.data.after_HELLO && c.data.state.empty()) {
+            srv.mem_reserved += player_bytes(srv);
+        }
+        size_t bytes = connection_bytes(c.fd, c.data);
+        total += bytes;
+        if (!c.parked) game += bytes;
+        max = std::max<uint64_t>(max, bytes);
+        if (srv.mem_limit.connection > 0 && bytes > srv.mem_limit.connection) {
+            shed.push_back(i);
+        } else if (c.action == TimerAction::NONE && now - c.last_active >= MEM_IDLE) {
+            idle.push_back({bytes, i});
+        }
+    }
+    server_stats.mem_connections_bytes = total;
+    server_stats.mem_game_bytes = game;
+    server_stats.mem_connection_max_bytes = max;
+    size_t heap = heap_bytes();
+    if (srv.mem_limit.total > 0 && heap > srv.mem_limit.total) {
+        std::sort(idle.rbegin(), idle.rend());
+        size_t excess = heap - srv.mem_limit.total;
+        for (size_t j = 0; j < idle.size() && excess > 0; j++) {
+            shed.push_back(idle[j].second);
+            excess -= std::min(excess, idle[j].first);
+        }
+    }
+    // Dropping a client moves the ones after it.
+    std::sort(shed.rbegin(), shed.rend());
+    for (size_t i : shed) {
+        const Client& c = srv.clients[i];
+        error("memory limit reached, dropping [%s]:%d, %s holding %zu bytes",
+              c.ip.c_str(), c.port, c.data.player_id.c_str(),
+              connection_bytes(c.fd, c.data));
+        server_stats.mem_shed++;
+        drop_client(srv, i);
+    }
+}
+
+// Handles a message msg received from the client c.
+static void handle_client_msg(Server& srv, Client& c, const std::string& msg) {
+    TimerAction timer = TimerAction::NONE;
+    if (handle_message(msg, c.data, c.fd, timer, c.ip, c.port, srv.K,
+                       srv.PUT_count, srv.N)) {
+        if (timer == TimerAction::SEND_STATE) {
+            auto delay = std::chrono::microseconds(rules_state_delay_us(c.data.player_id));
+            c.action = TimerAction::SEND_STATE;
+            c.next_action = Clock::now() + delay;
+            c.state_due = c.ready_since + delay;
+        } else if (timer == TimerAction::BAD_PUT) {
+            c.action = TimerAction::BAD_PUT;
+            c.next_action = Clock::now() + std::chrono::microseconds(BAD_PUT_DELAY_US);
+        } else {
+            c.action = TimerAction::NONE;
+        }
+    } else {
+        if (c.data.player_id.empty()) c.data.player_id = "UNKNOWN";
+        error("bad message from [%s]:%d, %s: %s", c.ip.c_str(), c.port, 
+                c.data.player_id.c_str(), msg.c_str());
+    }
+}
+
+// Runs the timers that expired before now.
+static void handle_timers(Server& srv, TimePoint now) {
+    TraceSpan span("handle_timers");
+    if (srv.coordinator_fd >= 0 && now >= srv.next_health) {
+        cluster_report_health(srv.coordinator_fd, srv.clients.size(), server_stats.games);
+        srv.next_health = now + HEALTH_INTERVAL;
+    }
+    if (srv.phase == Phase::ROLLOVER && now >= srv.next_game) {
+        start_game(srv, now);
+    }
+    if (now >= srv.next_mem_check) {
+        check_memory(srv, now);
+        srv.next_mem_check = now + MEM_CHECK_INTERVAL;
+    }
+    for (size_t i = 0; i < srv.closing.size(); ++i) {
+        // A connection waiting for SCORING stays until it is written.
+        if (now >= srv.closing[i].deadline && !has_placeholder(srv.closing[i].fd)) {
+            finish_closing(srv, i);
+            --i;
+        }
+    }
+    for (size_t i = 0; i < srv.clients.size(); ++i) {
+        Client &c = srv.clients[i];
+        if (c.parked) continue;
+        if (!c.data.after_HELLO && now >= c.hello_deadline) {
+            drop_client(srv, i);
+            --i;
+            continue;
+        }
+        if (c.action != TimerAction::NONE && now >= c.next_action) {
+            if (c.action == TimerAction::SEND_STATE) {
+                latency_record(server_stats.state_lateness[c.cls],
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        now - c.state_due).count());
+            }
+            fire_action(c);
+            c.last_active = now;
+        }
+    }
+}
+
+// Returns the time of the earliest pending timer.
+static TimePoint nearest_timer(const Server& srv, TimePoint now) {
+    auto nearest = now + std::chrono::hours(24);
+    if (srv.phase == Phase::ROLLOVER)
+        nearest = std::min(nearest, srv.next_game);
+    if (srv.coordinator_fd >= 0)
+        nearest = std::min(nearest, srv.next_health);
+    if (srv.mem_limit.total > 0 || srv.mem_limit.connection > 0)
+        nearest = std::min(nearest, srv.next_mem_check);
+    for (auto &c : srv.closing) {
+        if (!has_placeholder(c.fd)) nearest = std::min(nearest, c.deadline);
+    }
+    for (auto &c : srv.clients) {
+        if (c.parked) continue;
+        if (!c.data.after_HELLO)
+            nearest = std::min(nearest, c.hello_deadline);
+        if (c.action != TimerAction::NONE)
+            nearest = std::min(nearest, c.next_action);
+    }
+    return nearest;
+}
+
+// Version of the snapshot passed to a new process.
+static const char SNAPSHOT_VERSION[] = "approx-server-snapshot-3";
+
+// Converts a time point to nanoseconds and back. The steady clock is the
+// same for every process on the machine, so time points can be passed on.
+static int64_t to_ns(TimePoint t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                t.time_since_epoch()).count();
+}
+
+static TimePoint from_ns(int64_t ns) {
+    return TimePoint(std::chrono::duration_cast<Clock::duration>(
+                std::chrono::nanoseconds(ns)));
+}
+
+// Writes the buffers of the connection fd to w and adds its descriptors
+// to fds.
+static void snapshot_buffers(int fd, SnapshotWriter& w, std::vector<int>& fds) {
+    std::string input, output;
+    int shm_fd;
+    export_buffer(fd, input, output, shm_fd);
+    fds.push_back(fd);
+    if (shm_fd >= 0) fds.push_back(shm_fd);
+    snap_put_str(w, input);
+    snap_put_str(w, output);
+    snap_put_int(w, shm_fd >= 0);
+}
+
+// Writes the state of the server to w and collects the descriptors that
+// go with it in fds, in the order they are written.
+static void snapshot_server(const Server& srv, SnapshotWriter& w,
+                            std::vector<int>& fds) {
+    snap_put_str(w, SNAPSHOT_VERSION);
+    snap_put_int(w, srv.K);
+    snap_put_int(w, srv.N);
+    snap_put_int(w, srv.M);
+    snap_put_int(w, srv.PUT_count);
+    snap_put_int(w, srv.phase == Phase::ROLLOVER);
+    snap_put_int(w, to_ns(srv.next_game));
+    snap_put_str(w, srv.coeff_file);
+    snap_put_int(w, srv.generated);
+    snap_put_int(w, (int64_t)srv.seed);
+    snap_put_int(w, coeff_file_offset());
+    fds.push_back(srv.listen_fd);
+    snap_put_str(w, srv.unix_fd >= 0 ? srv.unix_path : "");
+    if (srv.unix_fd >= 0) fds.push_back(srv.unix_fd);
+    snap_put_str(w, srv.shm_fd >= 0 ? srv.shm_path : "");
+    if (srv.shm_fd >= 0) fds.push_back(srv.shm_fd);
+
+    snap_put_int(w, srv.clients.size());
+    for (const Client& c : srv.clients) {
+        const PlayerData& p = c.data;
+        snap_put_str(w, p.player_id);
+        snap_put_int(w, p.coeffs.size());
+        for (int64_t x : p.coeffs) snap_put_int(w, x);
+        snap_put_int(w, p.state.size());
+        for (int64_t x : p.state) snap_put_int(w, x);
+        snap_put_int(w, p.result);
+        snap_put_int(w, p.after_HELLO);
+        snap_put_int(w, p.PUT_count);
+        snap_put_int(w, p.received_PUT_answer);
+        snap_put_int(w, p.last_bad_point);
+        snap_put_int(w, p.last_bad_value);
+        snap_put_int(w, to_ns(c.hello_deadline));
+        snap_put_int(w, to_ns(c.next_action));
+        snap_put_int(w, (int)c.action);
+        snap_put_str(w, c.ip);
+        snap_put_int(w, c.port);
+        snap_put_int(w, c.parked);
+        snap_put_int(w, c.ready);
+        snap_put_int(w, to_ns(c.ready_since));
+        snap_put_int(w, to_ns(c.state_due));
+        snap_put_int(w, c.cls);
+        snap_put_int(w, (int64_t)(c.bucket.tokens * 1e6));
+        snap_put_int(w, to_ns(c.bucket.last));
+        snap_put_int(w, c.bucket.started);
+        snap_put_int(w, c.shedding);
+        snap_put_int(w, c.coalesced);
+        snapshot_buffers(c.fd, w, fds);
+    }
+    // The buckets of the addresses, their counts follow from the clients.
+    snap_put_int(w, srv.ip_buckets.size());
+    for (const auto& entry : srv.ip_buckets) {
+        const TokenBucket& b = entry.second.first;
+        snap_put_str(w, entry.first);
+        snap_put_int(w, (int64_t)(b.tokens * 1e6));
+        snap_put_int(w, to_ns(b.last));
+        snap_put_int(w, b.started);
+    }
+    snap_put_int(w, srv.closing.size());
+    for (const Closing& c : srv.closing) {
+        snap_put_int(w, to_ns(c.deadline));
+        snapshot_buffers(c.fd, w, fds);
+    }
+}
+
+// Takes the next descriptor passed with the snapshot.
+static int next_fd(const std::vector<int>& fds, size_t& used, SnapshotReader& r) {
+    if (used == fds.size()) {
+        r.ok = false;
+        return -1;
+    }
+    return fds[used++];
+}
+
+// Restores the buffers of a connection written by snapshot_buffers.
+// Returns its descriptor.
+static int restore_buffers(const std::vector<int>& fds, size_t& used,
+                           SnapshotReader& r) {
+    int fd = next_fd(fds, used, r);
+    std::string input = snap_str(r);
+    std::string output = snap_str(r);
+    int shm_fd = snap_int(r) ? next_fd(fds, used, r) : -1;
+    if (!r.ok) return -1;
+    add_player(fd);
+    if (!import_buffer(fd, input, output, shm_fd)) r.ok = false;
+    return fd;
+}
+
+// Restores the state of the server written by snapshot_server.
+// Returns false if the snapshot is invalid.
+static bool restore_server(Server& srv, const std::vector<int>& fds,
+                           const std::string& snapshot) {
+    SnapshotReader r{&snapshot, 0, true};
+    size_t used = 0;
+    if (snap_str(r) != SNAPSHOT_VERSION) return false;
+    srv.K = snap_int(r);
+    srv.N = snap_int(r);
+    srv.M = snap_int(r);
+    srv.PUT_count = snap_int(r);
+    srv.phase = snap_int(r) ? Phase::ROLLOVER : Phase::PLAYING;
+    srv.next_game = from_ns(snap_int(r));
+    srv.coeff_file = snap_str(r);
+    srv.generated = snap_int(r);
+    srv.seed = (uint64_t)snap_int(r);
+    long offset = snap_int(r);
+    if (!r.ok) return false;
+    if (srv.generated) use_coeff_generator(srv.seed);
+    else open_coeff_file(srv.coeff_file);
+    seek_coeff_file(offset);
+    srv.listen_fd = next_fd(fds, used, r);
+    srv.unix_path = snap_str(r);
+    if (!srv.unix_path.empty()) srv.unix_fd = next_fd(fds, used, r);
+    srv.shm_path = snap_str(r);
+    if (!srv.shm_path.empty()) srv.shm_fd = next_fd(fds, used, r);
+
+    size_t clients = snap_int(r);
+    for (size_t i = 0; i < clients && r.ok; i++) {
+        Client c;
+        PlayerData& p = c.data;
+        p.player_id = snap_str(r);
+        p.coeffs.resize(std::min<size_t>(snap_int(r), snapshot.size()));
+        for (int64_t& x : p.coeffs) x = snap_int(r);
+        p.state.resize(std::min<size_t>(snap_int(r), snapshot.size()));
+        for (int64_t& x : p.state) x = snap_int(r);
+        p.result = snap_int(r);
+        p.after_HELLO = snap_int(r);
+        p.PUT_count = snap_int(r);
+        p.received_PUT_answer = snap_int(r);
+        p.last_bad_point = snap_int(r);
+        p.last_bad_value = snap_int(r);
+        c.hello_deadline = from_ns(snap_int(r));
+        c.next_action = from_ns(snap_int(r));
+        c.action = (TimerAction)snap_int(r);
+        c.ip = snap_str(r);
+        c.port = snap_int(r);
+        c.parked = snap_int(r);
+        c.ready = snap_int(r);
+        c.ready_since = from_ns(snap_int(r));
+        c.state_due = from_ns(snap_int(r));
+        c.cls = snap_int(r) == CLASS_HEAVY ? CLASS_HEAVY : CLASS_NORMAL;
+        c.bucket.tokens = snap_int(r) / 1e6;
+        c.bucket.last = from_ns(snap_int(r));
+        c.bucket.started = snap_int(r);
+        c.shedding = snap_int(r);
+        c.coalesced = snap_int(r);
+        c.fd = restore_buffers(fds, used, r);
+        srv.ip_buckets[c.ip].second++;
+        srv.clients.push_back(std::move(c));
+    }
+    size_t buckets = snap_int(r);
+    for (size_t i = 0; i < buckets && r.ok; i++) {
+        std::string ip = snap_str(r);
+        TokenBucket b;
+        b.tokens = snap_int(r) / 1e6;
+        b.last = from_ns(snap_int(r));
+        b.started = snap_int(r);
+        auto it = srv.ip_buckets.find(ip);
+        if (it != srv.ip_buckets.end()) it->second.first = b;
+    }
+    size_t closing = snap_int(r);
+    for (size_t i = 0; i < closing && r.ok; i++) {
+        Closing c;
+        c.deadline = from_ns(snap_int(r));
+        c.fd = restore_buffers(fds, used, r);
+        srv.closing.push_back(c);
+    }
+    return r.ok && used == fds.size();
+}
+
+// Waits until the thread pool has finished every message that is
+// still queued as a placeholder.
+static void wait_for_pool(Server& srv) {
+    while (true) {
+        bool waiting = false;
+        for (const Client& c : srv.clients) waiting |= has_placeholder(c.fd);
+        for (const Closing& c : srv.closing) waiting |= has_placeholder(c.fd);
+        if (!waiting) return;
+        struct pollfd pfd = {pool_event_fd(), POLLIN, 0};
+        poll(&pfd, 1, -1);
+        pool_run_completions();
+    }
+}
+
+// Hands the server over to a new process that connected to the handoff
+// socket: the listening sockets, every connection and the state of the
+// game. Exits once the new process confirmed it; if anything fails the
+// server carries on.
+static void hand_off(Server& srv) {
+    int sock = accept(srv.handoff_fd, nullptr, nullptr);
+    if (sock < 0) return;
+    auto begin = Clock::now();
+    wait_for_pool(srv);
+    // The new process recovers the leaderboard from the files.
+    leaderboard_flush();
+    SnapshotWriter w;
+    std::vector<int> fds;
+    snap_put_int(w, to_ns(begin));
+    snapshot_server(srv, w, fds);
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+    if (!handoff_send(sock, fds, w.data)) {
+        error("handoff to a new process failed, carrying on");
+        close(sock);
+        return;
+    }
+    std::cout << "Handed off " << srv.clients.size() << " clients to a new process.\n";
+    std::cout.flush();
+    // The workers of the pool are still around, so the process ends
+    // without running destructors.
+    _exit(0);
+}
+
+// Takes the server over from the old process listening on the handoff
+// socket path.
+static void take_over(Server& srv, const std::string& path) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    if (!make_unix_addr(path, addr, len)) fatal("invalid handoff path: %s", path.c_str());
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) syserr("socket()");
+    if (connect(sock, (struct sockaddr*)&addr, len) < 0) {
+        syserr("connect to the old process at %s", path.c_str());
+    }
+    std::vector<int> fds;
+    std::string snapshot;
+    if (!handoff_receive(sock, fds, snapshot)) {
+        fatal("cannot receive the state of the old process");
+    }
+    // The snapshot starts with the time the old process stopped serving.
+    size_t space = snapshot.find(' ');
+    TimePoint stopped = from_ns(atoll(snapshot.c_str()));
+    if (space == std::string::npos ||
+        !restore_server(srv, fds, snapshot.substr(space + 1))) {
+        fatal("invalid snapshot from the old process");
+    }
+    handoff_confirm(sock);
+    close(sock);
+    int64_t pause = std::chrono::duration_cast<std::chrono::microseconds>(
+                        Clock::now() - stopped).count();
+    server_stats.handoff_pause_us = pause;
+    std::cout << "Took over " << srv.clients.size() << " clients and " <<
+                srv.closing.size() << " closing connections, paused for " <<
+                pause << " us.\n";
+}
+
 // Prints the usage of the program.
 void usage(const char* prog) {
     std::cerr << "Usage: " << prog
-              << " [-p port] [-k K] [-n N] [-m M] -f coeff_file\n"
+              << " [-p port] [-k K] [-n N] [-m M] [-r rate[/burst]] "
+              << "[-R rate[/burst]] [-x policy] [-t threads] [-u path] "
+              << "[-S path] [-H path] [-T path] [-c workers] [-L path] [-o port] [-D path] [-A path] "
+              << "[-Q bytes[/bytes]] "
+              << "-f coeff_file | -g seed\n"
               << "  -p port    server port (0–65535), default 0\n"
               << "  -k K       max point K (1–10000), default 100\n"
               << "  -n N       poly degree N (1–8), default 4\n"
               << "  -m M       max PUTs M (1–12341234), default 131\n"
-              << "  -f file    coeffs file (required)\n";
+              << "  -f file    coeffs file (required unless -g is given)\n"
+              << "  -g seed    generate the coefficients from seed (0–2^64-1) "
+              << "instead of reading a file\n"
+              << "  -r limit   messages per second of a connection, default 0 (no limit)\n"
+              << "  -R limit   messages per second of all connections from one IP, "
+              << "default 0 (no limit)\n"
+              << "  -x policy  what to do with messages over the limit: "
+              << "drop (default), coalesce or disconnect\n"
+              << "  -t threads workers for scoring and long STATEs (0–256), "
+              << "default 2, 0 does everything in the main loop\n"
+              << "  -u path    also listen on the unix domain socket path\n"
+              << "  -S path    also accept shared memory clients on the unix "
+              << "domain socket path\n"
+              << "  -H path    hand the server over to a new process that "
+              << "connects to the unix domain socket path\n"
+              << "  -T path    take over from the old process with -H path, "
+              << "the game and sockets come from it (-p, -k, -n, -m, -f, -u "
+              << "and -S are ignored)\n"
+              << "  -c workers run the games in workers processes (1–64), this "
+              << "process passes them the players\n"
+              << "  -L path    keep a leaderboard of all games in the files path "
+              << "and path.idx\n"
+              << "  -o port    stream the games to read-only spectators "
+              << "connecting to port\n"
+              << "  -D path    SIGUSR2 starts tracing the server, the next one "
+              << "writes the trace to path (Chrome trace format)\n"
+              << "  -A path    accept admin commands on the unix socket path, "
+              << "they change the next games without a restart\n"
+              << "  -Q limit[/per_connection]  refuse HELLOs and drop the heaviest "
+              << "idle clients while the heap is over limit, drop a client holding "
+              << "over per_connection (sizes with K, M or G)\n";
 }
 
 
 // Parses the arguments and checks if they're valid. If they're then
 // corresponding variables are set. If they're not then print an error
 // and exit with code 1.
-void parse_args(int& port, int& K, int& N, int& M, std::string& coeff_file,
-                int argc, char** argv) {
+void parse_args(int& port, Server& srv, std::string& coeff_file,
+                std::string& take_over_path, int argc, char** argv) {
+    int& K = srv.K;
+    int& N = srv.N;
+    int& M = srv.M;
     int opt;
-    while ((opt = getopt(argc, argv, "p:k:n:m:f:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:k:n:m:f:g:r:R:x:t:u:S:H:T:c:L:o:D:A:Q:")) != -1) {
         switch (opt) {
         case 'p':
             if (!parse_int(optarg, 0, 65535, port)) {
@@ -76,11 +941,92 @@ void parse_args(int& port, int& K, int& N, int& M, std::string& coeff_file,
         case 'f':
             coeff_file = optarg;
             break;
+        case 'g':
+            if (!parse_uint64(optarg, srv.seed)) fatal("invalid seed: %s", optarg);
+            srv.generated = true;
+            break;
+        case 'r':
+            if (!parse_rate_limit(optarg, srv.conn_limit)) {
+                fatal("invalid rate limit: %s", optarg);
+            }
+            break;
+        case 'R':
+            if (!parse_rate_limit(optarg, srv.ip_limit)) {
+                fatal("invalid rate limit: %s", optarg);
+            }
+            break;
+        case 'x':
+            if (!parse_shed_policy(optarg, srv.policy)) {
+                fatal("invalid policy: %s", optarg);
+            }
+            break;
+        case 'u':
+            srv.unix_path = optarg;
+            break;
+        case 'S':
+            srv.shm_path = optarg;
+            break;
+        case 'H':
+            srv.handoff_path = optarg;
+            break;
+        case 'T':
+            take_over_path = optarg;
+            break;
+        case 'L':
+            srv.leaderboard_path = optarg;
+            break;
+        case 'D':
+            srv.trace_path = optarg;
+            break;
+        case 'A':
+            srv.admin_path = optarg;
+            break;
+        case 'Q':
+            if (!parse_memory_limit(optarg, srv.mem_limit)) {
+                fatal("invalid memory limit: %s", optarg);
+            }
+            break;
+        case 'o':
+            if (!parse_int(optarg, 0, 65535, srv.spectator_port)) {
+                fatal("invalid spectator port: %s", optarg);
+            }
+            break;
+        case 't':
+            if (!parse_int(optarg, 0, 256, srv.threads)) {
+                fatal("invalid number of threads: %s", optarg);
+            }
+            break;
+        case 'c':
+            if (!parse_int(optarg, 1, 64, srv.workers)) {
+                fatal("invalid number of workers: %s", optarg);
+            }
+            break;
         default:
             usage(argv[0]);
             fatal("invalid argument");
         }
     }
+    if (srv.workers > 0 && (!take_over_path.empty() || !srv.handoff_path.empty())) {
+        usage(argv[0]);
+        fatal("-c can't be used with -H or -T");
+    }
+    if (srv.spectator_port >= 0 && (srv.workers > 0 || !take_over_path.empty())) {
+        usage(argv[0]);
+        fatal("-o can't be used with -c or -T");
+    }
+    if (!srv.admin_path.empty() && srv.workers > 0) {
+        usage(argv[0]);
+        fatal("-A can't be used with -c");
+    }
+    if (!take_over_path.empty()) return;
+    if (srv.generated) {
+        if (!coeff_file.empty()) {
+            usage(argv[0]);
+            fatal("-f and -g can't be used together");
+        }
+        use_coeff_generator(srv.seed);
+        return;
+    }
     if (coeff_file.empty()) {
         usage(argv[0]);
         fatal("missing -f parameter");
@@ -89,150 +1035,399 @@ void parse_args(int& port, int& K, int& N, int& M, std::string& coeff_file,
     open_coeff_file(coeff_file);
 }
 
-int main(int argc, char* argv[]) {
-    int port = 0;
-    int K    = 100;
-    int N    = 4;
-    int M    = 131;
-    std::string coeff_file;
-    int PUT_count = 0;
+// Starts tracing, or stops it and writes the trace to the file of srv.
+static void toggle_trace(Server& srv) {
+    if (!trace_on) {
+        trace_start();
+        std::cerr << "Tracing started.\n";
+        return;
+    }
+    size_t spans;
+    if (trace_stop(srv.trace_path, spans)) {
+        std::cerr << "Trace of " << spans << " spans written to " << srv.trace_path << ".\n";
+    } else {
+        error("cannot write the trace to %s", srv.trace_path.c_str());
+    }
+}
 
-    parse_args(port, K, N, M, coeff_file, argc, argv);
+// Closes the sockets new players connect to.
+static void close_listeners(Server& srv) {
+    if (srv.listen_fd >= 0) close(srv.listen_fd);
+    srv.listen_fd = -1;
+    if (srv.unix_fd >= 0) {
+        close(srv.unix_fd);
+        unlink(srv.unix_path.c_str());
+        srv.unix_fd = -1;
+    }
+    if (srv.shm_fd >= 0) {
+        close(srv.shm_fd);
+        unlink(srv.shm_path.c_str());
+        srv.shm_fd = -1;
+    }
+}
 
-    int listen_fd = create_dual_stack(port);
-    // Set listen_fd to non-blocking.
-    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+// Prints a parameter of the game, the next value too if it changes.
+static void show_param(std::ostream& os, const char* name, const std::string& now,
+                       const std::string& next) {
+    os << name << " " << now;
+    if (next != now) os << " (next game " << next << ")";
+    os << "\n";
+}
 
-    std::vector<Client> clients;
-    std::vector<pollfd> pollfds;
-    pollfds.push_back({listen_fd, POLLIN, 0});
+// Runs a command of the admin socket, see admin.h.
+static bool admin_command(Server& srv, const AdminCommand& cmd, std::string& answer) {
+    NextGame& next = srv.next;
+    switch (cmd.op) {
+    case AdminOp::SET:
+        (cmd.param == 'K' ? next.K : cmd.param == 'N' ? next.N : next.M) = cmd.value;
+        std::cout << "Admin set " << cmd.param << " " << cmd.value << " for the next game.\n";
+        return true;
+    case AdminOp::COEFF_FILE: {
+        int degree;
+        if (!coeff_file_degree(cmd.path, degree, answer)) return false;
+        // The next game needs N of the same degree, it may be set after.
+        if (degree != next.N) answer = "needs N " + std::to_string(degree) + "\n";
+        next.coeff_file = cmd.path;
+        next.generated = false;
+        next.coeff_changed = true;
+        std::cout << "Admin set coefficient file " << cmd.path << " for the next game.\n";
+        return true;
+    }
+    case AdminOp::COEFF_SEED:
+        next.generated = true;
+        next.seed = cmd.seed;
+        next.coeff_changed = true;
+        std::cout << "Admin set coefficient seed " << cmd.seed << " for the next game.\n";
+        return true;
+    case AdminOp::DRAIN:
+        if (!srv.draining) {
+            srv.draining = true;
+            close_listeners(srv);
+            // Players waiting for the next game won't get one.
+            if (srv.phase == Phase::ROLLOVER) {
+                while (!srv.clients.empty()) drop_client(srv, srv.clients.size() - 1);
+            }
+            std::cout << "Admin drains the server.\n";
+        }
+        answer = "players " + std::to_string(srv.clients.size()) + "\n";
+        return true;
+    case AdminOp::STATS: {
+        std::ostringstream os;
+        print_stats(os);
+        leaderboard_print(os);
+        spectator_print(os);
+        answer = os.str();
+        return true;
+    }
+    case AdminOp::SHOW: {
+        std::ostringstream os;
+        show_param(os, "K", std::to_string(srv.K), std::to_string(next.K));
+        show_param(os, "N", std::to_string(srv.N), std::to_string(next.N));
+        show_param(os, "M", std::to_string(srv.M), std::to_string(next.M));
+        auto source = [](bool generated, uint64_t seed, const std::string& file) {
+            return generated ? "seed " + std::to_string(seed) : "file " + file;
+        };
+        show_param(os, "coeff", source(srv.generated, srv.seed, srv.coeff_file),
+                   next.coeff_changed ? source(next.generated, next.seed, next.coeff_file) :
+                   source(srv.generated, srv.seed, srv.coeff_file));
+        os << "players " << srv.clients.size() << "\n"
+           << "draining " << srv.draining << "\n";
+        answer = os.str();
+        return true;
+    }
+    case AdminOp::RANK: {
+        Standing standing;
+        if (!leaderboard_enabled()) {
+            answer = "no leaderboard, the server runs without -L";
+            return false;
+        }
+        if (!leaderboard_rank(cmd.player_id, standing)) {
+            answer = "no games of " + cmd.player_id;
+            return false;
+        }
+        std::ostringstream os;
+        os << "rank " << standing.rank << "\n"
+           << "mean " << standing.total / standing.games << "\n"
+           << "games " << standing.games << "\n";
+        answer = os.str();
+        return true;
+    }
+    }
+    return false;
+}
 
+// Runs the main loop of the server until it is drained.
+static void serve(Server& srv) {
+    std::vector<pollfd> pollfds;
+    bool busy = false;
+    TimePoint busy_since;
     while (true) {
         auto now = Clock::now();
-        auto nearest = now + std::chrono::hours(24);
-        for (auto &c : clients) {
-            if (!c.data.after_HELLO)
-                nearest = std::min(nearest, c.hello_deadline);
-            if (c.action != TimerAction::NONE)
-                nearest = std::min(nearest, c.next_action);
-        }
-        int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(nearest - now).count();
+        // Time spent between two poll() calls, nothing else is served then.
+        if (busy) {
+            latency_record(server_stats.reactor_stall,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    now - busy_since).count());
+        }
+        int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            nearest_timer(srv, now) - now).count();
         if (timeout < 0) timeout = 0;
+        // Clients in the ready list have work to do right away.
+        bool any_ready = false;
+        for (auto &c : srv.clients) any_ready |= c.ready;
+        if (any_ready) timeout = 0;
+
+        // First come the listening sockets (or the coordinator), then the clients, the
+        // connections that are being closed, the completions of the
+        // thread pool, the handoff socket and the admin socket, in this order.
+        pollfds.clear();
+        if (srv.listen_fd >= 0) pollfds.push_back({srv.listen_fd, POLLIN, 0});
+        if (srv.unix_fd >= 0) pollfds.push_back({srv.unix_fd, POLLIN, 0});
+        if (srv.shm_fd >= 0) pollfds.push_back({srv.shm_fd, POLLIN, 0});
+        if (srv.coordinator_fd >= 0) pollfds.push_back({srv.coordinator_fd, POLLIN, 0});
+        size_t base = pollfds.size();
+        for (auto &c : srv.clients) {
+            short events = c.parked ? 0 : POLLIN;
+            if (can_flush(c.fd)) events |= POLLOUT;
+            pollfds.push_back({c.fd, events, 0});
+        }
+        for (auto &c : srv.closing) {
+            pollfds.push_back({c.fd, (short)(can_flush(c.fd) ? POLLOUT : 0), 0});
+        }
+        size_t pool_idx = pollfds.size();
+        if (pool_event_fd() >= 0) {
+            pollfds.push_back({pool_event_fd(), POLLIN, 0});
+        }
+        size_t handoff_idx = pollfds.size();
+        if (srv.handoff_fd >= 0) {
+            pollfds.push_back({srv.handoff_fd, POLLIN, 0});
+        }
+        size_t admin_idx = pollfds.size();
+        admin_poll_fds(pollfds);
 
         int ready = poll(pollfds.data(), pollfds.size(), timeout);
+        if (ready < 0 && errno != EINTR) syserr("poll()");
         now = Clock::now();
+        busy = true;
+        busy_since = now;
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats(std::cerr);
+            leaderboard_print(std::cerr);
+            spectator_print(std::cerr);
+        }
+        if (trace_requested) {
+            trace_requested = 0;
+            toggle_trace(srv);
+        }
+        for (size_t i = 0; i < srv.clients.size(); ++i)
+            srv.clients[i].revents = pollfds[base + i].revents;
+        for (size_t i = 0; i < srv.closing.size(); ++i)
+            srv.closing[i].revents = pollfds[base + srv.clients.size() + i].revents;
+
+        // Results of the thread pool are written before the new messages.
+        if (pool_event_fd() >= 0 && (pollfds[pool_idx].revents & POLLIN)) {
+            TraceSpan span("pool_completions");
+            pool_run_completions();
+        }
+        // A new process wants to take over.
+        if (srv.handoff_fd >= 0 && (pollfds[handoff_idx].revents & POLLIN)) {
+            hand_off(srv);
+        }
+
+        admin_handle(pollfds, admin_idx, [&srv](const AdminCommand& cmd, std::string& answer) {
+            return admin_command(srv, cmd, answer);
+        });
+
+        // Timers go first, they can't wait for the clients.
+        handle_timers(srv, now);
+        if (srv.draining && srv.clients.empty() && srv.closing.empty()) return;
+        if (ready <= 0 && !any_ready) continue;
+
+        // Write what is left for the players of the finished game and
+        // close their connections once everything was sent.
+        for (size_t i = 0; i < srv.closing.size(); ++i) {
+            int fd = srv.closing[i].fd;
+            if ((srv.closing[i].revents & (POLLOUT | POLLERR | POLLHUP)) &&
+                (!flush_output(fd) || !has_pending_output(fd))) {
+                finish_closing(srv, i);
+                --i;
+            }
+        }
+
+        // Handle new clients.
+        for (size_t i = 0; i < base; ++i) {
+            if (pollfds[i].revents & (POLLIN | POLLHUP)) accept_client(srv, pollfds[i].fd);
+        }
 
-        // Handle expired timers.
-        for (size_t i = 1; i < pollfds.size(); ++i) {
-            Client &c = clients[i-1];
-            if (!c.data.after_HELLO && now >= c.hello_deadline) {
-                close(c.fd);
-                pollfds.erase(pollfds.begin() + i);
-                clients.erase(clients.begin() + (i-1));
+        // Handle existing clients.
+        for (size_t i = 0; i < srv.clients.size(); ++i) {
+            Client &c = srv.clients[i];
+            // Shared memory clients ring the doorbell (POLLIN) when there
+            // is room for more output.
+            if ((c.revents & (POLLOUT | POLLERR | POLLHUP | POLLIN)) &&
+                !flush_output(c.fd)) {
+                drop_client(srv, i);
                 --i;
                 continue;
             }
-            if (c.action == TimerAction::SEND_STATE && now >= c.next_action) {
-                send_STATE(c.fd, c.data);
-                c.action = TimerAction::NONE;
-            }
-            if (c.action == TimerAction::BAD_PUT && now >= c.next_action) {
-                send_BAD_PUT(c.last_bad_point, c.last_bad_value, c.fd, c.data);
-                c.action = TimerAction::NONE;
-            }
-        }
-
-        if (ready > 0) {
-            // Handle new client.
-            if (pollfds[0].revents & POLLIN) {
-                struct sockaddr_storage addr;
-                socklen_t addrlen = sizeof(addr);
-                int new_fd = accept(listen_fd, (struct sockaddr*)&addr, &addrlen);
-                if (new_fd >= 0) {
-                    // Set new client socket to non-blocking.
-                    fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL, 0) | O_NONBLOCK);
-                    Client nc;
-                    nc.fd = new_fd;
-                    nc.hello_deadline = Clock::now() + std::chrono::seconds(3);
-                    nc.ip = sockaddr_to_ip((struct sockaddr*)&addr);
-                    if (addr.ss_family == AF_INET) {
-                        nc.port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
-                    } else if (addr.ss_family == AF_INET6) {
-                        nc.port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
-                    }
-                    nc.data = add_player();
-                    clients.push_back(nc);
-                    pollfds.push_back({new_fd, POLLIN, 0});
-                    std::cout << "New client [" << nc.ip << "]:" << nc.port << ".\n";
-                }
+            if (c.parked && (c.revents & (POLLERR | POLLHUP))) {
+                drop_client(srv, i);
+                --i;
+                continue;
             }
-            // Handle existing clients.
-            for (size_t i = 1; i < pollfds.size(); ++i) {
-                if (pollfds[i].revents & POLLIN) {
-                    bool erase = false;
-                    std::string msg = receive_msg(pollfds[i].fd, i-1, erase);
-                    if (erase) {
-                        close(pollfds[i].fd);
-                        PUT_count -= clients[i - 1].data.PUT_count;
-                        pollfds.erase(pollfds.begin() + i);
-                        clients.erase(clients.begin() + (i-1));
-                        erase_kth_player(i - 1);
-                        --i;
-                        continue;
-                    }
-                    if (msg.empty()) {
-                        continue;
-                    }
-                    Client &c = clients[i-1];
-                    TimerAction timer = TimerAction::NONE;
-                    if (handle_message(msg, c.data, c.fd, timer, c.ip, c.port, K, PUT_count, N)) {
-                        if (timer == TimerAction::SEND_STATE) {
-                            int low = 0;
-                            for (char ch : c.data.player_id) {
-                                if (ch >= 'a' && ch <= 'z') ++low;
-                            }
-                            c.action = TimerAction::SEND_STATE;
-                            c.next_action = Clock::now() + std::chrono::seconds(low);
-                        } else if (timer == TimerAction::BAD_PUT) {
-                            std::istringstream iss(msg);
-                            std::string cmd; int pt; double val;
-                            iss >> cmd >> pt >> val;
-                            c.last_bad_point = pt;
-                            c.last_bad_value = val;
-                            c.action = TimerAction::BAD_PUT;
-                            c.next_action = Clock::now() + std::chrono::seconds(1);
-                        } else {
-                            c.action = TimerAction::NONE;
-                        }
-                    } else {
-                        if (c.data.player_id.empty()) c.data.player_id = "UNKNOWN";
-                        error("bad message from [%s]:%d, %s: %s", c.ip.c_str(), c.port, 
-                                c.data.player_id.c_str(), msg.c_str());
-                    }
+            if (c.parked || !(c.ready || (c.revents & POLLIN))) continue;
+            if (!c.ready) c.ready_since = now;
+            c.ready = false;
+
+            // Handle the whole lines the client has sent so far, within the
+            // budget. A line that is left in the buffer wouldn't wake up
+            // poll() again, so a client that used up its budget is put in
+            // the ready list and continues in the next iteration.
+            bool erase = false;
+            bool game_over = false;
+            int msgs = 0;
+            size_t bytes = 0;
+            std::string msg;
+            while (msgs < MSG_BUDGET && bytes < BYTE_BUDGET &&
+                   receive_msg(c.fd, msg, erase)) {
+                msgs++;
+                bytes += msg.size() + 2;
+                c.last_active = now;
+                if (!admit_hello(srv, c, msg)) {
+                    erase = true;
+                    break;
+                }
+                if (!admit_msg(srv, c, msg, now, erase)) {
+                    if (erase) break;
+                    continue;
                 }
+                bool hello = !c.data.after_HELLO;
+                handle_client_msg(srv, c, msg);
+                if (hello && c.data.after_HELLO) srv.mem_reserved += player_bytes(srv);
                 // Check for game end and if yes then end game
-                // and start a new one.
-                if (PUT_count == M) {
-                    std::vector<int> fds;
-                    std::vector<PlayerData*> players;
-                    for (size_t j = 1; j < pollfds.size(); j++) {
-                        fds.push_back(pollfds[j].fd);
-                        players.push_back(&clients[j - 1].data);
-                        
-                    }
-                    send_SCORING(fds, players);
-                    erase_players();
-                    clients.clear();
-                    for (size_t i = 1; i < pollfds.size(); i++) close(pollfds[i].fd);
-                    pollfds.clear();
-                    pollfds.push_back({listen_fd, POLLIN, 0});
-                    PUT_count = 0;
-                    sleep(1);
+                // and start a new one after a pause.
+                if (srv.PUT_count == srv.M) {
+                    game_over = true;
                     break;
                 }
             }
+            if (game_over) {
+                end_game(srv, Clock::now());
+                break;
+            }
+            if (erase) {
+                drop_client(srv, i);
+                --i;
+            } else if (msgs == MSG_BUDGET || bytes >= BYTE_BUDGET) {
+                c.ready = true;
+                c.cls = CLASS_HEAVY;
+                server_stats.budget_exhausted++;
+            }
         }
     }
-    close(listen_fd);
-    return 0;
-}
\ No newline at end of file
+}
+
+// Turns the process into the worker w of a cluster: it plays its own
+// games with the players passed by the coordinator and takes every
+// workers-th line of the coefficient file.
+static void become_worker(Server& srv, const WorkerStart& w) {
+    srv.listen_fd = -1;
+    srv.unix_fd = -1;
+    srv.shm_fd = -1;
+    srv.coordinator_fd = w.sock;
+    coordinator_sock = w.sock;
+    // The results go to the leaderboard of the coordinator.
+    leaderboard_detach();
+    set_scoring_hook(report_scoring);
+    set_coeff_hook(report_coeff);
+    // The file was opened before fork(), its position is shared with the
+    // coordinator and the other workers.
+    if (!srv.generated) {
+        close_coeff_file();
+        open_coeff_file(srv.coeff_file);
+    }
+    seek_coeff_file(w.coeff_offset);
+    stride_coeff_file(w.coeff_skip, srv.workers - 1);
+    signal(SIGUSR1, on_sigusr1);
+    if (!srv.trace_path.empty()) {
+        // Every worker writes its own trace.
+        trace_thread_name("main");
+        srv.trace_path += "." + std::to_string(getpid());
+        signal(SIGUSR2, on_sigusr2);
+    }
+    pool_start(srv.threads);
+    serve(srv);
+}
+
+// Runs the coordinator of the cluster on the listening sockets of srv.
+static void run_cluster(Server& srv) {
+    std::vector<ClusterListener> listeners;
+    listeners.push_back({srv.listen_fd, FROM_TCP});
+    if (srv.unix_fd >= 0) listeners.push_back({srv.unix_fd, FROM_UNIX});
+    if (srv.shm_fd >= 0) listeners.push_back({srv.shm_fd, FROM_SHM});
+    cluster_run(listeners, srv.workers, [&srv](const WorkerStart& w) {
+        become_worker(srv, w);
+    });
+}
+
+int main(int argc, char* argv[]) {
+    int port = 0;
+    std::string coeff_file;
+    Server srv;
+    srv.K = 100;
+    srv.N = 4;
+    srv.M = 131;
+
+    std::string take_over_path;
+    parse_args(port, srv, coeff_file, take_over_path, argc, argv);
+    srv.coeff_file = coeff_file;
+
+    if (!take_over_path.empty()) {
+        // The listening sockets come from the old process.
+        take_over(srv, take_over_path);
+    } else {
+        srv.listen_fd = create_dual_stack(port);
+        // Set listen_fd to non-blocking.
+        fcntl(srv.listen_fd, F_SETFL, fcntl(srv.listen_fd, F_GETFL, 0) | O_NONBLOCK);
+        if (!srv.unix_path.empty()) {
+            srv.unix_fd = create_unix_listener(srv.unix_path);
+            fcntl(srv.unix_fd, F_SETFL, fcntl(srv.unix_fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+        if (!srv.shm_path.empty()) {
+            srv.shm_fd = create_unix_listener(srv.shm_path);
+            fcntl(srv.shm_fd, F_SETFL, fcntl(srv.shm_fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+    }
+    if (!srv.leaderboard_path.empty()) {
+        leaderboard_open(srv.leaderboard_path);
+        set_scoring_hook(leaderboard_add);
+    }
+    // The workers of a cluster apply it between their games too.
+    srv.next = {srv.K, srv.N, srv.M, srv.coeff_file, srv.generated, srv.seed};
+    if (srv.workers > 0) run_cluster(srv);
+    if (!srv.admin_path.empty()) admin_listen(srv.admin_path);
+    if (srv.spectator_port >= 0) {
+        spectator_listen(srv.spectator_port);
+        spectator_game(srv.K, srv.N, srv.M);
+    }
+    if (!srv.handoff_path.empty()) {
+        srv.handoff_fd = create_unix_listener(srv.handoff_path);
+        fcntl(srv.handoff_fd, F_SETFL, fcntl(srv.handoff_fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+    signal(SIGUSR1, on_sigusr1);
+    if (!srv.trace_path.empty()) {
+        trace_thread_name("main");
+        signal(SIGUSR2, on_sigusr2);
+    }
+    pool_start(srv.threads);
+
+    serve(srv);
+    close_listeners(srv);
+    admin_close();
+    leaderboard_flush();
+    std::cout << "Drained, exiting.\n";
+    std::cout.flush();
+    // The workers of the pool are still around.
+    _exit(0);
+}
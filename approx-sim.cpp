@@ -0,0 +1,189 @@
+#include <unistd.h>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "err.h"
+#include "common.h"
+#include "engine.h"
+#include "client-strategy.h"
+
+// Options given on the command line.
+struct Options {
+    int K = 100;
+    int N = 4;
+    int M = 131;
+    int players = 2;
+    int games = 10000;
+    uint64_t seed = 1;
+    Heuristic heuristic = Heuristic::GREEDY;
+    int window = 1;
+};
+
+// Totals of all simulated games.
+struct Totals {
+    uint64_t games = 0;
+    uint64_t stalled = 0;         // Games nobody could finish.
+    uint64_t puts = 0;
+    uint64_t penalties = 0;
+    long double result = 0;       // Sum of the results of all players.
+    int64_t virtual_us = 0;       // Sum of the virtual lengths of the games.
+};
+
+// Prints usage of the simulator.
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog
+              << " [-k K] [-n N] [-m M] [-P players] [-G games] [-g seed] "
+              << "[-S greedy|gain|cost] [-w window]\n"
+              << "  plays games games of players automatic players in memory, "
+              << "with coefficients generated from seed, and reports the "
+              << "simulated games per second\n";
+}
+
+// Parses the arguments and checks if they're valid. If they're not then
+// print an error and exit with code 1.
+static void parse_args(int argc, char** argv, Options& opts) {
+    int opt;
+    while ((opt = getopt(argc, argv, "k:n:m:P:G:g:S:w:")) != -1) {
+        switch (opt) {
+        case 'k':
+            if (!parse_int(optarg, 1, 10000, opts.K)) fatal("invalid K: %s", optarg);
+            break;
+        case 'n':
+            if (!parse_int(optarg, 1, 8, opts.N)) fatal("invalid N: %s", optarg);
+            break;
+        case 'm':
+            if (!parse_int(optarg, 1, 12341234, opts.M)) fatal("invalid M: %s", optarg);
+            break;
+        case 'P':
+            if (!parse_int(optarg, 1, 100000, opts.players)) {
+                fatal("invalid number of players: %s", optarg);
+            }
+            break;
+        case 'G':
+            if (!parse_int(optarg, 1, 2000000000, opts.games)) {
+                fatal("invalid number of games: %s", optarg);
+            }
+            break;
+        case 'g':
+            if (!parse_uint64(optarg, opts.seed)) fatal("invalid seed: %s", optarg);
+            break;
+        case 'S':
+            if (!parse_heuristic(optarg, opts.heuristic)) fatal("unknown heuristic: %s", optarg);
+            break;
+        case 'w':
+            if (!parse_int(optarg, 1, 1000000, opts.window)) fatal("invalid window: %s", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            fatal("invalid argument");
+        }
+    }
+}
+
+// Sends the PUTs the strategy of player p wants to send now.
+static void play(Game& g, size_t p, Strategy& s, Totals& totals,
+                 std::vector<Effect>& out) {
+    std::vector<std::pair<int, double>> puts;
+    strategy_plan_puts(s, puts);
+    for (auto& put : puts) {
+        totals.puts++;
+        game_put(g, p, put.first, llroundl((long double)put.second * FIXED_ONE), out);
+    }
+}
+
+// Plays one game with the players of strategies, whose coefficients are
+// the rows from row on.
+static void simulate_game(const Options& opts, uint64_t row,
+                          std::vector<Strategy>& strategies, Totals& totals) {
+    static Game g;
+    static std::vector<Effect> out, batch;
+    static std::vector<int64_t> coeffs;
+    static std::vector<double> values;
+    game_init(g, opts.K, opts.N, opts.M);
+    out.clear();
+    for (size_t p = 0; p < strategies.size(); p++) {
+        game_join(g);
+        generate_coeffs(opts.seed, row + p, opts.N, coeffs);
+        game_hello(g, p, "B" + std::to_string(p + 1), coeffs, out);
+    }
+    while (!g.over) {
+        // Messages are delivered at once, the players answer them at once.
+        while (!out.empty()) {
+            batch.swap(out);
+            for (const Effect& e : batch) {
+                Strategy& s = strategies[e.player];
+                const PlayerData& player = g.players[e.player];
+                switch (e.kind) {
+                case EffectKind::COEFF:
+                    values.clear();
+                    for (int64_t c : player.coeffs) values.push_back((double)c / FIXED_ONE);
+                    strategy_init(s, values);
+                    play(g, e.player, s, totals, out);
+                    break;
+                case EffectKind::STATE:
+                    values.clear();
+                    for (int64_t v : player.state) values.push_back((double)v / FIXED_ONE);
+                    strategy_set_state(s, values);
+                    play(g, e.player, s, totals, out);
+                    break;
+                case EffectKind::PENALTY:
+                    totals.penalties++;
+                    strategy_on_penalty(s, e.point, (double)e.value / FIXED_ONE);
+                    break;
+                case EffectKind::BAD_PUT:
+                    play(g, e.player, s, totals, out);
+                    break;
+                case EffectKind::SCORING:
+                case EffectKind::DROP:
+                    break;
+                }
+            }
+            batch.clear();
+        }
+        if (g.over) break;
+        int64_t next = game_next_timer(g);
+        if (next < 0) {
+            // Nobody has anything to send or to wait for.
+            totals.stalled++;
+            break;
+        }
+        game_advance(g, next, out);
+    }
+    totals.games++;
+    totals.virtual_us += g.now_us;
+    for (long double r : g.results) totals.result += r;
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    parse_args(argc, argv, opts);
+
+    std::vector<Strategy> strategies(opts.players);
+    for (Strategy& s : strategies) {
+        s.heuristic = opts.heuristic;
+        s.window = opts.window;
+    }
+    Totals totals;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < opts.games; i++) {
+        simulate_game(opts, (uint64_t)i * opts.players, strategies, totals);
+    }
+    double secs = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Simulated " << totals.games << " games of " << opts.players <<
+                 " players in " << secs << " s, " << totals.games / secs <<
+                 " games per second.\n";
+    std::cout << "PUTs per game " << (double)totals.puts / totals.games <<
+                 ", penalties per game " << (double)totals.penalties / totals.games <<
+                 ", mean result " << (double)(totals.result / totals.games / opts.players) <<
+                 ", virtual seconds per game " <<
+                 (double)totals.virtual_us / totals.games / 1e6 << ".\n";
+    if (totals.stalled > 0) {
+        std::cout << totals.stalled << " games stalled with nobody to move.\n";
+    }
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "err.h"
+#include "common.h"
+#include "engine.h"
+
+// Computes the best PUTs of a single player offline.
+//
+// The result is the sum over the points of the squared difference between
+// the polynomial and the state, and the PUTs of one point don't change the
+// others. So the problem splits into one convex problem per point: with n
+// PUTs a point whose residual is r is left with max(|r| - 5n, 0). The
+// gain of another PUT only grows with the residual that is left, so
+// giving every PUT to the point with the largest residual, as much as it
+// can take, is optimal (an exchange of any two PUTs can't do better). No
+// search is needed; many rows are solved in parallel instead.
+
+// Options given on the command line.
+struct Options {
+    int K = 100;
+    int N = 4;
+    int M = 131;
+    // Rows of the coefficient file, empty with -g.
+    std::string coeff_file;
+    bool generated = false;
+    uint64_t seed = 0;
+    int first = 0;
+    int rows = 1;
+    int threads = 0;
+    // File the plan of the first row is written to.
+    std::string plan_file;
+};
+
+// Residuals saturate here, a whole game of PUTs can't make a dent in them.
+static const __int128 RESIDUAL_MAX = (__int128)1 << 120;
+
+// What the solver keeps for a row, reused by the rows of a thread.
+typedef struct {
+    // Remaining residual of the points, the largest on top.
+    std::vector<std::pair<__int128, int>> heap;
+    std::vector<int> sign;
+    // PUTs of the plan, values in units of 1e-7.
+    std::vector<std::pair<int, int64_t>> plan;
+    PlayerData player;
+} Solver;
+
+// Totals of the rows solved by a thread.
+struct Totals {
+    uint64_t rows = 0;
+    uint64_t puts = 0;          // PUTs that change the state, without padding.
+    long double before = 0;     // Sum of the results with no PUTs.
+    long double after = 0;      // Sum of the results of the plans.
+};
+
+// Prints usage of the solver.
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog
+              << " -k K -m M (-f file | -g seed -n N) [-r row] [-R rows] "
+              << "[-t threads] [-o plan]\n"
+              << "  solves rows rows from row on (of the coefficient file or "
+              << "generated from seed), every one for a single player with M PUTs\n"
+              << "  -o plan  writes the PUTs for the first row to plan, one "
+              << "\"point value\" per line, to be played with approx-client -P\n";
+}
+
+// Parses the arguments and checks if they're valid. If they're not then
+// print an error and exit with code 1.
+static void parse_args(int argc, char** argv, Options& opts) {
+    int opt;
+    while ((opt = getopt(argc, argv, "k:n:m:f:g:r:R:t:o:")) != -1) {
+        switch (opt) {
+        case 'k':
+            if (!parse_int(optarg, 1, 10000, opts.K)) fatal("invalid K: %s", optarg);
+            break;
+        case 'n':
+            if (!parse_int(optarg, 1, 8, opts.N)) fatal("invalid N: %s", optarg);
+            break;
+        case 'm':
+            if (!parse_int(optarg, 1, 12341234, opts.M)) fatal("invalid M: %s", optarg);
+            break;
+        case 'f':
+            opts.coeff_file = optarg;
+            break;
+        case 'g':
+            if (!parse_uint64(optarg, opts.seed)) fatal("invalid seed: %s", optarg);
+            opts.generated = true;
+            break;
+        case 'r':
+            if (!parse_int(optarg, 0, 2000000000, opts.first)) fatal("invalid row: %s", optarg);
+            break;
+        case 'R':
+            if (!parse_int(optarg, 1, 2000000000, opts.rows)) {
+                fatal("invalid number of rows: %s", optarg);
+            }
+            break;
+        case 't':
+            if (!parse_int(optarg, 1, 1024, opts.threads)) {
+                fatal("invalid number of threads: %s", optarg);
+            }
+            break;
+        case 'o':
+            opts.plan_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            fatal("invalid argument");
+        }
+    }
+    if (opts.generated == !opts.coeff_file.empty()) {
+        usage(argv[0]);
+        fatal("exactly one of -f and -g is required");
+    }
+    if (opts.threads == 0) {
+        opts.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+// Reads the rows of the coefficient file that are solved.
+static void read_coeff_file(const Options& opts,
+                            std::vector<std::vector<int64_t>>& rows) {
+    std::ifstream in(opts.coeff_file);
+    if (!in) fatal("cannot open the coefficient file %s", opts.coeff_file.c_str());
+    std::string line;
+    for (int i = 0; std::getline(in, line) && i < opts.first + opts.rows; i++) {
+        if (i < opts.first) continue;
+        std::istringstream iss(line);
+        std::string command, coeff_str;
+        std::vector<int64_t> coeffs;
+        iss >> command;
+        while (iss >> coeff_str) {
+            int64_t coeff;
+            if (!parse_fixed(coeff_str.data(), coeff_str.size(), coeff)) {
+                fatal("Coefficient file wrong format.");
+            }
+            coeffs.push_back(coeff);
+        }
+        if (command != "COEFF" || coeffs.empty()) fatal("Coefficient file wrong format.");
+        rows.push_back(std::move(coeffs));
+    }
+    if (rows.empty()) fatal("no rows to solve in %s", opts.coeff_file.c_str());
+}
+
+// Returns the residual of coeffs in point x, saturated to RESIDUAL_MAX.
+static __int128 residual(const std::vector<int64_t>& coeffs, int64_t x) {
+    __int128 value;
+    if (poly_value(coeffs, x, value) && value < RESIDUAL_MAX && value > -RESIDUAL_MAX) {
+        return value;
+    }
+    long double approx = 0;
+    for (size_t j = coeffs.size(); j-- > 0;) {
+        approx = approx * x + (long double)coeffs[j];
+    }
+    return approx < 0 ? -RESIDUAL_MAX : RESIDUAL_MAX;
+}
+
+// Finds the best M PUTs for coeffs and checks the plan with the scoring of
+// the engine. The plan is padded with "PUT 0 0" to M PUTs, so that a
+// single player ends the game with it.
+static void solve_row(Solver& s, const std::vector<int64_t>& coeffs, int K, int M,
+                      Totals& totals) {
+    s.heap.clear();
+    s.sign.assign(K + 1, 1);
+    s.plan.clear();
+    for (int i = 0; i <= K; i++) {
+        __int128 r = residual(coeffs, i);
+        if (r < 0) {
+            s.sign[i] = -1;
+            r = -r;
+        }
+        if (r > 0) s.heap.push_back({r, i});
+    }
+    std::make_heap(s.heap.begin(), s.heap.end());
+    while ((int)s.plan.size() < M && !s.heap.empty()) {
+        std::pop_heap(s.heap.begin(), s.heap.end());
+        auto& top = s.heap.back();
+        int64_t value = (int64_t)std::min<__int128>(top.first, PUT_VALUE_MAX);
+        s.plan.push_back({top.second, s.sign[top.second] * value});
+        top.first -= value;
+        if (top.first > 0) {
+            std::push_heap(s.heap.begin(), s.heap.end());
+        } else {
+            s.heap.pop_back();
+        }
+    }
+    totals.puts += s.plan.size();
+    s.plan.resize(M, {0, 0});
+
+    PlayerData& player = s.player;
+    player = rules_new_player();
+    player.coeffs = coeffs;
+    player.state.assign(K + 1, 0);
+    totals.before += score_value(player);
+    for (auto& put : s.plan) player.state[put.first] += put.second;
+    totals.after += score_value(player);
+    totals.rows++;
+}
+
+// Writes plan, one "point value" per line.
+static void write_plan(const std::string& path,
+                       const std::vector<std::pair<int, int64_t>>& plan) {
+    std::ofstream out(path);
+    if (!out) fatal("cannot write the plan to %s", path.c_str());
+    std::string text;
+    char value[FIXED_MAX_LEN];
+    for (auto& put : plan) {
+        text += std::to_string(put.first);
+        text += ' ';
+        text.append(value, format_fixed(put.second, value, true));
+        text += '\n';
+    }
+    out << text;
+    if (!out.flush()) fatal("cannot write the plan to %s", path.c_str());
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    parse_args(argc, argv, opts);
+
+    std::vector<std::vector<int64_t>> file_rows;
+    if (!opts.generated) read_coeff_file(opts, file_rows);
+    size_t rows = opts.generated ? (size_t)opts.rows : file_rows.size();
+
+    // The threads take the rows one by one, the plan of the first row is kept.
+    std::atomic<size_t> next{0};
+    std::vector<Totals> totals(opts.threads);
+    std::vector<std::pair<int, int64_t>> first_plan;
+    auto work = [&](int t) {
+        Solver s;
+        std::vector<int64_t> generated;
+        for (size_t row; (row = next.fetch_add(1, std::memory_order_relaxed)) < rows;) {
+            const std::vector<int64_t>* coeffs = &generated;
+            if (opts.generated) {
+                generate_coeffs(opts.seed, opts.first + row, opts.N, generated);
+            } else {
+                coeffs = &file_rows[row];
+            }
+            solve_row(s, *coeffs, opts.K, opts.M, totals[t]);
+            if (row == 0) first_plan = s.plan;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 1; t < opts.threads; t++) threads.emplace_back(work, t);
+    work(0);
+    for (std::thread& thread : threads) thread.join();
+    double secs = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+
+    Totals sum;
+    for (const Totals& t : totals) {
+        sum.rows += t.rows;
+        sum.puts += t.puts;
+        sum.before += t.before;
+        sum.after += t.after;
+    }
+    if (!opts.plan_file.empty()) write_plan(opts.plan_file, first_plan);
+
+    std::cout << "Solved " << sum.rows << " rows with " << opts.threads <<
+                 " threads in " << secs << " s, " << sum.rows / secs <<
+                 " rows per second, " << sum.rows / secs / opts.threads <<
+                 " per thread.\n";
+    std::cout << "Useful PUTs per row " << (double)sum.puts / sum.rows <<
+                 " of " << opts.M << ", mean result " <<
+                 (double)(sum.after / sum.rows) << " (" <<
+                 (double)(sum.before / sum.rows) << " without PUTs).\n";
+    return 0;
+}
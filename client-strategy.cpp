@@ -0,0 +1,141 @@
+#include <cmath>
+
+#include "client-strategy.h"
+
+// Rounds x to 7 decimal places and clamps it to the allowed PUT values.
+static double put_value(double x) {
+    x = std::round(x * 1e7) / 1e7;
+    if (x < -5) return -5;
+    if (x > 5) return 5;
+    return x;
+}
+
+// Priority of point i according to the heuristic of s.
+static double point_priority(const Strategy& s, size_t i) {
+    double r = s.targets[i] - s.state[i];
+    if (s.heuristic == Heuristic::GREEDY) return std::abs(r);
+    double v = put_value(r);
+    return r * r - (r - v) * (r - v);
+}
+
+// Returns the better of two leaves, the one with the lower point on a tie.
+static size_t better_leaf(const Strategy& s, size_t a, size_t b) {
+    return s.priority[b] > s.priority[a] ? b : a;
+}
+
+// Recomputes the priority of point i and the path from it to the root.
+static void update_point(Strategy& s, size_t i) {
+    s.priority[i] = point_priority(s, i);
+    for (size_t node = (s.leaves + i) / 2; node >= 1; node /= 2) {
+        s.tree[node] = better_leaf(s, s.tree[2 * node], s.tree[2 * node + 1]);
+    }
+}
+
+// Computes the values of the polynomial and builds the tree for k points.
+static void build(Strategy& s, size_t k) {
+    s.targets.assign(k, 0);
+    for (size_t x = 0; x < k; x++) {
+        // Horner's method, in doubles so that x^N doesn't overflow.
+        double sum = 0;
+        for (size_t i = s.coeffs.size(); i-- > 0;) {
+            sum = sum * (double)x + s.coeffs[i];
+        }
+        s.targets[x] = sum;
+    }
+    s.state.assign(k, 0);
+    s.leaves = 1;
+    while (s.leaves < k) s.leaves *= 2;
+    // Padding leaves have the lowest priority so they are never chosen.
+    s.priority.assign(s.leaves, -1);
+    s.tree.assign(2 * s.leaves, 0);
+    for (size_t i = 0; i < s.leaves; i++) {
+        if (i < k) s.priority[i] = point_priority(s, i);
+        s.tree[s.leaves + i] = i;
+    }
+    for (size_t node = s.leaves - 1; node >= 1; node--) {
+        s.tree[node] = better_leaf(s, s.tree[2 * node], s.tree[2 * node + 1]);
+    }
+}
+
+bool parse_heuristic(const std::string& name, Heuristic& heuristic) {
+    if (name == "greedy") heuristic = Heuristic::GREEDY;
+    else if (name == "gain") heuristic = Heuristic::GAIN;
+    else if (name == "cost") heuristic = Heuristic::COST;
+    else return false;
+    return true;
+}
+
+void strategy_init(Strategy& s, const std::vector<double>& coeffs) {
+    s.coeffs = coeffs;
+    s.targets.clear();
+    s.state.clear();
+    s.priority.clear();
+    s.tree.clear();
+    s.in_flight.clear();
+    s.leaves = 0;
+}
+
+void strategy_set_state(Strategy& s, const std::vector<double>& state) {
+    if (s.targets.size() != state.size()) build(s, state.size());
+    for (size_t i = 0; i < state.size(); i++) {
+        if (s.state[i] != state[i]) {
+            s.state[i] = state[i];
+            update_point(s, i);
+        }
+    }
+    s.in_flight.clear();
+}
+
+void strategy_on_penalty(Strategy& s, int point, double value) {
+    for (size_t i = 0; i < s.in_flight.size(); i++) {
+        if (s.in_flight[i].first == point &&
+            std::abs(s.in_flight[i].second - value) < 5e-8) {
+            strategy_add(s, point, -value);
+            s.in_flight.erase(s.in_flight.begin() + i);
+            return;
+        }
+    }
+}
+
+void strategy_add(Strategy& s, int point, double value) {
+    if (point < 0 || (size_t)point >= s.state.size()) return;
+    s.state[point] += value;
+    update_point(s, point);
+}
+
+bool strategy_next_put(const Strategy& s, double extra_cost, int& point,
+                       double& value, double& gain) {
+    if (s.targets.empty()) {
+        // The number of points isn't known yet, point 0 always exists.
+        point = 0;
+        value = 0;
+        gain = 0;
+        return s.heuristic != Heuristic::COST || extra_cost <= 0;
+    }
+    size_t best = s.tree[1];
+    double r = s.targets[best] - s.state[best];
+    point = (int)best;
+    value = put_value(r);
+    gain = r * r - (r - value) * (r - value);
+    if (s.heuristic == Heuristic::COST) return gain > extra_cost;
+    return true;
+}
+
+void strategy_plan_puts(Strategy& s, std::vector<std::pair<int, double>>& puts) {
+    int point;
+    double value, gain;
+    if (!strategy_next_put(s, 0, point, value, gain)) return;
+    puts.push_back({point, value});
+    strategy_add(s, point, value);
+    s.in_flight.push_back({point, value});
+    while ((int)s.in_flight.size() < s.window) {
+        if (!strategy_next_put(s, PENALTY_COST, point, value, gain) ||
+            gain <= PENALTY_COST) {
+            break;
+        }
+        puts.push_back({0, 0});
+        puts.push_back({point, value});
+        strategy_add(s, point, value);
+        s.in_flight.push_back({point, value});
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef CLIENT_STRATEGY_H
+#define CLIENT_STRATEGY_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Points added to the score for a PUT sent before the previous one was answered.
+constexpr double PENALTY_COST = 20;
+
+// Heuristic used by the automatic player to choose the next PUT. All of
+// them clamp values to [-5, 5] and only put in known points, so a PUT of
+// the strategy never earns a BAD_PUT.
+enum class Heuristic {
+    // Point with the largest absolute error, value clamped to [-5, 5].
+    GREEDY,
+    // Point where one PUT reduces the squared error the most, counting
+    // the value after it is rounded to 7 decimal places.
+    GAIN,
+    // Like GAIN, but a PUT is only sent if its gain is bigger than the
+    // penalties it risks.
+    COST
+};
+
+// State of the automatic strategy. Values of the polynomial are computed
+// once per game and the residual of every point is kept in a tournament
+// tree, so that the best point is known at all times and a change of one
+// point costs O(log K).
+//
+// With a window bigger than 1 the strategy doesn't wait for STATE after
+// every PUT. The server answers a PUT sent before the previous one was
+// answered with PENALTY and ignores it, but the PUT after the PENALTY is
+// accepted again. So a burst alternates the PUTs that matter with cheap
+// "PUT 0 0" that take the PENALTY, and it goes on only while the next PUT
+// gains more than PENALTY_COST. The local model assumes the PUTs of the
+// burst were applied until STATE or PENALTY tells otherwise.
+typedef struct {
+    // Set by the user before the first game.
+    Heuristic heuristic;
+    // Maximal number of PUTs that are applied before waiting for STATE.
+    int window;
+    // Coefficients of the polynomial of the current game.
+    std::vector<double> coeffs;
+    // Value of the polynomial in every point, empty until K is known.
+    std::vector<double> targets;
+    // Last known state of the approximation.
+    std::vector<double> state;
+    // Number of leaves of the tree, a power of two not smaller than K + 1.
+    size_t leaves;
+    // Priority of every leaf, the bigger the better.
+    std::vector<double> priority;
+    // tree[i] is the leaf with the highest priority in the subtree of node i,
+    // node 1 is the root and leaf j is node leaves + j.
+    std::vector<size_t> tree;
+    // PUTs of the current burst that are assumed to be applied.
+    std::vector<std::pair<int, double>> in_flight;
+} Strategy;
+
+// Parses the name of a heuristic, returns false if it isn't known.
+bool parse_heuristic(const std::string& name, Heuristic& heuristic);
+
+// Starts a new game with polynomial coeffs. The number of points is
+// learned from the first state passed to strategy_set_state.
+void strategy_init(Strategy& s, const std::vector<double>& coeffs);
+
+// Sets the state of the approximation received in STATE, updating only
+// the points that changed. The PUTs sent before are considered answered.
+void strategy_set_state(Strategy& s, const std::vector<double>& state);
+
+// Reconciles the local model with a PENALTY for point and value: if it was
+// a PUT of the burst, it wasn't applied.
+void strategy_on_penalty(Strategy& s, int point, double value);
+
+// Appends the PUTs to send now to puts: one PUT, then pairs of a PUT taking
+// the PENALTY and a PUT that is applied, up to the window.
+void strategy_plan_puts(Strategy& s, std::vector<std::pair<int, double>>& puts);
+
+// Records that value was added to point without waiting for STATE.
+void strategy_add(Strategy& s, int point, double value);
+
+// Chooses the next PUT. Returns false if the heuristic decides that no PUT
+// is worth sending. extra_cost is the penalty the PUT would risk.
+bool strategy_next_put(const Strategy& s, double extra_cost, int& point,
+                       double& value, double& gain);
+
+#endif // CLIENT_STRATEGY_H
@@ -1,42 +1,304 @@
+#include <algorithm>
 #include <sstream>
 #include <iomanip>
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <unistd.h>
 #include <cmath>
+#include <charconv>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
 
 #include "client-utils.h"
+#include "client-strategy.h"
 #include "common.h"
 #include "err.h"
 
+// Initial size of the receive buffer, it grows if a message doesn't fit.
 static constexpr size_t BUF_SIZE = 65536;
-static char buf[BUF_SIZE];
-static size_t buf_start = 0, buf_end = 0;
 
 
-int send_HELLO(const std::string& player_id, int fd) {
-    std::string message = "HELLO " + player_id + "\r\n";
-    if (writen(fd, message.c_str(), message.size()) <= 0) {
-        syserr("write()");
-        return -1;
+void session_reset(Session& s, int fd) {
+    s.fd = fd;
+    s.shm = nullptr;
+    s.buf.assign(BUF_SIZE, '\0');
+    s.buf_start = 0;
+    s.buf_end = 0;
+    s.buf_scan = 0;
+    s.coeffs.clear();
+    s.state_vector.clear();
+    s.pending_puts.clear();
+    s.plan_next = 0;
+    s.answers = 0;
+    s.finished = false;
+    s.failed = false;
+    s.out.clear();
+    s.out_off = 0;
+    s.attaching = false;
+}
+
+bool session_attach_shm(Session& s) {
+    // The socket is non-blocking, the rings may not be there yet.
+    struct pollfd pfd = {s.fd, POLLIN, 0};
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) syserr("poll()");
+    }
+    int memfd;
+    if (recv_fds(s.fd, &memfd, 1) != 1) {
+        error("%sno shared memory from the server", s.prefix.c_str());
+        return false;
+    }
+    s.shm = shm_map(memfd);
+    close(memfd);
+    if (!s.shm) {
+        error("%scannot map shared memory of the server", s.prefix.c_str());
+        return false;
+    }
+    return true;
+}
+
+void session_close(Session& s) {
+    close(s.fd);
+    shm_unmap(s.shm);
+    s.fd = -1;
+    s.shm = nullptr;
+}
+
+// Reads everything waiting in the ring of session s into its buffer.
+// Returns the number of bytes read.
+static size_t read_ring(Session& s) {
+    size_t total = 0;
+    while (true) {
+        if (s.buf_end == s.buf.size()) s.buf.resize(2 * s.buf.size());
+        bool wake;
+        size_t n = ring_read(s.shm->to_client, &s.buf[s.buf_end],
+                             s.buf.size() - s.buf_end, wake);
+        if (wake) ring_doorbell(s.fd);
+        if (n == 0) return total;
+        s.buf_end += n;
+        total += n;
+    }
+}
+
+short session_events(const Session& s) {
+    // The server of a shm session rings the doorbell once it makes room,
+    // that is POLLIN as well.
+    return POLLIN | (!s.shm && s.out_off < s.out.size() ? POLLOUT : 0);
+}
+
+// The server closes the connection right after SCORING, so a PUT may cross
+// it on the way; then the write fails, but SCORING is still waiting to be
+// read, and a real disconnect is noticed by the next read anyway.
+void flush_output(Session& s) {
+    if (s.shm && s.out_off < s.out.size()) {
+        // What doesn't fit waits, ring_write asked the server for the doorbell.
+        bool was_empty;
+        s.out_off += ring_write(s.shm->to_server, s.out.data() + s.out_off,
+                                s.out.size() - s.out_off, was_empty);
+        if (was_empty) ring_doorbell(s.fd);
+        if (s.out_off < s.out.size()) return;
+    }
+    while (s.out_off < s.out.size()) {
+        ssize_t n = send(s.fd, s.out.data() + s.out_off, s.out.size() - s.out_off,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno != EPIPE && errno != ECONNRESET) syserr("write()");
+            break;
+        }
+        s.out_off += (size_t)n;
+    }
+    s.out.clear();
+    s.out_off = 0;
+}
+
+// Writes messages to the server of session s, the part the connection
+// doesn't take at once waits in s.out.
+static void write_msgs(Session& s, const std::string& message) {
+    if (s.out_off > 0) {
+        s.out.erase(0, s.out_off);
+        s.out_off = 0;
+    }
+    s.out += message;
+    flush_output(s);
+}
+
+// Returns the time of a monotonic clock in milliseconds.
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void connector_start(Connector& c, const struct addrinfo* ai, int stagger_ms) {
+    c.order.clear();
+    c.attempts.clear();
+    c.attempt_ai.clear();
+    c.next = 0;
+    c.stagger_ms = stagger_ms;
+    c.next_start = now_ms();
+    c.last_errno = ECONNREFUSED;
+    if (ai->ai_family == AF_UNIX) {
+        c.order.push_back(ai);
+        return;
+    }
+    // The family preferred by getaddrinfo goes first, then they alternate.
+    std::vector<const struct addrinfo*> preferred, other;
+    for (const struct addrinfo* a = ai; a; a = a->ai_next) {
+        (a->ai_family == ai->ai_family ? preferred : other).push_back(a);
+    }
+    for (size_t i = 0; i < preferred.size() || i < other.size(); i++) {
+        if (i < preferred.size()) c.order.push_back(preferred[i]);
+        if (i < other.size()) c.order.push_back(other[i]);
+    }
+}
+
+bool connector_step(Connector& c, int& fd, const struct addrinfo*& winner) {
+    fd = -1;
+    if (c.next == 0 && c.order.size() == 1 && c.order[0]->ai_family == AF_UNIX) {
+        // A local connect doesn't hang, and a non-blocking one fails
+        // instead of waiting when the backlog is full.
+        const struct addrinfo* a = c.order[c.next++];
+        int unix_fd = socket(a->ai_family, a->ai_socktype, 0);
+        if (unix_fd < 0) return false;
+        if (connect(unix_fd, a->ai_addr, a->ai_addrlen) < 0) {
+            c.last_errno = errno;
+            close(unix_fd);
+            errno = c.last_errno;
+            return false;
+        }
+        fcntl(unix_fd, F_SETFL, fcntl(unix_fd, F_GETFL, 0) | O_NONBLOCK);
+        fd = unix_fd;
+        winner = a;
+        return true;
+    }
+    // Checks the attempts that poll reported.
+    for (size_t i = 0; i < c.attempts.size();) {
+        if (c.attempts[i].revents == 0) {
+            i++;
+            continue;
+        }
+        int attempt_fd = c.attempts[i].fd;
+        int err = 0;
+        socklen_t len = sizeof err;
+        if (getsockopt(attempt_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+        if (err == 0) {
+            connector_stop(c, attempt_fd);
+            fd = attempt_fd;
+            winner = c.attempt_ai[i];
+            return true;
+        }
+        // A failed attempt lets the next one start at once.
+        c.last_errno = err;
+        close(attempt_fd);
+        c.attempts.erase(c.attempts.begin() + i);
+        c.attempt_ai.erase(c.attempt_ai.begin() + i);
+        c.next_start = now_ms();
+    }
+    // Starts the next attempt if it is due, or if nothing else is going on.
+    while (c.next < c.order.size() && (c.attempts.empty() || now_ms() >= c.next_start)) {
+        const struct addrinfo* a = c.order[c.next++];
+        int attempt_fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK, a->ai_protocol);
+        if (attempt_fd < 0) {
+            c.last_errno = errno;
+            continue;
+        }
+        if (connect(attempt_fd, a->ai_addr, a->ai_addrlen) == 0) {
+            // Connected at once, it is reported by the next poll.
+            c.attempts.push_back({attempt_fd, POLLOUT, POLLOUT});
+            c.attempt_ai.push_back(a);
+            break;
+        } else if (errno == EINPROGRESS) {
+            c.attempts.push_back({attempt_fd, POLLOUT, 0});
+            c.attempt_ai.push_back(a);
+            c.next_start = now_ms() + c.stagger_ms;
+        } else {
+            c.last_errno = errno;
+            close(attempt_fd);
+        }
+    }
+    if (c.attempts.empty()) {
+        errno = c.last_errno;
+        return false;
+    }
+    return true;
+}
+
+int connector_timeout(const Connector& c) {
+    for (const struct pollfd& attempt : c.attempts) {
+        if (attempt.revents != 0) return 0;
+    }
+    if (c.next >= c.order.size()) return -1;
+    return (int)std::max<int64_t>(0, c.next_start - now_ms());
+}
+
+void connector_stop(Connector& c, int keep) {
+    for (const struct pollfd& attempt : c.attempts) {
+        if (attempt.fd != keep) close(attempt.fd);
     }
-    std::cout << "Sending HELLO, player id: " << player_id << ".\n";
-    return 0;
+    c.attempts.clear();
+    c.attempt_ai.clear();
 }
 
-void send_PUT(int point, double value, int fd) {
+int connect_any(const struct addrinfo* ai, int stagger_ms,
+                const struct addrinfo*& winner) {
+    Connector c;
+    connector_start(c, ai, stagger_ms);
+    while (true) {
+        int fd;
+        if (!connector_step(c, fd, winner)) syserr("connect()");
+        if (fd >= 0) return fd;
+        int timeout = connector_timeout(c);
+        for (struct pollfd& attempt : c.attempts) attempt.revents = 0;
+        if (poll(c.attempts.data(), c.attempts.size(), timeout) < 0 && errno != EINTR) {
+            syserr("poll()");
+        }
+    }
+}
+
+void send_HELLO(Session& s) {
+    std::string message = "HELLO " + s.player_id + "\r\n";
+    write_msgs(s, message);
+    std::cout << s.prefix << "Sending HELLO, player id: " << s.player_id << ".\n";
+}
+
+// Appends PUT message for point, value to message.
+static void format_PUT(int point, double value, std::string& message) {
     std::ostringstream oss;
     oss << "PUT " << point << " " << std::fixed << std::setprecision(7) <<
                      value << "\r\n";
-    std::string message = oss.str();
-    
-    if (writen(fd, message.c_str(), message.size()) != (ssize_t)message.size())
-    {
-        syserr("write()");
-    }
+    message += oss.str();
+}
+
+// Prints the diagnostic line about putting value in point.
+static void print_PUT(const Session& s, int point, double value) {
     std::ostringstream formatted_value;
     formatted_value << std::fixed << std::setprecision(7) << value;
-    std::cout << "Putting " << formatted_value.str() << " in " << point << ".\n";
+    std::cout << s.prefix << "Putting " << formatted_value.str() << " in " <<
+                point << ".\n";
+}
+
+void send_PUT(Session& s, int point, double value) {
+    std::string message;
+    format_PUT(point, value, message);
+    
+    write_msgs(s, message);
+    print_PUT(s, point, value);
+}
+
+void send_PUTs(Session& s, const std::vector<std::pair<int, double>>& puts) {
+    if (puts.empty()) return;
+    std::string message;
+    for (auto put : puts) format_PUT(put.first, put.second, message);
+
+    write_msgs(s, message);
+    for (auto put : puts) print_PUT(s, put.first, put.second);
 }
 
 bool get_input_from_stdin(int& point, double& value) {
@@ -64,64 +326,141 @@ bool get_input_from_stdin(int& point, double& value) {
     return true;
 }
 
-// Sends the best PUT message according to an automatic strategy.
-void send_best_PUT(int fd, const std::vector<double>& state_vector,
-                    const std::vector<double>& coeffs) 
-{
-    int k = state_vector.size();
-    int best_point = 0;
-    double biggest_diff = 0;
-    double best_value = 0;
-    for (int i = 0; i < k; i++) {
-        double sum = get_sum_in_x(i, coeffs);
-        double diff = sum - state_vector[i];
-        if (std::abs(diff) > biggest_diff) {
-            best_point = i;
-            biggest_diff = std::abs(diff);
-            if (diff < -5) best_value = -5;
-            else if (diff > 5) best_value = 5;
-            else best_value = diff;
-        }
+// Skips spaces (and the \r of \r\n line ends) in [p, end).
+static const char* skip_spaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+// Parses a line [p, end) of a script, "point value".
+static bool parse_script_line(const char* p, const char* end, int& point,
+                              int64_t& value) {
+    p = skip_spaces(p, end);
+    auto parsed = std::from_chars(p, end, point);
+    if (parsed.ec != std::errc() || parsed.ptr == end ||
+        (*parsed.ptr != ' ' && *parsed.ptr != '\t')) {
+        return false;
     }
-    send_PUT(best_point, best_value, fd);
+    p = skip_spaces(parsed.ptr, end);
+    const char* token = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+    if (!parse_fixed(token, p - token, value)) return false;
+    return skip_spaces(p, end) == end;
 }
 
-std::string receive_msg(int fd) {
-    while (true) {
-        for (size_t i = buf_start; i + 1 < buf_end; ++i) {
-            if (buf[i] == '\r' && buf[i+1] == '\n') {
-                std::string line(buf + buf_start, i - buf_start);
-                size_t new_start = i + 2;
-                size_t rem = buf_end - new_start;
-                if (rem > 0) {
-                    memmove(buf, buf + new_start, rem);
-                }
-                buf_start = 0;
-                buf_end = rem;
-                return line;
-            }
-        }
+void load_script(const std::string& path, Script& script) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) syserr("open(%s)", path.c_str());
+    struct stat st;
+    if (fstat(fd, &st) < 0) syserr("fstat(%s)", path.c_str());
+    size_t size = st.st_size;
+    if (size == 0) fatal("empty script %s", path.c_str());
+    const char* data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) syserr("mmap(%s)", path.c_str());
+    close(fd);
+    madvise((void*)data, size, MADV_SEQUENTIAL);
 
-        if (buf_end == BUF_SIZE) {
-            syserr("read(): buffer overflow");
-        }
-        ssize_t n = read(fd, buf + buf_end, BUF_SIZE - buf_end);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return "";
-            }
-            syserr("read()");
+    const char* end = data + size;
+    size_t line = 1;
+    int point;
+    int64_t value;
+    for (const char* p = data; p < end; line++) {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        if (!parse_script_line(p, eol, point, value)) {
+            fatal("invalid line %zu of %s: %.*s", line, path.c_str(),
+                  (int)std::min<size_t>(eol - p, 80), p);
         }
-        if (n == 0) {
-            fatal("unexpected server disconnect");
+        script.push_back({point, value});
+        p = eol + 1;
+    }
+    munmap((void*)data, size);
+}
+
+void send_script_PUT(Session& s, const Script& script, size_t i) {
+    char value[FIXED_MAX_LEN];
+    size_t len = format_fixed(script[i].second, value, true);
+    std::string point = std::to_string(script[i].first);
+    std::string message = "PUT " + point + ' ';
+    message.append(value, len);
+    message += "\r\n";
+    write_msgs(s, message);
+    std::cout << s.prefix << "Putting " << std::string(value, len) << " in " << point << ".\n";
+}
+
+// Sends the best PUT messages according to the strategy of the session,
+// all of them in one write. With a plan its next PUT is sent instead.
+void send_best_PUTs(Session& s) {
+    if (s.plan) {
+        if (s.plan_next < s.plan->size()) {
+            send_script_PUT(s, *s.plan, s.plan_next++);
         }
-        buf_end += (size_t)n;
+        return;
     }
+    std::vector<std::pair<int, double>> puts;
+    strategy_plan_puts(s.strategy, puts);
+    send_PUTs(s, puts);
 }
 
+// Reads the data of a shared memory session. The doorbells on the socket
+// are only looked at once the ring is empty.
+// Returns false if the server disconnected.
+static bool receive_shm(Session& s) {
+    if (read_ring(s) > 0) return true;
+    bool open = drain_doorbell(s.fd);
+    return read_ring(s) > 0 || open;
+}
+
+bool receive_data(Session& s) {
+    if (s.buf_start > 0) {
+        memmove(&s.buf[0], &s.buf[s.buf_start], s.buf_end - s.buf_start);
+        s.buf_end -= s.buf_start;
+        s.buf_scan -= std::min(s.buf_scan, s.buf_start);
+        s.buf_start = 0;
+    }
+    if (s.buf_end == s.buf.size()) {
+        // A message longer than the buffer, e.g. STATE for a big K.
+        s.buf.resize(2 * s.buf.size());
+    }
+    ssize_t n = 0;
+    if (s.shm) {
+        if (receive_shm(s)) return true;
+    } else {
+        n = read(s.fd, &s.buf[s.buf_end], s.buf.size() - s.buf_end);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return true;
+        }
+    }
+    if (n <= 0) {
+        if (n == 0) errno = 0;
+        error("%sunexpected server disconnect", s.prefix.c_str());
+        s.failed = true;
+        return false;
+    }
+    s.buf_end += (size_t)n;
+    return true;
+}
 
+bool receive_msg(Session& s, const char*& msg, size_t& len) {
+    const char* buf = s.buf.data();
+    size_t i = std::max(s.buf_scan, s.buf_start);
+    while (i < s.buf_end) {
+        const char* nl = (const char*)memchr(buf + i, '\n', s.buf_end - i);
+        if (!nl) break;
+        i = nl - buf + 1;
+        if (nl > buf + s.buf_start && nl[-1] == '\r') {
+            msg = buf + s.buf_start;
+            len = nl - 1 - msg;
+            s.buf_start = s.buf_scan = i;
+            return true;
+        }
+    }
+    // The rest was searched already, only new data is searched next time.
+    s.buf_scan = s.buf_end;
+    return false;
+}
 
-bool handle_penalty_message(std::istringstream& iss) {
+bool handle_penalty_message(std::istringstream& iss, Session& s) {
     int point;
     std::string value_str;
     double value;
@@ -129,14 +468,14 @@ bool handle_penalty_message(std::istringstream& iss) {
     if (!is_valid_decimal(value_str)) return false;
 
     value = std::stod(value_str);
-    std::cout << "Received PENALTY for point " << point << " with value " <<
-                 value << ".\n";
+    std::cout << s.prefix << "Received PENALTY for point " << point <<
+                 " with value " << value << ".\n";
+    s.answers++;
+    if (s.auto_mode) strategy_on_penalty(s.strategy, point, value);
     return true;
 }
 
-bool handle_bad_put_message(std::istringstream& iss, int fd, bool auto_mode,
-                            const std::vector<double>& state_vector,
-                            const std::vector<double>& coeffs) {
+bool handle_bad_put_message(std::istringstream& iss, Session& s) {
     int point;
     std::string value_str;
     double value;
@@ -144,17 +483,16 @@ bool handle_bad_put_message(std::istringstream& iss, int fd, bool auto_mode,
     if (!is_valid_decimal(value_str)) return false;
     
     value = std::stod(value_str);
-    std::cout << "Received BAD_PUT for point " << point << " with value " <<
-                 value << ".\n";
-    if (auto_mode) send_best_PUT(fd, state_vector, coeffs);
+    std::cout << s.prefix << "Received BAD_PUT for point " << point <<
+                 " with value " << value << ".\n";
+    s.answers++;
+    if (s.auto_mode) send_best_PUTs(s);
     return true;
 }
 
-bool handle_coeff_message(std::istringstream& iss, std::vector<double>& coeffs,
-                        bool auto_mode, 
-                        const std::vector<double>& state_vector, int fd,
-                        std::vector<std::pair<int, double>>& pending_puts) {
-    if (!(state_vector.empty() || coeffs.empty())) {
+bool handle_coeff_message(std::istringstream& iss, Session& s) {
+    std::vector<double>& coeffs = s.coeffs;
+    if (!(s.state_vector.empty() || coeffs.empty())) {
         return false;
     }
     std::string coeff_str;
@@ -162,41 +500,42 @@ bool handle_coeff_message(std::istringstream& iss, std::vector<double>& coeffs,
     bool ok = true;
     while ((iss >> coeff_str)) {
         if (!is_valid_decimal(coeff_str)) {
-            std::cout << "Invalid decimal number in coeff\n";
+            std::cout << s.prefix << "Invalid decimal number in coeff\n";
             ok = false;
             break;
         }
         coeff = std::stod(coeff_str);
         if (std::abs(coeff) > 100) {
-            std::cout << "Bigger than 100 coeff\n";
+            std::cout << s.prefix << "Bigger than 100 coeff\n";
             ok = false;
             break;
         }
         coeffs.push_back(coeff);
     }
     if (ok == false || coeffs.size() > 9 || coeffs.size() < 2) {
-        std::cout << "ok: " << ok << "\n";
+        std::cout << s.prefix << "ok: " << ok << "\n";
         coeffs.clear();
         return false;
     }
-    std::cout << "Received coefficients";
+    std::cout << s.prefix << "Received coefficients";
     for (double n : coeffs) {
         std::cout << " " << n;
     }
     std::cout << ".\n";
-    if (auto_mode) {
-        send_PUT(0, 0, fd);
+    if (s.auto_mode) {
+        strategy_init(s.strategy, coeffs);
+        send_best_PUTs(s);
     }
     else {
-        for (auto put : pending_puts) {
-            send_PUT(put.first, put.second, fd);
+        for (auto put : s.pending_puts) {
+            send_PUT(s, put.first, put.second);
         }
     }
-    pending_puts.clear();
+    s.pending_puts.clear();
     return true;
 }
 
-bool handle_scoring_message(std::istringstream& iss, bool& exit) {
+bool handle_scoring_message(std::istringstream& iss, Session& s) {
     std::string message = "Game end, scoring:";
     std::string player;
     std::string score_str;
@@ -205,72 +544,77 @@ bool handle_scoring_message(std::istringstream& iss, bool& exit) {
         if (!is_valid_decimal(score_str)) return false;
         message += " " + player + " " + score_str;
     }
-    std::cout << message << ".\n";
-    exit = true;
+    std::cout << s.prefix << message << ".\n";
+    s.finished = true;
     return true;
 }
 
-bool handle_state_message(std::istringstream& iss,
-                        const std::vector<double>& coeffs,
-                        bool auto_mode, 
-                        std::vector<double>& state_vector, int fd) {
-    size_t k = state_vector.size();
-    std::vector<double> tmp_state;
-    bool known_size = k == 0 ? false : true;
-    int counter = 0;
-    std::string r_str;
-    double r;
-    std::string message = "Received state";
-    while (!iss.eof()) {
-        if (!(iss >> r_str)) return false;
-        counter++;
-        if (!is_valid_decimal(r_str)) return false;
-        message += " " + r_str;
-        r = std::stod(r_str);
-        tmp_state.push_back(r);
-    }
-    if (known_size && tmp_state.size() != k) return false;
-    if (known_size) 
-        for (size_t i = 0; i < k; i++) state_vector[i] = tmp_state[i];
-    else
-        for (double point : tmp_state) state_vector.push_back(point);
-    std::cout << message << ".\n";
-    
-    if (auto_mode)
-        send_best_PUT(fd, state_vector, coeffs);
-    return true;
+// Parses the values of STATE, args of length len, straight into the state
+// of the session, with no copies or allocations once K is known. The
+// values are read in units of 1e-7 and then divided, which gives the same
+// doubles as std::stod.
+static bool decode_state(Session& s, const char* args, size_t len) {
+    std::vector<double>& state_vector = s.state_vector;
+    bool known_size = !state_vector.empty();
+    const char* p = args;
+    const char* end = args + len;
+    size_t count = 0;
+    while (p < end) {
+        if (*p++ != ' ') return false;
+        const char* token = p;
+        while (p < end && *p != ' ') p++;
+        int64_t value;
+        if (!parse_fixed(token, p - token, value)) return false;
+        double r = (double)value / FIXED_ONE;
+        if (!known_size) {
+            state_vector.push_back(r);
+        } else if (count < state_vector.size()) {
+            state_vector[count] = r;
+        } else {
+            return false;
+        }
+        count++;
+    }
+    return count > 0 && count == state_vector.size();
 }
 
+bool handle_state_message(Session& s, const char* args, size_t len) {
+    if (!decode_state(s, args, len)) return false;
+    s.answers++;
+    if (s.auto_mode) {
+        strategy_set_state(s.strategy, s.state_vector);
+        send_best_PUTs(s);
+    }
+    // Printed only after the next PUT went out, it doesn't delay it.
+    if (s.print_state) {
+        std::cout << s.prefix << "Received state";
+        std::cout.write(args, len);
+        std::cout << ".\n";
+    }
+    return true;
+}
 
-
-bool handle_message(const std::string& msg, std::vector<double>& coeffs, 
-                    bool auto_mode,
-                    std::vector<double>& state_vector, int fd,
-                    std::vector<std::pair<int, double>>& pending_puts,
-                    bool& exit) {
-        std::istringstream iss(msg);
+bool handle_message(Session& s, const char* msg, size_t len) {
+        // STATE is the only message that comes often and can be long.
+        if (len >= 5 && memcmp(msg, "STATE", 5) == 0 && (len == 5 || msg[5] == ' ')) {
+            return handle_state_message(s, msg + 5, len - 5);
+        }
+        std::istringstream iss(std::string(msg, len));
         std::string command;
         if (!(iss >> command))
             return false;
         
         if (command == "COEFF") {
-            return handle_coeff_message(iss, coeffs, auto_mode, state_vector,
-                                        fd, pending_puts);
+            return handle_coeff_message(iss, s);
         }   
-        else if (command == "STATE") {
-            return handle_state_message(iss, coeffs, auto_mode,
-                                        state_vector, fd);
-        }
         else if (command == "SCORING") {
-            return handle_scoring_message(iss, exit);
+            return handle_scoring_message(iss, s);
         }
         else if (command == "BAD_PUT") {
-            return handle_bad_put_message(iss, fd, auto_mode, state_vector,
-                                            coeffs);
+            return handle_bad_put_message(iss, s);
         }
         else if (command == "PENALTY") {
-            return handle_penalty_message(iss);
+            return handle_penalty_message(iss, s);
         }
         else return false;
 }
-
@@ -1,32 +1,175 @@
 #ifndef CLIENT_UTILS_H
 #define CLIENT_UTILS_H
 
+#include <stdint.h>
+#include <netdb.h>
+#include <poll.h>
 #include <string>
 #include <vector>
 
+#include "client-strategy.h"
+#include "shm-ring.h"
 
-// Sends HELLO message to the tcp connection represented by descriptor fd.
-// Returns 0 on success and -1 on error.
-int send_HELLO(const std::string& player_id, int fd);
+// PUTs of a script or a plan, "point value" per line, values in units of 1e-7.
+typedef std::vector<std::pair<int, int64_t>> Script;
 
-// Sends PUT message to the tcp connection represented by descriptor fd.
+// Connection attempts of connect_any, for a client that goes on with its
+// other connections while this one is made.
+typedef struct {
+    // Addresses in the order they are tried, order[next] is the next one.
+    std::vector<const struct addrinfo*> order;
+    size_t next;
+    // When the next attempt starts, in milliseconds of a monotonic clock.
+    int64_t next_start;
+    int stagger_ms;
+    int last_errno;
+    // Attempts in progress, to be polled, and their addresses.
+    std::vector<struct pollfd> attempts;
+    std::vector<const struct addrinfo*> attempt_ai;
+} Connector;
+
+// Everything the client knows about one connection to the server
+// and the game played on it.
+typedef struct {
+    // Descriptor of the tcp connection, -1 if not connected.
+    int fd;
+    // True if the session connects with the shared memory transport.
+    bool use_shm;
+    // Rings of the shared memory transport, nullptr for socket connections.
+    // The socket then only carries doorbells.
+    ShmSegment* shm;
+    std::string player_id;
+    // Printed before every diagnostic line, to tell the sessions apart.
+    std::string prefix;
+    // Data received from the server, buf[buf_start, buf_end) isn't parsed yet.
+    std::string buf;
+    size_t buf_start;
+    size_t buf_end;
+    // buf[buf_start, buf_scan) has no message end, it isn't searched again.
+    size_t buf_scan;
+    // Coefficients of the polynomial, empty before COEFF.
+    std::vector<double> coeffs;
+    // Last state received from the server.
+    std::vector<double> state_vector;
+    // False if STATE isn't printed.
+    bool print_state;
+    // PUTs read before COEFF, sent once it arrives.
+    std::vector<std::pair<int, double>> pending_puts;
+    // True if the PUTs are chosen by strategy.
+    bool auto_mode;
+    Strategy strategy;
+    // PUTs played in auto mode instead of the ones of the strategy, one
+    // after every answer, nullptr if there are none.
+    const Script* plan;
+    // Index of the next PUT of the plan in the current game.
+    size_t plan_next;
+    // Number of PUTs answered in the current game, with STATE, BAD_PUT or
+    // PENALTY.
+    size_t answers;
+    // Set when SCORING is received.
+    bool finished;
+    // Set when the connection broke before SCORING.
+    bool failed;
+    // Messages not written yet, from out_off on. The socket is
+    // non-blocking, they wait for POLLOUT (for room in the ring and the
+    // doorbell of a shm session).
+    std::string out;
+    size_t out_off;
+    // True while connector is connecting the session.
+    bool connecting;
+    // True while a shared memory session waits for the rings of the
+    // server, HELLO is sent once they are attached.
+    bool attaching;
+    Connector connector;
+} Session;
+
+// Prepares session s for a new game on the connection fd.
+void session_reset(Session& s, int fd);
+
+// Receives the rings of the shared memory transport from the server over
+// the unix socket of session s. Prints the error and returns false on error.
+bool session_attach_shm(Session& s);
+
+// Closes the connection of session s.
+void session_close(Session& s);
+
+// Default delay between two connection attempts of connect_any, in
+// milliseconds, the one recommended by RFC 8305.
+constexpr int CONNECT_STAGGER_MS = 250;
+
+// Connects to one of the addresses of the list ai the way RFC 8305 (happy
+// eyeballs) does: the attempts alternate between the address families and
+// are non-blocking, a new one starts every stagger_ms milliseconds (or at
+// once when one fails) while the earlier ones go on. The first one that
+// connects wins and the others are closed. Returns the socket, in
+// non-blocking mode, and sets winner. Exits if no address can be reached.
+int connect_any(const struct addrinfo* ai, int stagger_ms,
+                const struct addrinfo*& winner);
+
+// The steps of connect_any, for a poll loop. connector_start begins
+// connecting c to the addresses ai.
+void connector_start(Connector& c, const struct addrinfo* ai, int stagger_ms);
+
+// Checks the attempts of c that were polled (their revents) and starts the
+// ones that are due. Sets fd to the connected socket, in non-blocking mode,
+// and winner once an attempt connects, fd to -1 while they go on. Returns
+// false with errno set if no address can be reached.
+bool connector_step(Connector& c, int& fd, const struct addrinfo*& winner);
+
+// Returns the time in milliseconds until connector_step has to be called
+// even without events of the attempts, -1 if not needed.
+int connector_timeout(const Connector& c);
+
+// Closes the attempts of c, except the socket keep.
+void connector_stop(Connector& c, int keep = -1);
+
+// Returns the events to poll the connection of session s for.
+short session_events(const Session& s);
+
+// Writes as much of the messages waiting in session s as the connection
+// takes without blocking.
+void flush_output(Session& s);
+
+// Sends HELLO message of the session. A failed write is noticed by the
+// next read from the server.
+void send_HELLO(Session& s);
+
+// Sends PUT message to the server of the session.
 // Prints the error and exits on error.
-void send_PUT(int point, double value, int fd);
+void send_PUT(Session& s, int point, double value);
+
+// Sends all PUT messages from puts in a single write.
+// Prints the error and exits on error.
+void send_PUTs(Session& s, const std::vector<std::pair<int, double>>& puts);
+
+// Reads the script at path, one "point value" per line (the input of the
+// client, or a plan written by approx-solve -o). The file is mapped and
+// checked in a single pass, exits with the line on error.
+void load_script(const std::string& path, Script& script);
+
+// Sends the PUT script[i], with the value exactly as the script has it.
+// The server answers every PUT before it takes the next one without a
+// PENALTY, so a script is sent one PUT per answer.
+void send_script_PUT(Session& s, const Script& script, size_t i);
 
 // Gets the point and value from STDIN. Prints error when wrong line format.
 bool get_input_from_stdin(int& point, double& value);
 
-// Reads a message from the socket represented by fd descriptor.
-// Returns either the whole message or empty string if didn't read
-// whole message. It may be called multiple times until it returns
-// non-empty string because it buffers the message.
-std::string receive_msg(int fd);
+// Reads once from the socket of the session into its buffer. Should be
+// called when the socket is readable. If the server disconnected, prints
+// the error, sets failed and returns false. With shared memory everything
+// waiting in the ring is read.
+bool receive_data(Session& s);
+
+// Takes the next whole message (without \r\n) out of the buffer of the
+// session: msg points to its len chars in the buffer, until the next
+// receive_data. Returns false if there is no whole message yet.
+bool receive_msg(Session& s, const char*& msg, size_t& len);
 
 // Parses the message and then based on the type handles the message 
 // (displays necessary diagnostic output, sends a response etc.).
+// In auto mode the PUTs are chosen by the strategy of the session.
 // Returns true if success and false if wrong message.
-bool handle_message(const std::string& msg, std::vector<double>& coeffs,
-                    bool auto_mode, std::vector<double>& state_vector, int fd,
-                    std::vector<std::pair<int, double>>& pending_puts, bool& exit);
+bool handle_message(Session& s, const char* msg, size_t len);
 
-#endif
\ No newline at end of file
+#endif
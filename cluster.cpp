@@ -0,0 +1,269 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+#include "cluster.h"
+#include "common.h"
+#include "err.h"
+#include "leaderboard.h"
+
+using Clock     = std::chrono::steady_clock;
+using TimePoint = Clock::time_point;
+
+// A worker that exits sooner than this after its start is started again
+// only after this time, so a worker that can't run doesn't spin.
+static constexpr auto RESTART_DELAY = std::chrono::seconds(1);
+
+// Worker process as seen by the coordinator.
+typedef struct {
+    pid_t pid;
+    int sock;              // Socket to the worker, -1 while it isn't running.
+    std::string in;        // Part of a line the worker hasn't finished yet.
+    TimePoint started;
+    TimePoint restart_at;  // When a stopped worker is started again.
+    size_t clients;        // Players of the worker, by its last report.
+    size_t passed;         // Connections passed since its last report.
+    uint64_t games;
+    uint64_t restarts;
+    long coeff_offset;     // Where the next worker with this index starts,
+    int coeff_skip;        // by its last COEFF, -1 once the file is exhausted.
+} Worker;
+
+// Set by the SIGUSR1 handler, asks the coordinator to print the health
+// of the workers.
+static volatile sig_atomic_t health_requested = 0;
+
+static void on_sigusr1(int) {
+    health_requested = 1;
+}
+
+// Starts the i-th worker.
+static void start_worker(std::vector<Worker>& workers, size_t i,
+                         const std::vector<ClusterListener>& listeners,
+                         const std::function<void(const WorkerStart&)>& start) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) syserr("socketpair()");
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) syserr("fork()");
+    if (pid == 0) {
+        close(sv[0]);
+        for (const ClusterListener& l : listeners) close(l.fd);
+        for (const Worker& w : workers) {
+            if (w.sock >= 0) close(w.sock);
+        }
+        signal(SIGUSR1, SIG_DFL);
+        start({(int)i, sv[1], workers[i].coeff_offset, workers[i].coeff_skip});
+        _exit(1);
+    }
+    close(sv[1]);
+    // A worker that stopped reading must not stop the coordinator.
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+    Worker& w = workers[i];
+    w.pid = pid;
+    w.sock = sv[0];
+    w.in.clear();
+    w.started = Clock::now();
+    w.clients = 0;
+    w.passed = 0;
+    std::cout << "Worker " << i << " started, pid " << pid << ".\n";
+}
+
+// Forgets the i-th worker once its socket was closed and schedules its
+// restart. Its players are gone with it.
+static void stop_worker(std::vector<Worker>& workers, size_t i) {
+    Worker& w = workers[i];
+    close(w.sock);
+    w.sock = -1;
+    int status = 0;
+    while (waitpid(w.pid, &status, 0) < 0 && errno == EINTR) {}
+    std::cout << "Worker " << i << " (pid " << w.pid << ") ";
+    if (WIFSIGNALED(status)) std::cout << "killed by signal " << WTERMSIG(status);
+    else std::cout << "exited with status " << WEXITSTATUS(status);
+    std::cout << ", " << w.clients + w.passed << " players lost.\n";
+    auto now = Clock::now();
+    w.restart_at = now - w.started < RESTART_DELAY ? now + RESTART_DELAY : now;
+    if (w.coeff_offset < 0) {
+        std::cout << "Worker " << i << " is not started again, the coefficient file "
+                     "is exhausted.\n";
+        return;
+    }
+    w.restarts++;
+}
+
+// Handles a whole line from the i-th worker.
+static void handle_report(Worker& w, size_t i, const std::string& line) {
+    if (line.compare(0, 8, "SCORING ") == 0) {
+        w.games++;
+        std::cout << "Worker " << i << ": " << line << "\n";
+        leaderboard_add(std::make_shared<const std::string>(line));
+        return;
+    }
+    std::istringstream iss(line);
+    std::string kind;
+    iss >> kind;
+    size_t clients;
+    uint64_t games;
+    long offset;
+    int skip;
+    if (kind == "HEALTH" && iss >> clients >> games) {
+        w.clients = clients;
+        w.passed = 0;
+    } else if (kind == "COEFF" && iss >> offset >> skip) {
+        w.coeff_offset = offset;
+        w.coeff_skip = skip;
+    } else {
+        error("bad report from worker %zu: %s", i, line.c_str());
+    }
+}
+
+// Reads the reports of the i-th worker. Returns false once it is gone.
+static bool read_reports(Worker& w, size_t i) {
+    char buf[4096];
+    while (true) {
+        ssize_t n = read(w.sock, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) return false;
+        w.in.append(buf, (size_t)n);
+    }
+    size_t nl;
+    while ((nl = w.in.find('\n')) != std::string::npos) {
+        handle_report(w, i, w.in.substr(0, nl));
+        w.in.erase(0, nl + 1);
+    }
+    return true;
+}
+
+// Passes the connection fd to the running worker with the fewest players.
+// The connection is closed if no worker takes it.
+static void pass_connection(std::vector<Worker>& workers, int fd, char tag) {
+    std::vector<size_t> order;
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i].sock >= 0) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return workers[a].clients + workers[a].passed <
+               workers[b].clients + workers[b].passed;
+    });
+    for (size_t i : order) {
+        if (send_fds(workers[i].sock, &fd, 1, tag)) {
+            workers[i].passed++;
+            close(fd);
+            return;
+        }
+    }
+    error("no worker to take a new connection");
+    close(fd);
+}
+
+// Prints the health of the workers.
+static void print_health(const std::vector<Worker>& workers, std::ostream& os) {
+    uint64_t games = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        const Worker& w = workers[i];
+        games += w.games;
+        os << "worker_" << i << "_pid " << (w.sock >= 0 ? w.pid : 0) << "\n"
+           << "worker_" << i << "_clients " << w.clients + w.passed << "\n"
+           << "worker_" << i << "_games " << w.games << "\n"
+           << "worker_" << i << "_restarts " << w.restarts << "\n";
+    }
+    os << "cluster_games " << games << "\n";
+    leaderboard_print(os);
+}
+
+void cluster_run(const std::vector<ClusterListener>& listeners, int count,
+                 std::function<void(const WorkerStart&)> start) {
+    std::vector<Worker> workers(count);
+    for (int i = 0; i < count; i++) {
+        workers[i].sock = -1;
+        workers[i].coeff_offset = 0;
+        workers[i].coeff_skip = i;
+    }
+    for (int i = 0; i < count; i++) start_worker(workers, i, listeners, start);
+    signal(SIGUSR1, on_sigusr1);
+
+    std::vector<pollfd> pollfds;
+    while (true) {
+        auto now = Clock::now();
+        int timeout = -1;
+        size_t exhausted = 0;
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (workers[i].sock >= 0) continue;
+            if (workers[i].coeff_offset < 0) {
+                exhausted++;
+            } else if (now >= workers[i].restart_at) {
+                start_worker(workers, i, listeners, start);
+            } else {
+                int ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            workers[i].restart_at - now).count() + 1;
+                if (timeout < 0 || ms < timeout) timeout = ms;
+            }
+        }
+        if (exhausted == workers.size()) {
+            print_health(workers, std::cerr);
+            fatal("Coefficient file exhausted.");
+        }
+
+        // First come the listening sockets, then the workers.
+        pollfds.clear();
+        for (const ClusterListener& l : listeners) pollfds.push_back({l.fd, POLLIN, 0});
+        for (const Worker& w : workers) pollfds.push_back({w.sock, POLLIN, 0});
+        int ready = poll(pollfds.data(), pollfds.size(), timeout);
+        if (ready < 0 && errno != EINTR) syserr("poll()");
+        if (health_requested) {
+            health_requested = 0;
+            print_health(workers, std::cerr);
+        }
+        if (ready <= 0) continue;
+
+        size_t base = listeners.size();
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker& w = workers[i];
+            if (w.sock < 0 || !(pollfds[base + i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if (!read_reports(w, i)) stop_worker(workers, i);
+        }
+        for (size_t i = 0; i < base; i++) {
+            if (!(pollfds[i].revents & POLLIN)) continue;
+            int fd = accept(listeners[i].fd, nullptr, nullptr);
+            if (fd >= 0) pass_connection(workers, fd, listeners[i].tag);
+        }
+        std::cout.flush();
+    }
+}
+
+bool cluster_receive(int sock, int& fd, char& tag) {
+    int n = recv_fds(sock, &fd, 1, &tag);
+    if (n != 1) fd = -1;
+    return n >= 0;
+}
+
+void cluster_report_health(int sock, size_t clients, uint64_t games) {
+    std::string line = "HEALTH " + std::to_string(clients) + " " +
+                       std::to_string(games) + "\n";
+    writen(sock, line.data(), line.size());
+}
+
+void cluster_report_coeff(int sock, long coeff_offset, int coeff_skip) {
+    std::string line = "COEFF " + std::to_string(coeff_offset) + " " +
+                       std::to_string(coeff_skip) + "\n";
+    writen(sock, line.data(), line.size());
+}
+
+void cluster_report_scoring(int sock, const std::string& scoring) {
+    // The message ends with "\r\n", the report with a newline.
+    std::string line = scoring.substr(0, scoring.find('\r')) + "\n";
+    writen(sock, line.data(), line.size());
+}
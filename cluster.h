@@ -0,0 +1,55 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Listener a connection passed to a worker was accepted on, sent as the
+// data byte of send_fds.
+constexpr char FROM_TCP = 't';
+constexpr char FROM_UNIX = 'u';
+constexpr char FROM_SHM = 's';
+
+// Listening socket of the coordinator and the tag of its connections.
+typedef struct {
+    int fd;
+    char tag;
+} ClusterListener;
+
+// What a worker process gets when it is started.
+typedef struct {
+    int index;          // Index of the worker, from 0.
+    int sock;           // Socket to the coordinator.
+    long coeff_offset;  // Position in the coefficient file to start from.
+    int coeff_skip;     // Lines to skip before the first COEFF.
+} WorkerStart;
+
+// Runs the coordinator of a cluster of workers worker processes, never
+// returns. Connections accepted on listeners are passed to the worker
+// with the fewest players. A worker that exits is started again, the
+// others go on with their games, unless it ran out of coefficients; the
+// coordinator exits once all of them did. start is run in every new worker process
+// with the listeners closed, it must not return.
+void cluster_run(const std::vector<ClusterListener>& listeners, int workers,
+                 std::function<void(const WorkerStart&)> start);
+
+// Receives a connection passed by the coordinator over sock into fd and
+// tag, fd is -1 if there was nothing. Returns false if the coordinator is
+// gone.
+bool cluster_receive(int sock, int& fd, char& tag);
+
+// Sends the health of a worker to the coordinator over sock.
+void cluster_report_health(int sock, size_t clients, uint64_t games);
+
+// Sends the position of the coefficients of a worker to the coordinator
+// over sock, after every COEFF, so that a restarted worker goes on right
+// after the last one handed out. offset -1 means the file is exhausted.
+void cluster_report_coeff(int sock, long coeff_offset, int coeff_skip);
+
+// Sends the SCORING message of a finished game to the coordinator over sock.
+void cluster_report_scoring(int sock, const std::string& scoring);
+
+#endif // CLUSTER_H
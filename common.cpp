@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -43,6 +44,16 @@ bool parse_int(const char *s, int minv, int maxv, int &out) {
     return true;
 }
 
+bool parse_uint64(const char *s, uint64_t &out) {
+    if (*s < '0' || *s > '9') return false;
+    errno = 0;
+    char *end;
+    unsigned long long val = strtoull(s, &end, 10);
+    if (errno != 0 || *end != '\0') return false;
+    out = (uint64_t)val;
+    return true;
+}
+
 std::string sockaddr_to_ip(const struct sockaddr* sa) {
     char buf[INET6_ADDRSTRLEN];
     if (sa->sa_family == AF_INET) {
@@ -63,10 +74,23 @@ std::string sockaddr_to_ip(const struct sockaddr* sa) {
         }
         inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof buf);
         return buf;
+    } else if (sa->sa_family == AF_UNIX) {
+        auto* sun = (const struct sockaddr_un*)sa;
+        return std::string("unix:") + sun->sun_path;
     }
     return {};
 }
 
+bool make_unix_addr(const std::string& path, struct sockaddr_un& addr,
+                    socklen_t& len) {
+    if (path.empty() || path.size() >= sizeof addr.sun_path) return false;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path.size() + 1);
+    return true;
+}
+
 
 bool is_valid_decimal(const std::string& str) {
     if (str.empty()) return false;
@@ -114,16 +138,158 @@ bool is_valid_player_id(const std::string& player_id) {
     return true;
 }
 
-double round7(double x) {
-    return std::round(x * 1e7) / 1e7;
+bool parse_fixed(const char* s, size_t len, int64_t& out) {
+    size_t pos = 0;
+    bool negative = false;
+    if (pos < len && s[pos] == '-') {
+        negative = true;
+        pos++;
+    }
+    // The magnitude is accumulated as a negative number, so that the
+    // smallest int64_t can be parsed as well.
+    int64_t acc = 0;
+    size_t int_digits = 0;
+    while (pos < len && s[pos] >= '0' && s[pos] <= '9') {
+        if (__builtin_mul_overflow(acc, (int64_t)10, &acc) ||
+            __builtin_sub_overflow(acc, (int64_t)(s[pos] - '0'), &acc)) {
+            return false;
+        }
+        int_digits++;
+        pos++;
+    }
+    if (int_digits == 0) return false;
+    size_t frac_digits = 0;
+    if (pos < len && s[pos] == '.') {
+        pos++;
+        while (pos < len && s[pos] >= '0' && s[pos] <= '9') {
+            if (++frac_digits > 7) return false;
+            if (__builtin_mul_overflow(acc, (int64_t)10, &acc) ||
+                __builtin_sub_overflow(acc, (int64_t)(s[pos] - '0'), &acc)) {
+                return false;
+            }
+            pos++;
+        }
+    }
+    if (pos != len) return false;
+    for (; frac_digits < 7; frac_digits++) {
+        if (__builtin_mul_overflow(acc, (int64_t)10, &acc)) return false;
+    }
+    if (negative) {
+        out = acc;
+    } else {
+        if (acc == INT64_MIN) return false;
+        out = -acc;
+    }
+    return true;
+}
+
+size_t format_fixed(int64_t x, char* out, bool all_places) {
+    char digits[24];
+    size_t n = 0;
+    uint64_t mag = x < 0 ? -(uint64_t)x : (uint64_t)x;
+    // At least 8 digits, so that there is a digit before the dot.
+    while (mag > 0 || n < 8) {
+        digits[n++] = (char)('0' + mag % 10);
+        mag /= 10;
+    }
+    size_t places = 7;
+    if (!all_places) {
+        while (places > 0 && digits[7 - places] == '0') places--;
+    }
+    size_t len = 0;
+    if (x < 0) out[len++] = '-';
+    for (size_t i = n; i-- > 7;) out[len++] = digits[i];
+    if (places > 0) {
+        out[len++] = '.';
+        for (size_t i = 0; i < places; i++) out[len++] = digits[6 - i];
+    }
+    return len;
+}
+
+std::string fixed_to_string(__int128 x) {
+    std::string digits;
+    unsigned __int128 mag = x < 0 ? -(unsigned __int128)x : (unsigned __int128)x;
+    while (mag > 0 || digits.size() < 8) {
+        digits.push_back((char)('0' + (int)(mag % 10)));
+        mag /= 10;
+    }
+    size_t places = 7;
+    while (places > 0 && digits[7 - places] == '0') places--;
+    std::string out;
+    if (x < 0) out.push_back('-');
+    for (size_t i = digits.size(); i-- > 7;) out.push_back(digits[i]);
+    if (places > 0) {
+        out.push_back('.');
+        for (size_t i = 0; i < places; i++) out.push_back(digits[6 - i]);
+    }
+    return out;
+}
+// SplitMix64 finalizer, a bijection of 64-bit values that mixes the bits.
+static uint64_t splitmix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void generate_coeffs(uint64_t seed, uint64_t row, int n, std::vector<int64_t>& out) {
+    out.clear();
+    for (int j = 0; j <= n; j++) {
+        uint64_t counter = row * (uint64_t)(n + 1) + (uint64_t)j;
+        uint64_t x = splitmix64(seed + (counter + 1) * 0x9e3779b97f4a7c15ULL);
+        // The modulo bias is below 2^-32.
+        out.push_back((int64_t)(x % (uint64_t)(2 * COEFF_MAX + 1)) - COEFF_MAX);
+    }
 }
 
-double get_sum_in_x(int x, const std::vector<double>& coeffs) {
-    double sum = coeffs[0];
-    int exp = 1;
-    for (size_t i = 1; i < coeffs.size(); i++) {
-        exp *= x;
-        sum += coeffs[i] * exp;
+bool send_fds(int sock, const int* fds, size_t n, char tag) {
+    char byte = tag;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MSG)];
+    memset(control, 0, sizeof control);
+    struct msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (n > 0) {
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * n);
     }
-    return sum;
-}
\ No newline at end of file
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == 1;
+}
+
+int recv_fds(int sock, int* fds, size_t max, char* tag) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MSG)];
+    struct msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof control;
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1) return -1;
+    if (tag) *tag = byte;
+    size_t count = 0;
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        size_t got = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < got; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (count < max) fds[count++] = fd;
+            else close(fd);
+        }
+    }
+    return (int)count;
+}
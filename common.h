@@ -4,6 +4,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <string>
 #include <vector>
 
@@ -16,19 +18,67 @@ ssize_t	writen(int fd, const void *vptr, size_t n);
 // satisfy minv <= s <= min then returns false.
 bool parse_int(const char *s, int minv, int maxv, int &out);
 
+// Parses the s string, a decimal number in [0, 2^64 - 1], to out.
+// Returns false if it is anything else.
+bool parse_uint64(const char *s, uint64_t &out);
+
 // Convert sockaddr to human-readable IP string; prefer IPv4 if v4-mapped.
+// Unix domain sockets are shown as "unix:path".
 std::string sockaddr_to_ip(const struct sockaddr* sa);
 
+// Prefix of server addresses that are paths of unix domain sockets.
+constexpr const char UNIX_PREFIX[] = "unix:";
+
+// Fills addr and its length len with the unix domain socket address of
+// path. Returns false if the path is empty or too long.
+bool make_unix_addr(const std::string& path, struct sockaddr_un& addr,
+                    socklen_t& len);
+
 // Checks if the given string represents a valid decimal number.
 bool is_valid_decimal(const std::string& str);
 
 // Validates player_id - checks if it contains only digits and English letters.
 bool is_valid_player_id(const std::string& player_id);
 
-// Returns the double rounded up to 7 decimal places.
-double round7(double x);
+// Number of fixed-point units in 1. Values of the game have at most
+// 7 decimal places, so they are stored exactly as integers in units of 1e-7.
+constexpr int64_t FIXED_ONE = 10000000;
+
+// Longest text written by format_fixed, without the terminating zero.
+constexpr size_t FIXED_MAX_LEN = 28;
+
+// Parses the decimal number s of length len (see is_valid_decimal) into
+// units of 1e-7, using integer arithmetic only. Returns false if s isn't
+// a valid decimal or doesn't fit in 64 bits.
+bool parse_fixed(const char* s, size_t len, int64_t& out);
+
+// Writes x, in units of 1e-7, as a decimal number to out, which must have
+// room for FIXED_MAX_LEN chars. If all_places is set then all 7 decimal
+// places are written, otherwise trailing zeros (and the dot) are dropped.
+// Returns the number of chars written.
+size_t format_fixed(int64_t x, char* out, bool all_places);
+
+// Returns x, in units of 1e-7, as a decimal number without trailing zeros.
+std::string fixed_to_string(__int128 x);
+
+// Largest absolute value of a coefficient accepted by the client.
+constexpr int64_t COEFF_MAX = 100 * FIXED_ONE;
+
+// Generates the coefficients of row row for a polynomial of degree n, in
+// units of 1e-7 and within COEFF_MAX. The coefficients depend only on seed,
+// row and their index, so any row can be computed on its own.
+void generate_coeffs(uint64_t seed, uint64_t row, int n, std::vector<int64_t>& out);
+
+// Most descriptors passed by a single send_fds.
+constexpr size_t MAX_FDS_PER_MSG = 250;
+
+// Sends n (at most MAX_FDS_PER_MSG) descriptors fds over the unix socket
+// sock, with a single byte of data tag. Returns false on error.
+bool send_fds(int sock, const int* fds, size_t n, char tag = 0);
 
-// Calculate the polynomial with coeffs coefficients in point x.
-double get_sum_in_x(int x, const std::vector<double>& coeffs);
+// Receives the descriptors sent by a single send_fds from the unix socket
+// sock into fds, which has room for max of them, blocking. Returns their
+// number or -1 on error. The byte of data is stored in tag, if given.
+int recv_fds(int sock, int* fds, size_t max, char* tag = nullptr);
 
 #endif
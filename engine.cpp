@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <algorithm>
+
+#include "engine.h"
+#include "err.h"
+
+bool poly_value(const std::vector<int64_t>& coeffs, int64_t x, __int128& out) {
+    __int128 sum = 0;
+    for (size_t i = coeffs.size(); i-- > 0;) {
+        if (__builtin_mul_overflow(sum, (__int128)x, &sum) ||
+            __builtin_add_overflow(sum, (__int128)coeffs[i], &sum)) {
+            return false;
+        }
+    }
+    out = sum;
+    return true;
+}
+
+// Calculates the result of the player exactly, in units of 1e-14 (squares
+// of the units of the state). Returns false if it doesn't fit in 128 bits.
+static bool exact_result(const PlayerData& player, __int128& out) {
+    // Squares of differences bigger than this don't fit in 127 bits.
+    const __int128 max_diff = (__int128)1 << 63;
+    __int128 total = (__int128)player.result * FIXED_ONE;
+    for (size_t i = 0; i < player.state.size(); i++) {
+        __int128 value;
+        if (!poly_value(player.coeffs, (int64_t)i, value)) return false;
+        __int128 diff = value - player.state[i];
+        if (diff >= max_diff || diff <= -max_diff) return false;
+        if (__builtin_add_overflow(total, diff * diff, &total)) return false;
+    }
+    out = total;
+    return true;
+}
+
+// Limbs of BigUint. The largest result of a game (K 10000, N 8, all
+// coefficients 100) needs under 300 bits in units of 1e-14.
+#define BIG_LIMBS 12
+
+// Unsigned integer of BIG_LIMBS 32-bit limbs, the least significant first,
+// for the results too big for 128 bits. Every operation that could go past
+// BIG_LIMBS returns false instead.
+typedef struct {
+    uint32_t limb[BIG_LIMBS];
+} BigUint;
+
+// a = a * m + add.
+static bool big_mul_add(BigUint& a, uint32_t m, uint64_t add) {
+    unsigned __int128 carry = add;
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        carry += (unsigned __int128)a.limb[i] * m;
+        a.limb[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    return carry == 0;
+}
+
+// a = a + b.
+static bool big_add(BigUint& a, const BigUint& b) {
+    uint64_t carry = 0;
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        carry += (uint64_t)a.limb[i] + b.limb[i];
+        a.limb[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    return carry == 0;
+}
+
+// Returns a < b.
+static bool big_less(const BigUint& a, const BigUint& b) {
+    for (int i = BIG_LIMBS; i-- > 0;) {
+        if (a.limb[i] != b.limb[i]) return a.limb[i] < b.limb[i];
+    }
+    return false;
+}
+
+// a = a - b, for a >= b.
+static void big_sub(BigUint& a, const BigUint& b) {
+    int64_t borrow = 0;
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        int64_t d = (int64_t)a.limb[i] - b.limb[i] - borrow;
+        borrow = d < 0;
+        a.limb[i] = (uint32_t)(d + (borrow << 32));
+    }
+}
+
+// out = a * a.
+static bool big_square(const BigUint& a, BigUint& out) {
+    uint64_t wide[2 * BIG_LIMBS + 1] = {};
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        if (a.limb[i] == 0) continue;
+        uint64_t carry = 0;
+        for (int j = 0; j < BIG_LIMBS; j++) {
+            uint64_t t = (uint64_t)a.limb[i] * a.limb[j] + wide[i + j] + carry;
+            wide[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        wide[i + BIG_LIMBS] += carry;
+    }
+    for (int i = BIG_LIMBS; i < 2 * BIG_LIMBS; i++) {
+        if (wide[i] != 0) return false;
+    }
+    for (int i = 0; i < BIG_LIMBS; i++) out.limb[i] = (uint32_t)wide[i];
+    return true;
+}
+
+// a = a / d, returns the remainder.
+static uint32_t big_div(BigUint& a, uint32_t d) {
+    uint64_t rem = 0;
+    for (int i = BIG_LIMBS; i-- > 0;) {
+        uint64_t cur = (rem << 32) | a.limb[i];
+        a.limb[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+    return (uint32_t)rem;
+}
+
+static bool big_zero(const BigUint& a) {
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        if (a.limb[i] != 0) return false;
+    }
+    return true;
+}
+
+// Calculates the result of the player exactly like exact_result, in
+// BigUint. The value of the polynomial minus the state is kept as the
+// difference of two non-negative numbers: the terms with positive
+// coefficients and the negative state, minus the rest. Returns false if it
+// doesn't fit in BIG_LIMBS.
+static bool big_result(const PlayerData& player, BigUint& total) {
+    total = BigUint{};
+    if (!big_mul_add(total, 1, (uint64_t)player.result) ||
+        !big_mul_add(total, (uint32_t)FIXED_ONE, 0)) {
+        return false;
+    }
+    for (size_t i = 0; i < player.state.size(); i++) {
+        BigUint plus{}, minus{};
+        for (size_t j = player.coeffs.size(); j-- > 0;) {
+            int64_t c = player.coeffs[j];
+            if (!big_mul_add(plus, (uint32_t)i, c > 0 ? (uint64_t)c : 0) ||
+                !big_mul_add(minus, (uint32_t)i, c < 0 ? -(uint64_t)c : 0)) {
+                return false;
+            }
+        }
+        int64_t st = player.state[i];
+        if (!big_mul_add(plus, 1, st < 0 ? -(uint64_t)st : 0) ||
+            !big_mul_add(minus, 1, st > 0 ? (uint64_t)st : 0)) {
+            return false;
+        }
+        if (big_less(plus, minus)) std::swap(plus, minus);
+        big_sub(plus, minus);
+        BigUint square;
+        if (!big_square(plus, square) || !big_add(total, square)) return false;
+    }
+    return true;
+}
+
+// Formats total, in units of 1e-14, rounded to 7 decimal places the way
+// fixed_to_string does.
+static std::string big_to_string(BigUint total) {
+    big_mul_add(total, 1, FIXED_ONE / 2);
+    big_div(total, (uint32_t)FIXED_ONE);
+    uint32_t fraction = big_div(total, (uint32_t)FIXED_ONE);
+    std::string digits;
+    do {
+        uint32_t part = big_div(total, 1000000000);
+        for (int k = 0; k < 9; k++) {
+            digits.push_back((char)('0' + part % 10));
+            part /= 10;
+        }
+    } while (!big_zero(total));
+    while (digits.size() > 1 && digits.back() == '0') digits.pop_back();
+    std::string out(digits.rbegin(), digits.rend());
+    if (fraction > 0) {
+        char buf[16];
+        snprintf(buf, sizeof buf, ".%07u", fraction);
+        out += buf;
+        while (out.back() == '0') out.pop_back();
+    }
+    return out;
+}
+
+// Returns total, in units of 1e-14, as a number.
+static long double big_to_value(const BigUint& total) {
+    long double value = 0;
+    for (int i = BIG_LIMBS; i-- > 0;) value = value * 4294967296.0L + total.limb[i];
+    return value / FIXED_ONE / FIXED_ONE;
+}
+
+PlayerData rules_new_player() {
+    PlayerData p{};
+    p.received_PUT_answer = true;
+    p.after_HELLO = false;
+    p.PUT_count = 0;
+    p.result = 0;
+    return p;
+}
+
+bool rules_hello(PlayerData& player, const std::string& player_id) {
+    if (player.after_HELLO || !is_valid_player_id(player_id)) return false;
+    player.player_id = player_id;
+    player.after_HELLO = true;
+    return true;
+}
+
+PutVerdict rules_put(PlayerData& player, int K, int& PUT_count, int point,
+                     int64_t value) {
+    PutVerdict verdict{false, TimerAction::NONE};
+    if (!player.received_PUT_answer || player.coeffs.empty()) {
+        rules_penalty(player);
+        verdict.penalty = true;
+        player.received_PUT_answer = true;
+    }
+    if (player.coeffs.empty()) return verdict;
+    if (point < 0 || point > K || value < -PUT_VALUE_MAX || value > PUT_VALUE_MAX) {
+        player.last_bad_point = point;
+        player.last_bad_value = value;
+        verdict.answer = TimerAction::BAD_PUT;
+    } else if (!verdict.penalty) {
+        if (player.state.empty()) player.state.assign(K + 1, 0);
+        player.PUT_count++;
+        player.state[point] += value;
+        PUT_count++;
+        verdict.answer = TimerAction::SEND_STATE;
+    }
+    if (!verdict.penalty) player.received_PUT_answer = false;
+    return verdict;
+}
+
+void rules_penalty(PlayerData& player) {
+    player.result += PENALTY_CHARGE;
+}
+
+void rules_answer(PlayerData& player, TimerAction answer) {
+    if (answer == TimerAction::BAD_PUT) player.result += BAD_PUT_CHARGE;
+    player.received_PUT_answer = true;
+}
+
+int64_t rules_state_delay_us(const std::string& player_id) {
+    int64_t low = std::count_if(player_id.begin(), player_id.end(),
+                                [](char ch) { return ch >= 'a' && ch <= 'z'; });
+    return low * 1000000;
+}
+
+// The result is computed in integers and rounded to 7 decimal places only at
+// the end, so it is the same on every platform. Results too big for 128-bit
+// integers (huge K and N) are computed in BigUint.
+std::string score_player(const PlayerData& player) {
+    __int128 total;
+    if (exact_result(player, total)) {
+        return fixed_to_string((total + FIXED_ONE / 2) / FIXED_ONE);
+    }
+    BigUint big;
+    if (!big_result(player, big)) {
+        fatal("result of %s doesn't fit in %d bits", player.player_id.c_str(),
+              32 * BIG_LIMBS);
+    }
+    return big_to_string(big);
+}
+
+long double score_value(const PlayerData& player) {
+    __int128 total;
+    if (exact_result(player, total)) return (long double)total / FIXED_ONE / FIXED_ONE;
+    BigUint big;
+    if (!big_result(player, big)) {
+        fatal("result of %s doesn't fit in %d bits", player.player_id.c_str(),
+              32 * BIG_LIMBS);
+    }
+    return big_to_value(big);
+}
+
+void game_init(Game& g, int K, int N, int M) {
+    g.K = K;
+    g.N = N;
+    g.M = M;
+    g.now_us = 0;
+    g.PUT_count = 0;
+    g.over = false;
+    g.players.clear();
+    g.timers.clear();
+    g.results.clear();
+}
+
+size_t game_join(Game& g) {
+    g.players.push_back(rules_new_player());
+    g.timers.push_back({g.now_us + HELLO_TIMEOUT_US, TimerAction::NONE, 0, false});
+    return g.players.size() - 1;
+}
+
+bool game_hello(Game& g, size_t p, const std::string& player_id,
+                const std::vector<int64_t>& coeffs, std::vector<Effect>& out) {
+    if (g.over || g.timers[p].dropped) return false;
+    PlayerData& player = g.players[p];
+    if (!rules_hello(player, player_id)) return false;
+    player.coeffs = coeffs;
+    g.timers[p].action = TimerAction::NONE;
+    out.push_back({EffectKind::COEFF, p, 0, 0});
+    return true;
+}
+
+// Sends the answer of player p that was waiting for its timer.
+static void fire_action(Game& g, size_t p, std::vector<Effect>& out) {
+    PlayerTimers& t = g.timers[p];
+    PlayerData& player = g.players[p];
+    if (t.action == TimerAction::SEND_STATE) {
+        out.push_back({EffectKind::STATE, p, 0, 0});
+    } else if (t.action == TimerAction::BAD_PUT) {
+        out.push_back({EffectKind::BAD_PUT, p, player.last_bad_point,
+                       player.last_bad_value});
+    }
+    if (t.action != TimerAction::NONE) rules_answer(player, t.action);
+    t.action = TimerAction::NONE;
+}
+
+// Ends the game: answers the PUTs that are still waiting for their timers
+// and sends SCORING to everyone.
+static void end_game(Game& g, std::vector<Effect>& out) {
+    g.over = true;
+    for (size_t p = 0; p < g.players.size(); p++) {
+        if (!g.timers[p].dropped) fire_action(g, p, out);
+    }
+    g.results.assign(g.players.size(), 0);
+    for (size_t p = 0; p < g.players.size(); p++) {
+        if (g.timers[p].dropped) continue;
+        g.results[p] = score_value(g.players[p]);
+        out.push_back({EffectKind::SCORING, p, 0, 0});
+    }
+}
+
+bool game_put(Game& g, size_t p, int point, int64_t value, std::vector<Effect>& out) {
+    PlayerData& player = g.players[p];
+    if (g.over || g.timers[p].dropped || !player.after_HELLO) return false;
+    PutVerdict verdict = rules_put(player, g.K, g.PUT_count, point, value);
+    if (verdict.penalty) out.push_back({EffectKind::PENALTY, p, point, value});
+    // Like in the server, a PUT replaces the answer that was waiting.
+    PlayerTimers& t = g.timers[p];
+    t.action = verdict.answer;
+    if (verdict.answer == TimerAction::SEND_STATE) {
+        t.action_due_us = g.now_us + rules_state_delay_us(player.player_id);
+    } else if (verdict.answer == TimerAction::BAD_PUT) {
+        t.action_due_us = g.now_us + BAD_PUT_DELAY_US;
+    }
+    if (g.PUT_count == g.M) end_game(g, out);
+    return true;
+}
+
+// Returns the time of the next timer of player p, -1 if there is none.
+static int64_t player_timer(const Game& g, size_t p) {
+    const PlayerTimers& t = g.timers[p];
+    if (t.dropped) return -1;
+    if (!g.players[p].after_HELLO) return t.hello_deadline_us;
+    return t.action != TimerAction::NONE ? t.action_due_us : -1;
+}
+
+int64_t game_next_timer(const Game& g) {
+    if (g.over) return -1;
+    int64_t next = -1;
+    for (size_t p = 0; p < g.players.size(); p++) {
+        int64_t due = player_timer(g, p);
+        if (due >= 0 && (next < 0 || due < next)) next = due;
+    }
+    return next;
+}
+
+void game_advance(Game& g, int64_t now_us, std::vector<Effect>& out) {
+    while (!g.over) {
+        int64_t next = game_next_timer(g);
+        if (next < 0 || next > now_us) break;
+        g.now_us = std::max(g.now_us, next);
+        for (size_t p = 0; p < g.players.size(); p++) {
+            if (player_timer(g, p) != next) continue;
+            if (!g.players[p].after_HELLO) {
+                g.timers[p].dropped = true;
+                g.PUT_count -= g.players[p].PUT_count;
+                out.push_back({EffectKind::DROP, p, 0, 0});
+            } else {
+                fire_action(g, p, out);
+            }
+        }
+    }
+    g.now_us = std::max(g.now_us, now_us);
+}
@@ -0,0 +1,150 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Rules of the game, without sockets or clocks. The server applies them to
+// its connections in real time, Game below plays whole games in memory on
+// a virtual clock.
+
+// This is the structure representing a player's data
+// that the server stores.
+typedef struct {
+    // Player's id, alphanumeric.
+    std::string player_id;
+    // Coefficients of the polynomial of a given player, in units of 1e-7.
+    std::vector<int64_t> coeffs;
+    // State of the current approximation of a player, in units of 1e-7.
+    std::vector<int64_t> state;
+    // Penalties of the player so far, in units of 1e-7. The squared
+    // error is added when the game ends.
+    int64_t result;
+    // True if after HELLO and false otherwise.
+    bool after_HELLO;
+    // Number of correct PUTs by a player.
+    int PUT_count;
+    // True if a player received an answer to their last PUT.
+    // False otherwise.
+    bool received_PUT_answer;
+    // Point and value (in units of 1e-7) of the last PUT that
+    // will be answered with BAD_PUT.
+    int last_bad_point;
+    int64_t last_bad_value;
+} PlayerData;
+
+enum class TimerAction { NONE, SEND_STATE, BAD_PUT };
+
+// Penalties added to the result, in units of 1e-7.
+constexpr int64_t PENALTY_CHARGE = 20 * FIXED_ONE;
+constexpr int64_t BAD_PUT_CHARGE = 10 * FIXED_ONE;
+
+// Largest absolute value of a PUT, in units of 1e-7.
+constexpr int64_t PUT_VALUE_MAX = 5 * FIXED_ONE;
+
+// Time for HELLO after a player joins and the delay of BAD_PUT, in
+// microseconds.
+constexpr int64_t HELLO_TIMEOUT_US = 3000000;
+constexpr int64_t BAD_PUT_DELAY_US = 1000000;
+
+// What a PUT leads to.
+typedef struct {
+    // The PUT came before the previous one was answered (or before COEFF),
+    // PENALTY is sent at once and the PUT isn't applied.
+    bool penalty;
+    // Answer sent once its timer fires, NONE if there is none.
+    TimerAction answer;
+} PutVerdict;
+
+// Returns a new player who hasn't sent HELLO yet.
+PlayerData rules_new_player();
+
+// Applies HELLO with player_id. Returns false if it is not allowed.
+bool rules_hello(PlayerData& player, const std::string& player_id);
+
+// Applies PUT of value (in units of 1e-7) in point to the player. PUT_count
+// is the number of applied PUTs in the game.
+PutVerdict rules_put(PlayerData& player, int K, int& PUT_count, int point,
+                     int64_t value);
+
+// Charges a penalty without applying anything.
+void rules_penalty(PlayerData& player);
+
+// Applies the answer to the last PUT of the player, when it is sent.
+void rules_answer(PlayerData& player, TimerAction answer);
+
+// Returns how long STATE is delayed for the player, in microseconds: a
+// second for every lowercase letter of the id.
+int64_t rules_state_delay_us(const std::string& player_id);
+
+// Calculates the value of the polynomial coeffs in point x, in units of
+// 1e-7. Returns false if it doesn't fit in 128 bits.
+bool poly_value(const std::vector<int64_t>& coeffs, int64_t x, __int128& out);
+
+// Returns the result of the player as a decimal number with at most
+// 7 decimal places: the penalties plus the squared error of the state.
+std::string score_player(const PlayerData& player);
+
+// Returns the result of the player as a number.
+long double score_value(const PlayerData& player);
+
+// What the game tells a player.
+enum class EffectKind { COEFF, STATE, PENALTY, BAD_PUT, SCORING, DROP };
+
+// A message for a player. For PENALTY and BAD_PUT point and value are the
+// ones of the PUT, COEFF, STATE and SCORING are read from the game.
+typedef struct {
+    EffectKind kind;
+    size_t player;
+    int point;
+    int64_t value;
+} Effect;
+
+// Timers of a player in a game.
+typedef struct {
+    int64_t hello_deadline_us;
+    TimerAction action;
+    int64_t action_due_us;
+    bool dropped;
+} PlayerTimers;
+
+// Game played in memory. Events come in through the functions below,
+// the effects they cause are appended to out. Time is virtual, it only
+// moves with game_advance.
+typedef struct {
+    int K, N, M;
+    int64_t now_us;
+    int PUT_count;
+    bool over;
+    std::vector<PlayerData> players;
+    std::vector<PlayerTimers> timers;
+    // Results of the players, set when the game is over.
+    std::vector<long double> results;
+} Game;
+
+// Starts an empty game at time 0.
+void game_init(Game& g, int K, int N, int M);
+
+// Adds a player who connected now. Returns their index.
+size_t game_join(Game& g);
+
+// HELLO of player p with player_id, who gets coeffs. Returns false if
+// it is not allowed.
+bool game_hello(Game& g, size_t p, const std::string& player_id,
+                const std::vector<int64_t>& coeffs, std::vector<Effect>& out);
+
+// PUT of player p. Returns false if it is not allowed. Ends the game with
+// SCORING for everyone once M PUTs were applied.
+bool game_put(Game& g, size_t p, int point, int64_t value, std::vector<Effect>& out);
+
+// Returns the time of the next timer, -1 if there is none.
+int64_t game_next_timer(const Game& g);
+
+// Moves the clock to now_us, running the timers due until then.
+void game_advance(Game& g, int64_t now_us, std::vector<Effect>& out);
+
+#endif // ENGINE_H
@@ -0,0 +1,122 @@
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include "handoff.h"
+#include "common.h"
+
+// How long the old process waits for the new one to confirm the handoff.
+#define HANDOFF_TIMEOUT_MS 5000
+
+void snap_put_int(SnapshotWriter& w, int64_t x) {
+    w.data += std::to_string(x);
+    w.data += ' ';
+}
+
+void snap_put_str(SnapshotWriter& w, const std::string& s) {
+    w.data += std::to_string(s.size());
+    w.data += ':';
+    w.data += s;
+    w.data += ' ';
+}
+
+// Reads a decimal number terminated by end from r.
+static bool read_number(SnapshotReader& r, char end, int64_t& x) {
+    const std::string& d = *r.data;
+    size_t start = r.pos;
+    bool neg = r.pos < d.size() && d[r.pos] == '-';
+    if (neg) r.pos++;
+    uint64_t value = 0;
+    size_t digits = 0;
+    while (r.pos < d.size() && d[r.pos] >= '0' && d[r.pos] <= '9' && digits < 19) {
+        value = value * 10 + (uint64_t)(d[r.pos++] - '0');
+        digits++;
+    }
+    if (digits == 0 || r.pos >= d.size() || d[r.pos] != end) {
+        r.pos = start;
+        return false;
+    }
+    r.pos++;
+    x = neg ? -(int64_t)value : (int64_t)value;
+    return true;
+}
+
+int64_t snap_int(SnapshotReader& r) {
+    int64_t x;
+    if (!r.ok || !read_number(r, ' ', x)) {
+        r.ok = false;
+        return 0;
+    }
+    return x;
+}
+
+std::string snap_str(SnapshotReader& r) {
+    int64_t len;
+    if (!r.ok || !read_number(r, ':', len) || len < 0 ||
+        r.pos + (size_t)len >= r.data->size() || (*r.data)[r.pos + len] != ' ') {
+        r.ok = false;
+        return {};
+    }
+    std::string s = r.data->substr(r.pos, (size_t)len);
+    r.pos += (size_t)len + 1;
+    return s;
+}
+
+// Reads exactly n bytes from fd. Returns false on error or EOF.
+static bool read_exact(int fd, char* buf, size_t n) {
+    while (n > 0) {
+        ssize_t got = read(fd, buf, n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        buf += got;
+        n -= (size_t)got;
+    }
+    return true;
+}
+
+bool handoff_send(int sock, const std::vector<int>& fds, const std::string& snapshot) {
+    std::string header = "HANDOFF " + std::to_string(fds.size()) + " " +
+                         std::to_string(snapshot.size()) + "\n";
+    if (writen(sock, header.data(), header.size()) != (ssize_t)header.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < fds.size(); i += MAX_FDS_PER_MSG) {
+        size_t n = std::min(MAX_FDS_PER_MSG, fds.size() - i);
+        if (!send_fds(sock, fds.data() + i, n)) return false;
+    }
+    if (writen(sock, snapshot.data(), snapshot.size()) != (ssize_t)snapshot.size()) {
+        return false;
+    }
+    struct pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, 1, HANDOFF_TIMEOUT_MS) <= 0) return false;
+    char ack[3];
+    return read_exact(sock, ack, 3) && ack[0] == 'O' && ack[1] == 'K' && ack[2] == '\n';
+}
+
+bool handoff_receive(int sock, std::vector<int>& fds, std::string& snapshot) {
+    std::string header;
+    char c;
+    while (header.size() < 64) {
+        if (!read_exact(sock, &c, 1)) return false;
+        if (c == '\n') break;
+        header += c;
+    }
+    unsigned long nfds, len;
+    if (sscanf(header.c_str(), "HANDOFF %lu %lu", &nfds, &len) != 2) return false;
+    fds.clear();
+    while (fds.size() < nfds) {
+        int batch[MAX_FDS_PER_MSG];
+        int got = recv_fds(sock, batch, MAX_FDS_PER_MSG);
+        if (got <= 0) return false;
+        fds.insert(fds.end(), batch, batch + got);
+    }
+    snapshot.assign(len, '\0');
+    return fds.size() == nfds && read_exact(sock, &snapshot[0], len);
+}
+
+void handoff_confirm(int sock) {
+    writen(sock, "OK\n", 3);
+}
@@ -0,0 +1,39 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Snapshot of the state of the server passed to a new process. Numbers are
+// written as decimal tokens and strings as "length:bytes", all separated
+// by spaces, so a snapshot can be read (and checked) by a person.
+typedef struct {
+    std::string data;
+} SnapshotWriter;
+
+typedef struct {
+    const std::string* data;
+    size_t pos;
+    // Cleared when the snapshot is malformed, everything read then is 0.
+    bool ok;
+} SnapshotReader;
+
+void snap_put_int(SnapshotWriter& w, int64_t x);
+void snap_put_str(SnapshotWriter& w, const std::string& s);
+int64_t snap_int(SnapshotReader& r);
+std::string snap_str(SnapshotReader& r);
+
+// Sends descriptors fds and snapshot over the connected unix socket sock
+// and waits for the new process to confirm it took them over.
+// Returns false if the handoff failed and the caller should carry on.
+bool handoff_send(int sock, const std::vector<int>& fds, const std::string& snapshot);
+
+// Receives the descriptors and snapshot sent by handoff_send from the
+// socket sock. Returns false on error.
+bool handoff_receive(int sock, std::vector<int>& fds, std::string& snapshot);
+
+// Tells the old process that the handoff succeeded.
+void handoff_confirm(int sock);
+
+#endif // HANDOFF_H
@@ -0,0 +1,398 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+
+#include "leaderboard.h"
+#include "common.h"
+#include "err.h"
+
+// How long the writer thread collects results before writing them, and
+// how often it writes a checkpoint of the index.
+#define BATCH_INTERVAL_MS 100
+#define CHECKPOINT_INTERVAL_S 10
+
+// Number of players printed by leaderboard_print.
+#define PRINTED_TOP 10
+
+// The index holds long doubles as they are in memory, so their size is a
+// part of the format.
+static const char INDEX_MAGIC[8] = {'A', 'P', 'X', 'L', 'B', '0', '1',
+                                    (char)sizeof(long double)};
+
+// Header of the index file. It is followed by count entries, each being
+// the length of player_id (uint16_t), player_id, the total (long double)
+// and the number of games (uint64_t).
+typedef struct {
+    char magic[8];
+    uint64_t log_offset;    // Length of the log the index covers.
+    uint64_t count;
+} IndexHeader;
+
+// Results of a player so far.
+typedef struct {
+    long double total;
+    uint64_t games;
+} Totals;
+
+// Position of a player in the ranking.
+typedef struct {
+    long double mean;
+    uint64_t games;
+    std::string player_id;
+} RankKey;
+
+struct RankLess {
+    bool operator()(const RankKey& a, const RankKey& b) const {
+        if (a.mean != b.mean) return a.mean < b.mean;
+        if (a.games != b.games) return a.games > b.games;
+        return a.player_id < b.player_id;
+    }
+};
+
+// Balanced tree that knows the size of every subtree, so the rank of a
+// key and the key of a rank are found in O(log n).
+typedef __gnu_pbds::tree<RankKey, __gnu_pbds::null_type, RankLess,
+                         __gnu_pbds::rb_tree_tag,
+                         __gnu_pbds::tree_order_statistics_node_update> RankTree;
+
+static bool enabled = false;
+static std::string index_path;
+static int log_fd = -1;
+static uint64_t log_size = 0;       // Written by the writer thread only.
+static uint64_t index_offset = 0;   // Log length of the last checkpoint.
+
+// Guards the players and the ranking, which the writer thread changes
+// and queries read.
+static std::mutex lock;
+static std::unordered_map<std::string, Totals> players;
+static RankTree ranking;
+
+// Results waiting for the writer thread.
+static std::mutex queue_lock;
+static std::condition_variable queue_wake;
+static std::condition_variable flushed_wake;
+static std::vector<std::shared_ptr<const std::string>> queue;
+static uint64_t flush_requested = 0;
+static uint64_t flush_done = 0;
+
+static RankKey key_of(const std::string& player_id, const Totals& t) {
+    return {t.total / t.games, t.games, player_id};
+}
+
+// Adds the result value of a game of player_id, also to the ranking if
+// rank is set. The caller holds lock.
+static void add_result(const std::string& player_id, long double value, bool rank) {
+    auto it = players.find(player_id);
+    if (it == players.end()) {
+        it = players.emplace(player_id, Totals{0, 0}).first;
+    } else if (rank) {
+        ranking.erase(key_of(player_id, it->second));
+    }
+    it->second.total += value;
+    it->second.games++;
+    if (rank) ranking.insert(key_of(player_id, it->second));
+}
+
+// Adds the results of a line of the log, "player_id result ..." of a
+// single game. The caller holds lock.
+static void apply_line(const char* p, size_t len, bool rank) {
+    const char* end = p + len;
+    while (p < end) {
+        const char* id_end = (const char*)memchr(p, ' ', end - p);
+        if (!id_end) return;
+        const char* value_end = (const char*)memchr(id_end + 1, ' ', end - id_end - 1);
+        if (!value_end) value_end = end;
+        std::string player_id(p, id_end);
+        char buf[64];
+        size_t value_len = value_end - id_end - 1;
+        // Players that never sent HELLO have no id. A result too long for
+        // buf is no number the server writes.
+        if (!player_id.empty() && value_len > 0 && value_len < sizeof buf) {
+            memcpy(buf, id_end + 1, value_len);
+            buf[value_len] = '\0';
+            char* parsed;
+            long double value = strtold(buf, &parsed);
+            if (*parsed == '\0' && std::isfinite(value)) add_result(player_id, value, rank);
+        }
+        p = value_end + 1;
+    }
+}
+
+// Maps the file path read-only. Returns nullptr if it is missing or empty.
+static const char* map_file(const std::string& path, size_t& size) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = (size_t)st.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? nullptr : (const char*)data;
+}
+
+// Loads the index. Returns the length of the log it covers, 0 if there
+// is no valid index.
+static uint64_t load_index() {
+    size_t size;
+    const char* data = map_file(index_path, size);
+    if (!data) return 0;
+    IndexHeader h;
+    bool ok = size >= sizeof h;
+    if (ok) memcpy(&h, data, sizeof h);
+    ok = ok && memcmp(h.magic, INDEX_MAGIC, sizeof h.magic) == 0;
+    size_t pos = sizeof h;
+    for (uint64_t i = 0; ok && i < h.count; i++) {
+        uint16_t id_len;
+        Totals t;
+        if (size - pos < sizeof id_len) {
+            ok = false;
+            break;
+        }
+        memcpy(&id_len, data + pos, sizeof id_len);
+        pos += sizeof id_len;
+        if (size - pos < id_len + sizeof t.total + sizeof t.games) {
+            ok = false;
+            break;
+        }
+        std::string player_id(data + pos, id_len);
+        pos += id_len;
+        memcpy(&t.total, data + pos, sizeof t.total);
+        pos += sizeof t.total;
+        memcpy(&t.games, data + pos, sizeof t.games);
+        pos += sizeof t.games;
+        if (t.games > 0) players[player_id] = t;
+    }
+    munmap((void*)data, size);
+    if (!ok) {
+        error("invalid leaderboard index %s, replaying the whole log", index_path.c_str());
+        players.clear();
+        return 0;
+    }
+    return h.log_offset;
+}
+
+// Replays the log from offset from. A line cut short by a crash is
+// dropped from the log.
+static void replay_log(const std::string& path, uint64_t from) {
+    struct stat st;
+    if (fstat(log_fd, &st) < 0) syserr("fstat(%s)", path.c_str());
+    log_size = (uint64_t)st.st_size;
+    if (from > log_size) {
+        error("leaderboard index is newer than the log, replaying the whole log");
+        players.clear();
+        from = 0;
+    }
+    size_t size = 0;
+    const char* data = log_size > from ? map_file(path, size) : nullptr;
+    uint64_t complete = from;
+    if (data) {
+        size_t len = std::min<size_t>(size, log_size);
+        size_t pos = from;
+        while (pos < len) {
+            const char* nl = (const char*)memchr(data + pos, '\n', len - pos);
+            if (!nl) break;
+            apply_line(data + pos, nl - data - pos, false);
+            pos = nl - data + 1;
+        }
+        complete = pos;
+        munmap((void*)data, size);
+    }
+    if (complete < log_size) {
+        if (ftruncate(log_fd, (off_t)complete) < 0) syserr("ftruncate(%s)", path.c_str());
+        log_size = complete;
+    }
+}
+
+// Writes the index to a new file that replaces the old one. Called by
+// the writer thread.
+static void write_index() {
+    std::string out;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        IndexHeader h;
+        memcpy(h.magic, INDEX_MAGIC, sizeof h.magic);
+        h.log_offset = log_size;
+        h.count = players.size();
+        out.reserve(sizeof h + players.size() * 48);
+        out.append((const char*)&h, sizeof h);
+        for (const auto& p : players) {
+            uint16_t id_len = (uint16_t)std::min<size_t>(p.first.size(), UINT16_MAX);
+            out.append((const char*)&id_len, sizeof id_len);
+            out.append(p.first, 0, id_len);
+            out.append((const char*)&p.second.total, sizeof p.second.total);
+            out.append((const char*)&p.second.games, sizeof p.second.games);
+        }
+    }
+    std::string tmp = index_path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || writen(fd, out.data(), out.size()) != (ssize_t)out.size() ||
+        close(fd) < 0 || rename(tmp.c_str(), index_path.c_str()) < 0) {
+        error("cannot write the leaderboard index %s", index_path.c_str());
+        return;
+    }
+    index_offset = log_size;
+}
+
+// Strips "SCORING " and the line end from a SCORING message.
+static void append_payload(std::string& out, const std::string& scoring) {
+    size_t from = scoring.compare(0, 8, "SCORING ") == 0 ? 8 : 0;
+    size_t to = scoring.find_first_of("\r\n", from);
+    if (to == std::string::npos) to = scoring.size();
+    out.append(scoring, from, to - from);
+    out += '\n';
+}
+
+// Writes the queued results in batches: to the log with a single write,
+// then to the ranking, then every CHECKPOINT_INTERVAL_S to the index.
+static void writer() {
+    auto next_checkpoint = std::chrono::steady_clock::now() +
+                           std::chrono::seconds(CHECKPOINT_INTERVAL_S);
+    std::vector<std::shared_ptr<const std::string>> batch;
+    std::string lines;
+    while (true) {
+        uint64_t flush;
+        {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            queue_wake.wait_for(guard, std::chrono::milliseconds(BATCH_INTERVAL_MS), [] {
+                return flush_requested != flush_done;
+            });
+            batch.swap(queue);
+            flush = flush_requested;
+        }
+        lines.clear();
+        for (const auto& scoring : batch) append_payload(lines, *scoring);
+        batch.clear();
+        if (!lines.empty()) {
+            size_t written = 0;
+            while (written < lines.size()) {
+                ssize_t n = write(log_fd, lines.data() + written, lines.size() - written);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                written += (size_t)n;
+            }
+            // Only whole lines count, a line cut short is removed so the
+            // log and the checkpoints stay at line boundaries.
+            size_t complete = written;
+            if (written < lines.size()) {
+                error("cannot write the leaderboard log, %zu results lost",
+                      (size_t)std::count(lines.begin() + written, lines.end(), '\n'));
+                size_t nl = written == 0 ? std::string::npos : lines.rfind('\n', written - 1);
+                complete = nl == std::string::npos ? 0 : nl + 1;
+                if (ftruncate(log_fd, (off_t)(log_size + complete)) < 0) {
+                    error("cannot truncate the leaderboard log");
+                }
+            }
+            log_size += complete;
+            std::lock_guard<std::mutex> guard(lock);
+            const char* p = lines.data();
+            const char* end = p + complete;
+            while (p < end) {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                apply_line(p, nl - p, true);
+                p = nl + 1;
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (log_size != index_offset && (now >= next_checkpoint || flush != flush_done)) {
+            write_index();
+            next_checkpoint = now + std::chrono::seconds(CHECKPOINT_INTERVAL_S);
+        }
+        if (flush != flush_done) {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            flush_done = flush;
+            flushed_wake.notify_all();
+        }
+    }
+}
+
+void leaderboard_open(const std::string& path) {
+    index_path = path + ".idx";
+    log_fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd < 0) syserr("cannot open the leaderboard log %s", path.c_str());
+    auto begin = std::chrono::steady_clock::now();
+    uint64_t from = load_index();
+    replay_log(path, from);
+    index_offset = from == log_size ? log_size : 0;
+    for (const auto& p : players) ranking.insert(key_of(p.first, p.second));
+    int64_t took = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - begin).count();
+    std::cout << "Leaderboard of " << players.size() << " players recovered in " <<
+                took << " ms.\n";
+    enabled = true;
+    std::thread(writer).detach();
+}
+
+bool leaderboard_enabled() {
+    return enabled;
+}
+
+void leaderboard_add(const std::shared_ptr<const std::string>& scoring) {
+    if (!enabled) return;
+    std::lock_guard<std::mutex> guard(queue_lock);
+    queue.push_back(scoring);
+}
+
+std::vector<Standing> leaderboard_top(size_t k) {
+    std::vector<Standing> top;
+    if (!enabled) return top;
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = ranking.begin(); it != ranking.end() && top.size() < k; ++it) {
+        const Totals& t = players.at(it->player_id);
+        top.push_back({it->player_id, t.total, t.games, top.size() + 1});
+    }
+    return top;
+}
+
+bool leaderboard_rank(const std::string& player_id, Standing& out) {
+    if (!enabled) return false;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = players.find(player_id);
+    if (it == players.end()) return false;
+    out = {player_id, it->second.total, it->second.games,
+           ranking.order_of_key(key_of(player_id, it->second)) + 1};
+    return true;
+}
+
+void leaderboard_flush() {
+    if (!enabled) return;
+    std::unique_lock<std::mutex> guard(queue_lock);
+    uint64_t ticket = ++flush_requested;
+    queue_wake.notify_one();
+    flushed_wake.wait(guard, [ticket] { return flush_done >= ticket; });
+}
+
+void leaderboard_detach() {
+    enabled = false;
+    if (log_fd >= 0) close(log_fd);
+    log_fd = -1;
+}
+
+void leaderboard_print(std::ostream& os) {
+    if (!enabled) return;
+    std::vector<Standing> top = leaderboard_top(PRINTED_TOP);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        os << "leaderboard_players " << players.size() << "\n";
+    }
+    for (const Standing& s : top) {
+        os << "leaderboard_" << s.rank << " " << s.player_id << " " <<
+              s.total / s.games << " " << s.games << "\n";
+    }
+}
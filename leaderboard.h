@@ -0,0 +1,51 @@
+#ifndef LEADERBOARD_H
+#define LEADERBOARD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Standing of a player across all games. Players are ranked by their
+// mean result (lower is better), then by the number of games (more is
+// better), then by player_id.
+typedef struct {
+    std::string player_id;
+    long double total;      // Sum of the results of all games.
+    uint64_t games;
+    uint64_t rank;          // From 1.
+} Standing;
+
+// Opens the leaderboard stored at path (the log of results) and path.idx
+// (the checkpointed index), creating them if needed, and recovers it:
+// the index is mapped and the log written after the checkpoint is
+// replayed. Starts the thread that writes the results. Exits with error
+// if the files can't be used.
+void leaderboard_open(const std::string& path);
+
+// Returns true if a leaderboard is open in this process.
+bool leaderboard_enabled();
+
+// Queues the results of a game, given as its SCORING message. They are
+// parsed, logged and ranked by the writer thread in batches.
+void leaderboard_add(const std::shared_ptr<const std::string>& scoring);
+
+// Returns the k best players.
+std::vector<Standing> leaderboard_top(size_t k);
+
+// Finds the standing of player_id. Returns false if they have no games.
+bool leaderboard_rank(const std::string& player_id, Standing& out);
+
+// Writes the queued results and a checkpoint of the index, blocking.
+void leaderboard_flush();
+
+// Forgets the leaderboard in a child process after fork(), whose copy of
+// it has no writer thread.
+void leaderboard_detach();
+
+// Prints the size of the leaderboard and its top players.
+void leaderboard_print(std::ostream& os);
+
+#endif // LEADERBOARD_H
@@ -0,0 +1,89 @@
+#include <malloc.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+#include "mem-account.h"
+
+// Bytes allocated with operator new, as malloc_usable_size() counts them.
+static std::atomic<size_t> heap{0};
+
+// Parses a size with an optional suffix, up to end. Returns false if it
+// isn't valid.
+static bool parse_size(const char* s, const char*& end, size_t& out) {
+    char* num_end;
+    unsigned long long value = strtoull(s, &num_end, 10);
+    if (num_end == s || *s == '-') return false;
+    unsigned long long unit = 1;
+    switch (*num_end) {
+    case 'K': unit = 1ULL << 10; num_end++; break;
+    case 'M': unit = 1ULL << 20; num_end++; break;
+    case 'G': unit = 1ULL << 30; num_end++; break;
+    }
+    if (value > (1ULL << 50) / unit) return false;
+    out = (size_t)(value * unit);
+    end = num_end;
+    return true;
+}
+
+bool parse_memory_limit(const char* s, MemoryLimit& limit) {
+    const char* end;
+    size_t total, connection = 0;
+    if (!parse_size(s, end, total)) return false;
+    if (*end == '/' && !parse_size(end + 1, end, connection)) return false;
+    if (*end != '\0') return false;
+    limit.total = total;
+    limit.connection = connection;
+    return true;
+}
+
+size_t heap_bytes() {
+    return heap.load(std::memory_order_relaxed);
+}
+
+// Allocates n bytes and counts them, nullptr if there is no memory.
+static void* counted_alloc(size_t n) {
+    void* p = malloc(n ? n : 1);
+    if (p) heap.fetch_add(malloc_usable_size(p), std::memory_order_relaxed);
+    return p;
+}
+
+static void counted_free(void* p) {
+    if (!p) return;
+    heap.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+    free(p);
+}
+
+void* operator new(size_t n) {
+    void* p = counted_alloc(n);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t n) {
+    return operator new(n);
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept {
+    return counted_alloc(n);
+}
+
+void* operator new[](size_t n, const std::nothrow_t&) noexcept {
+    return counted_alloc(n);
+}
+
+void operator delete(void* p) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    counted_free(p);
+}
@@ -0,0 +1,27 @@
+#ifndef MEM_ACCOUNT_H
+#define MEM_ACCOUNT_H
+
+#include <stddef.h>
+
+// Accounting of the memory of the server. Every operator new and delete of
+// the process goes through this module, which keeps the number of bytes
+// taken from the heap. What a single connection holds (its buffers, output
+// queue and player data) is counted by server-utils.
+
+// Limits of the memory, 0 for no limit.
+typedef struct {
+    // Heap of the whole process. Above it HELLOs are refused and the
+    // heaviest idle connections are dropped.
+    size_t total;
+    // Bytes of a single connection, one that holds more is dropped.
+    size_t connection;
+} MemoryLimit;
+
+// Parses "total[/connection]", sizes in bytes with an optional suffix
+// K, M or G. Returns false if s is not valid.
+bool parse_memory_limit(const char* s, MemoryLimit& limit);
+
+// Returns the number of bytes allocated with operator new and not freed.
+size_t heap_bytes();
+
+#endif // MEM_ACCOUNT_H
@@ -0,0 +1,47 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "rate-limit.h"
+
+bool parse_rate_limit(const char* s, RateLimit& limit) {
+    char* end;
+    double rate = strtod(s, &end);
+    if (end == s || rate < 0 || rate > 1e9) return false;
+    double burst = std::max(rate, 1.0);
+    if (*end == '/') {
+        const char* b = end + 1;
+        burst = strtod(b, &end);
+        if (end == b || burst < 1 || burst > 1e9) return false;
+    }
+    if (*end != '\0') return false;
+    limit.rate = rate;
+    limit.burst = burst;
+    return true;
+}
+
+bool parse_shed_policy(const char* s, ShedPolicy& policy) {
+    if (strcmp(s, "drop") == 0) policy = ShedPolicy::DROP;
+    else if (strcmp(s, "coalesce") == 0) policy = ShedPolicy::COALESCE;
+    else if (strcmp(s, "disconnect") == 0) policy = ShedPolicy::DISCONNECT;
+    else return false;
+    return true;
+}
+
+bool bucket_ready(TokenBucket& b, const RateLimit& limit,
+                  std::chrono::steady_clock::time_point now) {
+    if (limit.rate == 0) return true;
+    if (!b.started) {
+        b.tokens = limit.burst;
+        b.started = true;
+    } else {
+        double secs = std::chrono::duration<double>(now - b.last).count();
+        b.tokens = std::min(limit.burst, b.tokens + secs * limit.rate);
+    }
+    b.last = now;
+    return b.tokens >= 1;
+}
+
+void bucket_take(TokenBucket& b, const RateLimit& limit) {
+    if (limit.rate != 0) b.tokens -= 1;
+}
@@ -0,0 +1,46 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <chrono>
+
+// Limit of a token bucket: rate tokens are added every second, up to
+// burst tokens. A rate of 0 means no limit.
+typedef struct {
+    double rate;
+    double burst;
+} RateLimit;
+
+// Token bucket, every message takes one token.
+typedef struct {
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+    bool started;
+} TokenBucket;
+
+// What the server does with messages over the limit.
+enum class ShedPolicy {
+    // Messages are discarded without an answer.
+    DROP,
+    // The first PUT over the limit in a row is answered with PENALTY, the
+    // rest of the row is discarded and counted.
+    COALESCE,
+    // The client is disconnected.
+    DISCONNECT
+};
+
+// Parses "rate" or "rate/burst" into limit. Burst defaults to the rate,
+// but at least 1. Returns false if s is not valid.
+bool parse_rate_limit(const char* s, RateLimit& limit);
+
+// Parses the name of a shed policy. Returns false if it is unknown.
+bool parse_shed_policy(const char* s, ShedPolicy& policy);
+
+// Refills bucket b with the given limit up to time now. Returns true if
+// it has a token for a message, which bucket_take then takes.
+bool bucket_ready(TokenBucket& b, const RateLimit& limit,
+                  std::chrono::steady_clock::time_point now);
+
+// Takes a token from bucket b, which bucket_ready said it has.
+void bucket_take(TokenBucket& b, const RateLimit& limit);
+
+#endif // RATE_LIMIT_H
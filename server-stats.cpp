@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <iostream>
+
+#include "server-stats.h"
+#include "mem-account.h"
+
+ServerStats server_stats{};
+
+// Returns the bucket of a latency of us microseconds.
+static size_t latency_bucket(uint64_t us) {
+    if (us < 8) return us;
+    int msb = 63 - __builtin_clzll(us);
+    return (size_t)(msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+}
+
+// Returns the smallest latency that falls into bucket b.
+static uint64_t bucket_lower(size_t b) {
+    if (b < 8) return b;
+    int msb = (int)(b / 8) + 2;
+    return (uint64_t)(8 + b % 8) << (msb - 3);
+}
+
+void latency_record(LatencyHistogram& h, int64_t us) {
+    if (us < 0) us = 0;
+    h.buckets[latency_bucket((uint64_t)us)]++;
+    h.count++;
+    if (us > h.max_us) h.max_us = us;
+}
+
+int64_t latency_percentile(const LatencyHistogram& h, double p) {
+    if (h.count == 0) return 0;
+    uint64_t rank = (uint64_t)(h.count * p / 100);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h.buckets[b];
+        if (seen >= rank) {
+            if (b + 1 == LATENCY_BUCKETS) return h.max_us;
+            return std::min<int64_t>((int64_t)bucket_lower(b + 1) - 1, h.max_us);
+        }
+    }
+    return h.max_us;
+}
+
+void print_stats(std::ostream& os) {
+    os << "games " << server_stats.games << "\n"
+       << "players_parked " << server_stats.players_parked << "\n"
+       << "scoring_players " << server_stats.scoring_players << "\n"
+       << "scoring_bytes " << server_stats.scoring_bytes << "\n"
+       << "scoring_last_us " << server_stats.scoring_last_us << "\n"
+       << "scoring_max_us " << server_stats.scoring_max_us << "\n"
+       << "budget_exhausted " << server_stats.budget_exhausted << "\n"
+       << "shed_dropped " << server_stats.shed_dropped << "\n"
+       << "shed_coalesced " << server_stats.shed_coalesced << "\n"
+       << "shed_disconnects " << server_stats.shed_disconnects << "\n"
+       << "handoff_pause_us " << server_stats.handoff_pause_us << "\n"
+       << "mem_heap_bytes " << heap_bytes() << "\n"
+       << "mem_connections_bytes " << server_stats.mem_connections_bytes << "\n"
+       << "mem_game_bytes " << server_stats.mem_game_bytes << "\n"
+       << "mem_connection_max_bytes " << server_stats.mem_connection_max_bytes << "\n"
+       << "mem_hello_refused " << server_stats.mem_hello_refused << "\n"
+       << "mem_shed " << server_stats.mem_shed << "\n";
+    const LatencyHistogram& stall = server_stats.reactor_stall;
+    os << "reactor_stall_p50_us " << latency_percentile(stall, 50) << "\n"
+       << "reactor_stall_p99_us " << latency_percentile(stall, 99) << "\n"
+       << "reactor_stall_max_us " << stall.max_us << "\n";
+    static const char* class_names[CLASS_COUNT] = {"normal", "heavy"};
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        const LatencyHistogram& h = server_stats.state_lateness[c];
+        os << "state_lateness_count_" << class_names[c] << " " << h.count << "\n"
+           << "state_lateness_p50_us_" << class_names[c] << " "
+           << latency_percentile(h, 50) << "\n"
+           << "state_lateness_p99_us_" << class_names[c] << " "
+           << latency_percentile(h, 99) << "\n"
+           << "state_lateness_max_us_" << class_names[c] << " " << h.max_us << "\n";
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stdint.h>
+#include <ostream>
+
+// Number of buckets of a latency histogram.
+constexpr size_t LATENCY_BUCKETS = 496;
+
+// Histogram of latencies in microseconds. Buckets below 8 us are exact,
+// above that every power of two is split into 8 buckets, so percentiles
+// are accurate to 12.5%.
+typedef struct {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    int64_t max_us;
+} LatencyHistogram;
+
+// Classes of clients for the latency statistics.
+enum ClientClass {
+    // Clients that never used up their processing budget.
+    CLASS_NORMAL,
+    // Clients that sent more than their budget in a single iteration.
+    CLASS_HEAVY,
+    CLASS_COUNT
+};
+
+// Counters and timings collected by the server for monitoring.
+typedef struct {
+    // Number of finished games.
+    uint64_t games;
+    // Number of players that connected between games and waited for the next one.
+    uint64_t players_parked;
+    // Number of players that received the last SCORING.
+    uint64_t scoring_players;
+    // Size in bytes of the last SCORING message.
+    uint64_t scoring_bytes;
+    // Time in microseconds from the end of the last game until its SCORING
+    // was written to every player (or they were dropped): scoring, queueing
+    // and delivery.
+    int64_t scoring_last_us;
+    // Longest such SCORING broadcast so far, in microseconds.
+    int64_t scoring_max_us;
+    // Number of times a client used up its processing budget and had
+    // to wait for the next iteration of the main loop.
+    uint64_t budget_exhausted;
+    // Messages over the rate limit that were discarded.
+    uint64_t shed_dropped;
+    // PUTs over the rate limit discarded after the one answered with
+    // PENALTY, neither answered nor charged.
+    uint64_t shed_coalesced;
+    // Clients disconnected for going over the rate limit.
+    uint64_t shed_disconnects;
+    // How much later than due STATE was sent, counted from the time the
+    // PUT was noticed by the server, per class of the client.
+    LatencyHistogram state_lateness[CLASS_COUNT];
+    // Time in microseconds for which no process served the clients during
+    // the handoff this process took over with, 0 if it didn't.
+    int64_t handoff_pause_us;
+    // Time the main loop spent between two poll() calls, in microseconds.
+    LatencyHistogram reactor_stall;
+    // Bytes held for the connections, for the players of the current
+    // game and for the heaviest connection, as of the last check.
+    uint64_t mem_connections_bytes;
+    uint64_t mem_game_bytes;
+    uint64_t mem_connection_max_bytes;
+    // HELLOs refused because the heap was over the limit.
+    uint64_t mem_hello_refused;
+    // Connections dropped for holding too much memory.
+    uint64_t mem_shed;
+} ServerStats;
+
+// Statistics of this server process.
+extern ServerStats server_stats;
+
+// Adds a latency of us microseconds to the histogram h.
+void latency_record(LatencyHistogram& h, int64_t us);
+
+// Returns the upper bound of the bucket with the p-th percentile
+// (0 < p <= 100) of the latencies in h, 0 if h is empty.
+int64_t latency_percentile(const LatencyHistogram& h, double p);
+
+// Prints the statistics to os, one "name value" pair per line.
+void print_stats(std::ostream& os);
+
+#endif // SERVER_STATS_H
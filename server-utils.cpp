@@ -8,38 +8,99 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include "server-utils.h"
+#include "server-stats.h"
+#include "thread-pool.h"
+#include "shm-ring.h"
 #include "err.h"
 #include "common.h"
+#include "engine.h"
+#include "spectator.h"
+#include "trace.h"
 
 #define BUF_SIZE 1024
+// Maximal number of queued messages passed to a single sendmsg().
+#define MAX_IOV 64
 
 // File stream for the coefficient file.
 static std::ifstream coeffs;
+// With the generator the coefficients come from generate_coeffs instead
+// of the file, row is the next row to use.
+static bool coeff_generated = false;
+static uint64_t coeff_seed = 0;
+static uint64_t coeff_row = 0;
+// Lines of the coefficient file skipped before the next COEFF and between
+// two COEFFs, so that workers of a cluster share one file.
+static int coeff_pending_skip = 0;
+static int coeff_stride_skip = 0;
+// Called with the scoreboard of every finished game, if set.
+static void (*scoring_hook)(const SharedMsg& scoring) = nullptr;
+// Called with the position of the coefficients after every COEFF, if set.
+static void (*coeff_hook)(long offset, int skip) = nullptr;
+
+// Message waiting to be written. A message that is still being prepared
+// by the thread pool has no msg yet, it holds back the messages after it.
+typedef struct {
+    SharedMsg msg;
+    // Identifies the placeholder of a message being prepared, 0 otherwise.
+    uint64_t ticket;
+} OutChunk;
 
 // Structure representing a buffer for a single client.
 typedef struct {
     char buf[BUF_SIZE];
     size_t start;
     size_t end;
+    // Messages waiting to be written to the client, oldest first.
+    std::deque<OutChunk> out;
+    // Number of bytes of out.front() that were already written.
+    size_t out_off;
+    // Bytes of the messages in out, including the written part of the first.
+    size_t queued;
+    // True if writing to the client failed and it should be dropped.
+    bool broken;
+    // Rings of a client of the shared memory transport, nullptr for
+    // socket clients. The socket then only carries doorbells.
+    ShmSegment* shm;
+    // Descriptor of the shared memory, valid if shm is set.
+    int shm_fd;
 } Buffer;
 
-// Vector of buffers for every client.
-static std::vector<Buffer> buffers;
+// Buffers of every client, indexed by the client's descriptor.
+static std::unordered_map<int, Buffer> buffers;
 
+// Last ticket given to a placeholder. Tickets are never reused, so a late
+// message can't end up with a new client that got the same descriptor.
+static uint64_t last_ticket = 0;
 
-// Comparator function for comparing players (their ids).
-static bool player_comp(const PlayerData* a, const PlayerData* b) {
-    return a->player_id < b->player_id;
-} 
+// SCORING broadcast that is still being written: when the game ended and
+// how many output queues still hold it.
+typedef struct {
+    std::chrono::steady_clock::time_point begin;
+    size_t left;
+} ScoringDelivery;
 
-// Calculates the result of the player based on their state and coefficients.
-static void calculate_result(PlayerData& player) {
-    for (size_t i = 0; i < player.state.size(); i++) {
-        player.result += (player.state[i] - get_sum_in_x(i, player.coeffs)) * 
-                    (player.state[i] - get_sum_in_x(i, player.coeffs));
-    }
+// Broadcasts of SCORING being written, by their message.
+static std::unordered_map<const std::string*, ScoringDelivery> deliveries;
+
+// States at least this long are formatted by the thread pool.
+#define STATE_OFFLOAD_MIN 1024
+
+
+// Appends value (in units of 1e-7) to out. If all_places is set then
+// all 7 decimal places are written.
+static void append_fixed(std::string& out, int64_t value, bool all_places) {
+    char buf[FIXED_MAX_LEN];
+    out.append(buf, format_fixed(value, buf, all_places));
 }
 
 void open_coeff_file(const std::string& coeff_file) {
@@ -49,12 +110,26 @@ void open_coeff_file(const std::string& coeff_file) {
     }
 }
 
+void use_coeff_generator(uint64_t seed) {
+    coeff_generated = true;
+    coeff_seed = seed;
+    coeff_row = 0;
+}
+
 void close_coeff_file() {
     if (coeffs.is_open()) {
         coeffs.close();
     }
 }
 
+bool switch_coeff_file(const std::string& coeff_file) {
+    std::ifstream next(coeff_file);
+    if (!next.is_open()) return false;
+    coeffs = std::move(next);
+    coeff_generated = false;
+    return true;
+}
+
 int create_dual_stack(int port) {
     std::string port_s = std::to_string(port);
     struct addrinfo hints{}, *res;
@@ -99,119 +174,421 @@ int create_dual_stack(int port) {
 
     return listen_fd;
 }
+
+int create_unix_listener(const std::string& path) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    if (!make_unix_addr(path, addr, len)) {
+        fatal("invalid unix socket path: %s", path.c_str());
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) syserr("socket unix");
+    // Only a socket may be removed, never a regular file given by mistake.
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+    if (bind(listen_fd, (struct sockaddr*)&addr, len) < 0)
+        syserr("bind unix %s", path.c_str());
+    if (listen(listen_fd, SOMAXCONN) < 0)
+        syserr("listen unix");
+    return listen_fd;
+}
+
+// Called when the message of chunk left an output queue, written in full or
+// dropped with its client. Once a SCORING broadcast left every queue, its
+// time is recorded.
+static void chunk_done(const OutChunk& chunk) {
+    if (deliveries.empty() || !chunk.msg) return;
+    auto it = deliveries.find(chunk.msg.get());
+    if (it == deliveries.end() || --it->second.left > 0) return;
+    int64_t took = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - it->second.begin).count();
+    server_stats.scoring_last_us = took;
+    server_stats.scoring_max_us = std::max(server_stats.scoring_max_us, took);
+    deliveries.erase(it);
+}
+
+// Appends msg to the output queue of the client with descriptor fd.
+static void queue_msg(int fd, const SharedMsg& msg) {
+    auto it = buffers.find(fd);
+    if (it == buffers.end() || it->second.broken) return;
+    it->second.out.push_back({msg, 0});
+    it->second.queued += msg->size();
+}
+
+// Appends a placeholder for a message that is being prepared to the output
+// queue of the client with descriptor fd. Returns its ticket.
+static uint64_t queue_placeholder(int fd) {
+    uint64_t ticket = ++last_ticket;
+    auto it = buffers.find(fd);
+    if (it != buffers.end() && !it->second.broken) {
+        it->second.out.push_back({nullptr, ticket});
+    }
+    return ticket;
+}
+
+// Puts msg in place of the placeholder with the given ticket, if the
+// client with descriptor fd still has it, and tries to write it.
+// Returns false if the placeholder is gone.
+static bool fill_placeholder(int fd, uint64_t ticket, const SharedMsg& msg) {
+    auto it = buffers.find(fd);
+    if (it == buffers.end()) return false;
+    for (OutChunk& chunk : it->second.out) {
+        if (chunk.ticket == ticket) {
+            chunk.msg = msg;
+            chunk.ticket = 0;
+            it->second.queued += msg->size();
+            flush_output(fd);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Queues msg for the client with descriptor fd and tries to write it at once.
+static void send_msg(int fd, std::string msg) {
+    queue_msg(fd, std::make_shared<const std::string>(std::move(msg)));
+    flush_output(fd);
+}
+
+// Writes as much of the output queue of a shared memory client as fits
+// in its ring, ringing the doorbell once if the client may be asleep.
+static bool flush_shm(int fd, Buffer& buffer) {
+    bool wake = false;
+    while (!buffer.out.empty() && buffer.out.front().msg) {
+        const SharedMsg& msg = buffer.out.front().msg;
+        size_t rem = msg->size() - buffer.out_off;
+        bool was_empty;
+        size_t n = ring_write(buffer.shm->to_client, msg->data() + buffer.out_off,
+                              rem, was_empty);
+        wake |= was_empty;
+        if (n < rem) {
+            buffer.out_off += n;
+            break;
+        }
+        buffer.queued -= msg->size();
+        chunk_done(buffer.out.front());
+        buffer.out.pop_front();
+        buffer.out_off = 0;
+    }
+    if (wake) ring_doorbell(fd);
+    return true;
+}
+
+bool flush_output(int fd) {
+    TraceSpan span("flush_output", fd);
+    auto it = buffers.find(fd);
+    if (it == buffers.end()) return false;
+    Buffer& buffer = it->second;
+    if (buffer.shm) return flush_shm(fd, buffer);
+    while (!buffer.out.empty() && buffer.out.front().msg && !buffer.broken) {
+        struct iovec iov[MAX_IOV];
+        size_t cnt = 0;
+        for (const OutChunk& chunk : buffer.out) {
+            if (cnt == MAX_IOV || !chunk.msg) break;
+            const SharedMsg& msg = chunk.msg;
+            size_t off = cnt == 0 ? buffer.out_off : 0;
+            iov[cnt].iov_base = const_cast<char*>(msg->data() + off);
+            iov[cnt].iov_len = msg->size() - off;
+            cnt++;
+        }
+        struct msghdr mh{};
+        mh.msg_iov = iov;
+        mh.msg_iovlen = cnt;
+        ssize_t n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            buffer.broken = true;
+            break;
+        }
+        size_t left = (size_t)n;
+        while (left > 0) {
+            size_t rem = buffer.out.front().msg->size() - buffer.out_off;
+            if (left < rem) {
+                buffer.out_off += left;
+                break;
+            }
+            left -= rem;
+            buffer.queued -= buffer.out.front().msg->size();
+            chunk_done(buffer.out.front());
+            buffer.out.pop_front();
+            buffer.out_off = 0;
+        }
+    }
+    if (buffer.broken) {
+        for (const OutChunk& chunk : buffer.out) chunk_done(chunk);
+        buffer.out.clear();
+        buffer.queued = 0;
+    }
+    return !buffer.broken;
+}
+
+size_t connection_bytes(int fd, const PlayerData& player) {
+    size_t bytes = sizeof(Buffer) + player.player_id.capacity() +
+                   (player.coeffs.capacity() + player.state.capacity()) * sizeof(int64_t);
+    auto it = buffers.find(fd);
+    if (it != buffers.end()) bytes += it->second.queued;
+    return bytes;
+}
+
+bool has_pending_output(int fd) {
+    auto it = buffers.find(fd);
+    return it != buffers.end() && !it->second.out.empty();
+}
+
+bool can_flush(int fd) {
+    auto it = buffers.find(fd);
+    // The socket of a shared memory client is always writable, the client
+    // rings the doorbell when there is room in its ring instead.
+    return it != buffers.end() && !it->second.shm &&
+           !it->second.out.empty() && it->second.out.front().msg;
+}
+
+bool has_placeholder(int fd) {
+    auto it = buffers.find(fd);
+    if (it == buffers.end()) return false;
+    for (const OutChunk& chunk : it->second.out) {
+        if (!chunk.msg) return true;
+    }
+    return false;
+}
+
 // Send BAD_PUT with point, value to a player via descriptor fd.
-void send_BAD_PUT(int point, double value, int fd, PlayerData& player) {
-    player.result += 10;
-    std::ostringstream oss;
-    oss << "BAD_PUT " << point << " " << std::fixed << std::setprecision(7) <<
-                     value << "\r\n";
-    std::string message = oss.str();
-    if (writen(fd, message.c_str(), message.size()) != (ssize_t)message.size())
-    {
-        syserr("write()");
-    }
-    player.received_PUT_answer = true;
-    std::ostringstream formatted_value;
-    formatted_value << std::fixed << std::setprecision(7) << value;
-    std::cout << "Sending BAD_PUT " << point << " " << formatted_value.str() 
+void send_BAD_PUT(int point, int64_t value, int fd, PlayerData& player) {
+    TraceSpan span("send_BAD_PUT", fd);
+    rules_answer(player, TimerAction::BAD_PUT);
+    std::string formatted_value;
+    append_fixed(formatted_value, value, true);
+    send_msg(fd, "BAD_PUT " + std::to_string(point) + " " + formatted_value +
+                 "\r\n");
+    std::cout << "Sending BAD_PUT " << point << " " << formatted_value 
                 << " to " << player.player_id << ".\n";
 }
 
 // Send PENALTY with point, value to a player via descriptor fd.
-void send_PENALTY(int point, double value, int fd, PlayerData& player) {
-    player.result += 20;
-    std::ostringstream oss;
-    oss << "PENALTY " << point << " " << std::fixed << std::setprecision(7) <<
-                     value << "\r\n";
-    std::string message = oss.str();
-    if (writen(fd, message.c_str(), message.size()) != (ssize_t)message.size())
-    {
-        syserr("write()");
-    }
-    std::ostringstream formatted_value;
-    formatted_value << std::fixed << std::setprecision(7) << value;
-    std::cout << "Sending PENALTY " << point << " " << formatted_value.str() 
+void send_PENALTY(int point, int64_t value, int fd, const PlayerData& player) {
+    TraceSpan span("send_PENALTY", fd);
+    std::string formatted_value;
+    append_fixed(formatted_value, value, true);
+    send_msg(fd, "PENALTY " + std::to_string(point) + " " + formatted_value +
+                 "\r\n");
+    std::cout << "Sending PENALTY " << point << " " << formatted_value 
                 << " to " << player.player_id << ".\n";
 }
 
 // Send COEFF via descriptor fd, from the coefficient's file.
 void send_COEFF(int fd, PlayerData& player, int N) {
+    TraceSpan span("send_COEFF", fd);
     std::string line;
-    if (!std::getline(coeffs, line)) {
-        fatal("Coefficient file exhausted.");
-    }
-    std::istringstream iss(line);
-    std::string command;
-    iss >> command;
-    double coeff;
-    while (iss >> coeff) {
-        player.coeffs.push_back(coeff);
-    }
-    if (player.coeffs.size() != (size_t)N + 1) {
-        fatal("Coefficient file wrong format.");
+    if (coeff_generated) {
+        coeff_row += coeff_pending_skip;
+        generate_coeffs(coeff_seed, coeff_row++, N, player.coeffs);
+        line = "COEFF";
+        for (int64_t value : player.coeffs) {
+            line += ' ';
+            append_fixed(line, value, false);
+        }
+    } else {
+        for (; coeff_pending_skip > 0; coeff_pending_skip--) {
+            if (!std::getline(coeffs, line)) break;
+        }
+        if (!std::getline(coeffs, line)) {
+            if (coeff_hook) coeff_hook(-1, 0);
+            fatal("Coefficient file exhausted.");
+        }
+        std::istringstream iss(line);
+        std::string command;
+        iss >> command;
+        std::string coeff_str;
+        int64_t coeff;
+        while (iss >> coeff_str) {
+            if (!parse_fixed(coeff_str.data(), coeff_str.size(), coeff)) {
+                fatal("Coefficient file wrong format.");
+            }
+            player.coeffs.push_back(coeff);
+        }
+        if (player.coeffs.size() != (size_t)N + 1) {
+            fatal("Coefficient file wrong format.");
+        }
     }
+    coeff_pending_skip = coeff_stride_skip;
+    if (coeff_hook) coeff_hook(coeff_file_offset(), coeff_pending_skip);
     line += "\r\n";
-    if (writen(fd, line.c_str(), line.size()) != (ssize_t)line.size()) {
-        syserr("write()");
+    send_msg(fd, std::move(line));
+    std::string output = player.player_id + " gets coefficients";
+    for (int64_t value : player.coeffs) {
+        output += ' ';
+        append_fixed(output, value, false);
+    }
+    std::cout << output << ".\n";
+}
+
+// Game end scoring that is computed by the thread pool.
+typedef struct {
+    std::vector<int> fds;
+    // Tickets of the placeholders of SCORING, one for every descriptor.
+    std::vector<uint64_t> tickets;
+    std::vector<PlayerData> players;
+    std::vector<std::string> results;
+    // Number of chunks of players that are still being scored.
+    std::atomic<size_t> left;
+    SharedMsg msg;
+    std::string output;
+    std::chrono::steady_clock::time_point begin;
+} ScoringJob;
+
+// Number of players scored by a single task of the thread pool.
+#define SCORING_CHUNK 64
+
+// Builds the SCORING message of job, once all results are known.
+static void build_SCORING(ScoringJob& job) {
+    TraceSpan span("build_SCORING");
+    std::string msg = "SCORING";
+    std::string output = "Game end, scoring:";
+    for (size_t i = 0; i < job.players.size(); i++) {
+        msg += " " + job.players[i].player_id + " " + job.results[i];
+        output += " " + job.players[i].player_id + " " + job.results[i];
     }
-    std::cout << player.player_id << " gets coefficients";
-    for (double value : player.coeffs) {
-        std::cout << " " << value;
+    msg += "\r\n";
+    output += ".\n";
+    job.msg = std::make_shared<const std::string>(std::move(msg));
+    job.output = std::move(output);
+}
+
+// Sends the SCORING of job to everyone, in the main thread.
+static void finish_SCORING(ScoringJob& job) {
+    TraceSpan span("finish_SCORING");
+    // The scoreboard is the same for everyone, so it was serialized once and
+    // the same buffer is written to every player. The clock stops when the
+    // last of them has it, the extra count keeps it going while they are
+    // being filled.
+    ScoringDelivery& delivery = deliveries[job.msg.get()];
+    delivery.begin = job.begin;
+    delivery.left = 1;
+    for (size_t i = 0; i < job.fds.size(); i++) {
+        delivery.left++;
+        if (!fill_placeholder(job.fds[i], job.tickets[i], job.msg)) delivery.left--;
     }
-    std::cout << ".\n";
+    chunk_done({job.msg, 0});
+    server_stats.games++;
+    server_stats.scoring_players = job.fds.size();
+    server_stats.scoring_bytes = job.msg->size();
+    std::cout << job.output;
+    spectator_scoring(job.msg);
+    if (scoring_hook) scoring_hook(job.msg);
 }
 
 // Send SCORING to players via descriptors fds.
-void send_SCORING(const std::vector<int>& fds, std::vector<PlayerData*>& players) {
-    std::ostringstream oss_msg;
-    std::ostringstream oss_output;
-    oss_msg << "SCORING";
-    oss_output << "Game end, scoring:";
-    std::sort(players.begin(), players.end(), player_comp);
-
-    for (size_t i = 0; i < players.size(); i++) {
-        calculate_result(*players[i]);
-        oss_msg << " " << players[i]->player_id << " " << round7(players[i]->result);
-        oss_output << " " << players[i]->player_id << " " << round7(players[i]->result);
-    }
-    oss_msg << "\r\n";
-    oss_output << ".\n";
-
-    for (int fd : fds) {
-        if (writen(fd, oss_msg.str().c_str(), oss_msg.str().size()) < 0) {
-            syserr("write()");
-        }
+void send_SCORING(const std::vector<int>& fds, std::vector<PlayerData>&& players) {
+    TraceSpan span("send_SCORING");
+    auto job = std::make_shared<ScoringJob>();
+    job->begin = std::chrono::steady_clock::now();
+    job->fds = fds;
+    job->players = std::move(players);
+    std::sort(job->players.begin(), job->players.end(),
+              [](const PlayerData& a, const PlayerData& b) {
+                  return a.player_id < b.player_id;
+              });
+    job->results.resize(job->players.size());
+    for (int fd : fds) job->tickets.push_back(queue_placeholder(fd));
+
+    // Players are scored in chunks, in parallel. The task that scores the
+    // last chunk builds the message, and only its completion sends it: the
+    // others may run while it is still being built.
+    size_t chunks = (job->players.size() + SCORING_CHUNK - 1) / SCORING_CHUNK;
+    if (chunks == 0) {
+        build_SCORING(*job);
+        finish_SCORING(*job);
+        return;
+    }
+    job->left = chunks;
+    for (size_t c = 0; c < chunks; c++) {
+        size_t from = c * SCORING_CHUNK;
+        size_t to = std::min(job->players.size(), from + SCORING_CHUNK);
+        // Set by the task if it scored the last chunk. The completion
+        // reads it after the task is done.
+        auto last = std::make_shared<bool>(false);
+        pool_submit([job, from, to, last] {
+            TraceSpan span("score_players");
+            for (size_t i = from; i < to; i++) {
+                job->results[i] = score_player(job->players[i]);
+            }
+            if (--job->left == 0) {
+                build_SCORING(*job);
+                *last = true;
+            }
+        }, [job, last] {
+            if (*last) finish_SCORING(*job);
+        });
     }
-    std::cout << oss_output.str();
+}
+
+// Formats STATE with the given state.
+static std::string format_STATE(const std::vector<int64_t>& state) {
+    std::string msg = "STATE";
+    msg.reserve(5 + state.size() * 8 + 2);
+    for (int64_t point : state) {
+        msg += ' ';
+        append_fixed(msg, point, false);
+    }
+    msg += "\r\n";
+    return msg;
 }
 
 // Send STATE to player via descriptor fd 
 // with a state of the approximation of the player.
 void send_STATE(int fd, PlayerData& player) {
-    std::ostringstream oss_msg, oss_output;
-    oss_msg << "STATE";
-    oss_output << "Sending state";
-
-    for (double point : player.state) {
-        oss_msg << " " << point;
-        oss_output << " " << point;
+    TraceSpan span("send_STATE", fd);
+    rules_answer(player, TimerAction::SEND_STATE);
+    if (player.state.size() < STATE_OFFLOAD_MIN || pool_threads() == 0) {
+        std::string msg = format_STATE(player.state);
+        std::cout << "Sending state" << msg.substr(5, msg.size() - 7) << ".\n";
+        send_msg(fd, std::move(msg));
+        return;
     }
-    oss_msg << "\r\n";
-    oss_output << ".\n";
-    if (writen(fd, oss_msg.str().c_str(), oss_msg.str().size()) < 0) {
-        syserr("write()");
-    }
-    player.received_PUT_answer = true;
-    std::cout << oss_output.str();
+    // Long states are formatted by the thread pool, a placeholder keeps
+    // their place in the output queue.
+    uint64_t ticket = queue_placeholder(fd);
+    auto msg = std::make_shared<SharedMsg>();
+    pool_submit([msg, state = player.state] {
+        TraceSpan span("format_STATE");
+        *msg = std::make_shared<const std::string>(format_STATE(state));
+    }, [msg, fd, ticket] {
+        std::cout << "Sending state" << (*msg)->substr(5, (*msg)->size() - 7)
+                  << ".\n";
+        fill_placeholder(fd, ticket, *msg);
+    });
 }
 
 
-std::string receive_msg(int fd, int k, bool& erase) {
-    Buffer& buffer = buffers[k];
+// Reads what a shared memory client wrote to its ring, like read().
+// The doorbells on the socket are only looked at once the ring is empty.
+static ssize_t read_shm(int fd, Buffer& buffer) {
+    ShmRing& ring = buffer.shm->to_server;
+    bool wake;
+    size_t n = ring_read(ring, buffer.buf + buffer.end, BUF_SIZE - buffer.end, wake);
+    if (n == 0) {
+        bool open = drain_doorbell(fd);
+        n = ring_read(ring, buffer.buf + buffer.end, BUF_SIZE - buffer.end, wake);
+        if (n == 0) {
+            if (!open) return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    if (wake) ring_doorbell(fd);
+    return (ssize_t)n;
+}
+
+bool receive_msg(int fd, std::string& line, bool& erase) {
+    TraceSpan span("receive_msg", fd);
+    Buffer& buffer = buffers[fd];
     while (true) {
         for (size_t i = buffer.start; i + 1 < buffer.end; ++i) {
             if (buffer.buf[i] == '\r' && buffer.buf[i+1] == '\n') {
-                std::string line(buffer.buf + buffer.start, i - buffer.start);
+                line.assign(buffer.buf + buffer.start, i - buffer.start);
                 size_t new_start = i + 2;
                 size_t rem = buffer.end - new_start;
                 if (rem > 0) {
@@ -219,22 +596,29 @@ std::string receive_msg(int fd, int k, bool& erase) {
                 }
                 buffer.start = 0;
                 buffer.end = rem;
-                return line;
+                return true;
             }
         }
         if (buffer.end == BUF_SIZE) {
-            syserr("read(): buffer overflow");
+            // A line longer than the buffer can't be a message, drop the
+            // client instead of the server.
+            error("line of client %d longer than %d bytes", fd, BUF_SIZE);
+            erase = true;
+            return false;
         }
-        ssize_t n = read(fd, buffer.buf + buffer.end, BUF_SIZE - buffer.end);
+        ssize_t n = buffer.shm ? read_shm(fd, buffer) :
+                    read(fd, buffer.buf + buffer.end, BUF_SIZE - buffer.end);
         if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return "";
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return false;
             }
-            syserr("read()");
+            // The client reset the connection, treat it as a disconnect.
+            erase = true;
+            return false;
         }
         if (n == 0) {
             erase = true;
-            return "";
+            return false;
         }
         buffer.end += (size_t)n;
     }
@@ -242,94 +626,212 @@ std::string receive_msg(int fd, int k, bool& erase) {
 
 bool handle_HELLO_message(std::istringstream& iss, PlayerData& player, int fd,
                             const std::string& ip, int port, int N) {
-    if (player.after_HELLO) return false;
-    if (!(iss >> player.player_id)) {
-        return false;
-    }
-    if (!iss.eof()) return false;
-
-    if (!is_valid_player_id(player.player_id)) return false;
-    player.after_HELLO = true;
+    std::string player_id;
+    if (player.after_HELLO || !(iss >> player_id) || !iss.eof()) return false;
+    if (!rules_hello(player, player_id)) return false;
 
     std::cout << ip << ":" << port << " is now known as " << player.player_id << ".\n";
     send_COEFF(fd, player, N);
+    spectator_join(fd, player.player_id);
     return true;
 }
 
-bool handle_PUT_message(std::istringstream& iss, PlayerData& player, int fd,
-                        TimerAction& timer, int K, int& PUT_count) {
-    if (!player.after_HELLO) return false;
-    int point;
-    std::string value_str;
-    double value;
-    if (!(iss >> point >> value_str)) {
+// Returns true if c separates tokens, the whitespace that operator>> of
+// streams skips.
+static bool is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r' || c == '\n';
+}
+
+// Finds the next token of msg separated by whitespace, starting at pos.
+// Returns false if there are no more tokens.
+static bool next_token(const std::string& msg, size_t& pos, size_t& start,
+                       size_t& len) {
+    while (pos < msg.size() && is_separator(msg[pos])) pos++;
+    if (pos == msg.size()) return false;
+    start = pos;
+    while (pos < msg.size() && !is_separator(msg[pos])) pos++;
+    len = pos - start;
+    return true;
+}
+
+// Parses the point of PUT, a point that doesn't fit in an int is
+// certainly out of range, so it is saturated.
+static bool parse_point(const char* s, size_t len, int& out) {
+    int64_t value;
+    if (len == 0 || len > 11 || memchr(s, '.', len)) return false;
+    if (!parse_fixed(s, len, value)) return false;
+    value /= FIXED_ONE;
+    out = (int)std::max<int64_t>(INT32_MIN, std::min<int64_t>(INT32_MAX, value));
+    return true;
+}
+
+// Parses the point and value of PUT with the arguments that start
+// at pos in msg.
+static bool parse_PUT_args(const std::string& msg, size_t pos, int& point,
+                           int64_t& value) {
+    size_t start, len;
+    if (!next_token(msg, pos, start, len) ||
+        !parse_point(msg.data() + start, len, point)) {
         return false;
     }
-    if (is_valid_decimal(value_str)) value = std::stod(value_str);
-    else return false;
-    bool PENALTY_sent = false;
-    if (!player.received_PUT_answer || player.coeffs.empty()) {
-        send_PENALTY(point, value, fd, player);
-        PENALTY_sent = true;
-        player.received_PUT_answer = true;
-    }
-    if (player.coeffs.empty()) return true;
-    if (point < 0 || point > K || value < -5 || value > 5) {
-        timer = TimerAction::BAD_PUT;
-    } else {
-        if (!PENALTY_sent) {
-            if (player.state.empty()) player.state.assign(K + 1, 0.0);
-            player.PUT_count++;
-            player.state[point] += value;
-            PUT_count++;
-            timer = TimerAction::SEND_STATE;
-        }
+    if (!next_token(msg, pos, start, len) ||
+        !parse_fixed(msg.data() + start, len, value)) {
+        return false;
     }
-    if (!PENALTY_sent) player.received_PUT_answer = false;
-    std::cout << player.player_id << " puts " << round7(value) << " in " << 
-                point << ", current state";
+    return !next_token(msg, pos, start, len);
+}
 
-    for (double val : player.state) {
-        std::cout << " " << round7(val);
+// Handles PUT with the arguments that start at pos in msg. This is the
+// hot path of the server, so it doesn't use streams or floating point.
+bool handle_PUT_message(const std::string& msg, size_t pos, PlayerData& player,
+                        int fd, TimerAction& timer, int K, int& PUT_count) {
+    if (!player.after_HELLO) return false;
+    int point;
+    int64_t value;
+    if (!parse_PUT_args(msg, pos, point, value)) return false;
+
+    PutVerdict verdict = rules_put(player, K, PUT_count, point, value);
+    if (verdict.penalty) send_PENALTY(point, value, fd, player);
+    spectator_put(fd, point, value, verdict);
+    timer = verdict.answer;
+    if (player.coeffs.empty()) return true;
+    std::string output = player.player_id + " puts ";
+    append_fixed(output, value, false);
+    output += " in " + std::to_string(point) + ", current state";
+    for (int64_t val : player.state) {
+        output += ' ';
+        append_fixed(output, val, false);
     }
-    std::cout << ".\n";
+    std::cout << output << ".\n";
     return true;
 } 
 
+bool send_shed_PENALTY(const std::string& msg, PlayerData& player, int fd) {
+    TraceSpan span("send_shed_PENALTY", fd);
+    if (!player.after_HELLO || msg.compare(0, 4, "PUT ") != 0) return false;
+    int point;
+    int64_t value;
+    if (!parse_PUT_args(msg, 3, point, value)) return false;
+    rules_penalty(player);
+    send_PENALTY(point, value, fd, player);
+    return true;
+}
+
 bool handle_message(const std::string& msg, PlayerData& player, int fd, 
                     TimerAction& timer, const std::string& ip, int port,
                     int K, int& PUT_count, int N) {
-    std::istringstream iss(msg);
-    std::string command;
-    
-    if (!(iss >> command)) {
+    TraceSpan span("handle_message", fd);
+    size_t pos = 0, start, len;
+    if (!next_token(msg, pos, start, len)) {
         return false;
     }
 
-    if (command  == "HELLO") {
-        return handle_HELLO_message(iss, player, fd, ip, port, N);
+    if (msg.compare(start, len, "PUT") == 0) {
+        return handle_PUT_message(msg, pos, player, fd, timer, K, PUT_count);
     }
-    else if (command == "PUT") {
-        return handle_PUT_message(iss, player, fd, timer, K, PUT_count);
+    else if (msg.compare(start, len, "HELLO") == 0) {
+        std::istringstream iss(msg.substr(pos));
+        return handle_HELLO_message(iss, player, fd, ip, port, N);
     }
     else return false;
 
 }
 
-void erase_kth_player(int k) {
-    if (k >= 0 && k < (int)buffers.size())
-        buffers.erase(buffers.begin() + k);
+void erase_player(int fd) {
+    auto it = buffers.find(fd);
+    if (it == buffers.end()) return;
+    if (it->second.shm) {
+        shm_unmap(it->second.shm);
+        close(it->second.shm_fd);
+    }
+    for (const OutChunk& chunk : it->second.out) chunk_done(chunk);
+    buffers.erase(it);
+}
+
+bool attach_shm(int fd) {
+    auto it = buffers.find(fd);
+    if (it == buffers.end()) return false;
+    int memfd;
+    ShmSegment* seg = shm_create(memfd);
+    if (!seg) return false;
+    if (!send_fds(fd, &memfd, 1)) {
+        shm_unmap(seg);
+        close(memfd);
+        return false;
+    }
+    it->second.shm = seg;
+    it->second.shm_fd = memfd;
+    return true;
+}
+
+void export_buffer(int fd, std::string& input, std::string& output, int& shm_fd) {
+    input.clear();
+    output.clear();
+    shm_fd = -1;
+    auto it = buffers.find(fd);
+    if (it == buffers.end()) return;
+    Buffer& buffer = it->second;
+    input.assign(buffer.buf + buffer.start, buffer.end - buffer.start);
+    size_t off = buffer.out_off;
+    for (const OutChunk& chunk : buffer.out) {
+        if (!chunk.msg) break;
+        output.append(*chunk.msg, off, std::string::npos);
+        off = 0;
+    }
+    if (buffer.shm) shm_fd = buffer.shm_fd;
+}
+
+bool import_buffer(int fd, const std::string& input, const std::string& output,
+                   int shm_fd) {
+    auto it = buffers.find(fd);
+    if (it == buffers.end() || input.size() > BUF_SIZE) return false;
+    Buffer& buffer = it->second;
+    memcpy(buffer.buf, input.data(), input.size());
+    buffer.start = 0;
+    buffer.end = input.size();
+    if (!output.empty()) queue_msg(fd, std::make_shared<const std::string>(output));
+    if (shm_fd >= 0) {
+        buffer.shm = shm_map(shm_fd);
+        if (!buffer.shm) return false;
+        buffer.shm_fd = shm_fd;
+    }
+    return true;
+}
+
+long coeff_file_offset() {
+    if (coeff_generated) return (long)coeff_row;
+    // Once the file is exhausted tellg() fails, -1 then means the end.
+    return (long)coeffs.tellg();
+}
+
+void seek_coeff_file(long offset) {
+    if (coeff_generated) {
+        coeff_row = (uint64_t)offset;
+        return;
+    }
+    if (offset < 0) coeffs.seekg(0, std::ios::end);
+    else coeffs.seekg(offset);
+    if (!coeffs) fatal("cannot seek in the coefficient file");
+}
+
+void stride_coeff_file(int first, int skip) {
+    coeff_pending_skip = first;
+    coeff_stride_skip = skip;
+}
+
+int coeff_lines_to_skip() {
+    return coeff_pending_skip;
+}
+
+void set_scoring_hook(void (*hook)(const SharedMsg& scoring)) {
+    scoring_hook = hook;
 }
 
-void erase_players() {
-    buffers.clear();
+void set_coeff_hook(void (*hook)(long offset, int skip)) {
+    coeff_hook = hook;
 }
 
-PlayerData add_player() {
-    buffers.push_back({});
-    memset(&buffers.back(), 0, sizeof(Buffer));
-    PlayerData p;
-    p.received_PUT_answer = true;
-    p.after_HELLO = false;
-    return p;
+PlayerData add_player(int fd) {
+    buffers[fd] = Buffer{};
+    return rules_new_player();
 }
\ No newline at end of file
@@ -1,60 +1,123 @@
 #ifndef SERVER_UTILS_H
 #define SERVER_UTILS_H
 
+#include <stdint.h>
+#include <memory>
+#include <string>
 #include <vector>
 
-// This is the structure representing a player's data
-// that the server stores.
-typedef struct {
-    // Player's id, alphanumeric.
-    std::string player_id; 
-    // Coefficients of the polynomial of a given player.
-    std::vector<double> coeffs; 
-    // State of the current approximation of a player.
-    std::vector<double> state;
-    // The result of the player.
-    double result; 
-    // True if after HELLO and false otherwise.
-    bool after_HELLO;
-    // Number of correct PUTs by a player.
-    int PUT_count;
-    // True if a player received an answer to their last PUT.
-    // False otherwise.
-    bool received_PUT_answer;
-} PlayerData;
-
-enum class TimerAction { NONE, SEND_STATE, BAD_PUT };
+#include "engine.h"
+
+// Immutable message that can be shared by output queues of many clients.
+typedef std::shared_ptr<const std::string> SharedMsg;
 
 // Opens the coefficient file and exits with error if it can't be opened.
 void open_coeff_file(const std::string& coeff_file);
 
+// Makes COEFF use rows of generate_coeffs with seed instead of a file.
+void use_coeff_generator(uint64_t seed);
+
 // Closes the coefficient file.
 void close_coeff_file();
 
+// Takes the next coefficients from the start of coeff_file instead of the
+// current source. Returns false, keeping the current source, if the file
+// can't be opened.
+bool switch_coeff_file(const std::string& coeff_file);
+
 // Setup dual-stack listener (IPv6+IPv4 fallback).
 // Returns the descriptor of the listening socket.
 int create_dual_stack(int port);
 
+// Moves the client with descriptor fd, a unix socket, to the shared memory
+// transport: creates the rings and sends them to the client. From then on
+// its messages go through the rings and the socket only carries doorbells.
+// Returns false on error.
+bool attach_shm(int fd);
+
+// Copies the buffers of the client with descriptor fd for a handoff to a new
+// process: unparsed input and unsent output. The descriptor of its shared
+// memory is stored in shm_fd, -1 if the client uses a socket.
+void export_buffer(int fd, std::string& input, std::string& output, int& shm_fd);
+
+// Restores the buffers of the client with descriptor fd, which was added
+// with add_player, from export_buffer of the old process. Returns false
+// if they are invalid.
+bool import_buffer(int fd, const std::string& input, const std::string& output,
+                   int shm_fd);
+
+// Returns the position of the next line of the coefficient file, or the
+// next row of the generator.
+long coeff_file_offset();
+
+// Moves the coefficient file (or the generator) to the position offset.
+void seek_coeff_file(long offset);
+
+// Makes COEFF skip first lines of the coefficient file and then skip
+// lines between every two COEFFs, so that a worker of a cluster uses
+// every (skip + 1)-th line.
+void stride_coeff_file(int first, int skip);
+
+// Returns the number of lines skipped before the next COEFF.
+int coeff_lines_to_skip();
+
+// Sets the function called with the SCORING message of every game.
+void set_scoring_hook(void (*hook)(const SharedMsg& scoring));
+
+// Sets the function called after every COEFF with coeff_file_offset() and
+// coeff_lines_to_skip(), and with offset -1 once the file is exhausted.
+void set_coeff_hook(void (*hook)(long offset, int skip));
+
+// Setup a listener on the unix domain socket path, replacing a stale
+// socket file left there. Returns the descriptor of the listening socket.
+int create_unix_listener(const std::string& path);
+
 // Send STATE to player via descriptor fd 
 // with a state of the approximation of the player.
 void send_STATE(int fd, PlayerData& player);
 
-// Send SCORING to players via descriptors fds.
-void send_SCORING(const std::vector<int>& fds, std::vector<PlayerData*>& players);
+// Send SCORING to players via descriptors fds. The results are computed by
+// the thread pool, the message is queued for everyone at once, so until it
+// is ready nothing else is written to these descriptors.
+void send_SCORING(const std::vector<int>& fds, std::vector<PlayerData>&& players);
 
 // Send COEFF via descriptor fd, from the coefficient's file.
 void send_COEFF(int fd, PlayerData& player, int K);
 
-// Send PENALTY with point, value to a player via descriptor fd.
-void send_PENALTY(int point, double value, int fd, PlayerData& player);
+// Send PENALTY with point, value (in units of 1e-7) to a player via descriptor
+// fd. The penalty is charged by the rules.
+void send_PENALTY(int point, int64_t value, int fd, const PlayerData& player);
+
+// Answers PUT msg that was shed by the rate limiter with PENALTY, without
+// applying it. Returns false if msg is not a valid PUT.
+bool send_shed_PENALTY(const std::string& msg, PlayerData& player, int fd);
+
+// Send BAD_PUT with point, value (in units of 1e-7) to a player via descriptor fd.
+void send_BAD_PUT(int point, int64_t value, int fd, PlayerData& player);
 
-// Send BAD_PUT with point, value to a player via descriptor fd.
-void send_BAD_PUT(int point, double value, int fd, PlayerData& player);
+// Receives a message from fd into its buffer. Returns true and sets line
+// (without \r\n) if a whole line is available, or returns false if not.
+// If erase is set then server should erase all the data concerning this
+// player, because they disconnected.
+bool receive_msg(int fd, std::string& line, bool& erase);
 
-// Receives a message from fd into the k-th buffer, returns a line (without \r\n)
-// if available, or empty string if not. If erase is set then server should erase 
-// all the data concerning this player, because they disconnected.
-std::string receive_msg(int fd, int k, bool& erase);
+// Writes as much of the output queue of fd as the socket accepts without
+// blocking. Returns false if the connection is broken and should be dropped.
+bool flush_output(int fd);
+
+// Returns true if fd has queued data that wasn't written yet, including
+// messages that are still being prepared.
+bool has_pending_output(int fd);
+
+// Returns true if the first queued message of fd is ready to be written.
+bool can_flush(int fd);
+
+// Returns true if fd has a queued message that is still being prepared.
+bool has_placeholder(int fd);
+
+// Returns the bytes held for the client with descriptor fd: its buffers,
+// the messages queued for it (shared ones in full) and its data.
+size_t connection_bytes(int fd, const PlayerData& player);
 
 // Parses the message msg from the player represented by their descriptor fd.
 // Sends back the necessary replies if necessary or sets the timer for specific
@@ -65,14 +128,11 @@ bool handle_message(const std::string& msg, PlayerData& player, int fd,
                     int K, int& PUT_count, int N);
 
 
-// Removes the buffer associated with the k-th player (used for cleaning up after a disconnect).
-void erase_kth_player(int k);
-
-// Removes all player buffers (used for cleaning up after a game ends).
-void erase_players();
+// Removes the buffer associated with the player on fd (used for cleaning up after a disconnect).
+void erase_player(int fd);
 
-// Adds a new player and initializes their buffer; returns a default-initialized PlayerData.
-PlayerData add_player();
+// Adds a new player on fd and initializes their buffer; returns a default-initialized PlayerData.
+PlayerData add_player(int fd);
 
 
 #endif // SERVER_UTILS_H
\ No newline at end of file
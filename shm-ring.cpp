@@ -0,0 +1,116 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include "shm-ring.h"
+
+// Marks a segment created by this version of the server.
+#define SHM_MAGIC 0x41505052u
+
+ShmSegment* shm_create(int& memfd) {
+    memfd = memfd_create("approx-shm", MFD_CLOEXEC);
+    if (memfd < 0) return nullptr;
+    if (ftruncate(memfd, sizeof(ShmSegment)) < 0) {
+        close(memfd);
+        return nullptr;
+    }
+    void* p = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED) {
+        close(memfd);
+        return nullptr;
+    }
+    // The memory is zeroed, which is a valid state of the rings.
+    ShmSegment* seg = new (p) ShmSegment;
+    seg->magic = SHM_MAGIC;
+    return seg;
+}
+
+ShmSegment* shm_map(int memfd) {
+    void* p = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED) return nullptr;
+    ShmSegment* seg = (ShmSegment*)p;
+    if (seg->magic != SHM_MAGIC) {
+        munmap(p, sizeof(ShmSegment));
+        return nullptr;
+    }
+    return seg;
+}
+
+void shm_unmap(ShmSegment* seg) {
+    if (seg) munmap(seg, sizeof(ShmSegment));
+}
+
+size_t ring_write(ShmRing& r, const char* data, size_t len, bool& was_empty) {
+    was_empty = false;
+    size_t total = 0;
+    while (true) {
+        uint32_t head = r.head.load(std::memory_order_relaxed);
+        uint32_t tail = r.tail.load(std::memory_order_acquire);
+        size_t room = SHM_RING_SIZE - (head - tail);
+        size_t n = std::min(len - total, room);
+        for (size_t done = 0; done < n;) {
+            size_t at = (head + done) % SHM_RING_SIZE;
+            size_t part = std::min<size_t>(n - done, SHM_RING_SIZE - at);
+            memcpy(r.data + at, data + total + done, part);
+            done += part;
+        }
+        // Publishing the data and then looking at tail pairs with the
+        // consumer moving tail and then looking at head (both sequentially
+        // consistent): either the consumer sees the new data or we see that
+        // it emptied the ring and may be going to sleep.
+        r.head.store(head + (uint32_t)n, std::memory_order_seq_cst);
+        if (n > 0 && r.tail.load(std::memory_order_seq_cst) == head) {
+            was_empty = true;
+        }
+        total += n;
+        if (total == len) return total;
+        r.full_waiting.store(1, std::memory_order_seq_cst);
+        // If the consumer made room before it could see the flag, nobody
+        // would wake us, so we try again.
+        if (r.tail.load(std::memory_order_seq_cst) == tail) return total;
+    }
+}
+
+size_t ring_read(ShmRing& r, char* out, size_t len, bool& wake_producer) {
+    uint32_t tail = r.tail.load(std::memory_order_relaxed);
+    uint32_t head = r.head.load(std::memory_order_acquire);
+    size_t used = head - tail;
+    size_t n = len < used ? len : used;
+    for (size_t done = 0; done < n;) {
+        size_t at = (tail + done) % SHM_RING_SIZE;
+        size_t part = std::min<size_t>(n - done, SHM_RING_SIZE - at);
+        memcpy(out + done, r.data + at, part);
+        done += part;
+    }
+    r.tail.store(tail + (uint32_t)n, std::memory_order_seq_cst);
+    wake_producer = n > 0 && r.full_waiting.exchange(0, std::memory_order_seq_cst);
+    return n;
+}
+
+size_t ring_used(const ShmRing& r) {
+    return r.head.load(std::memory_order_seq_cst) -
+           r.tail.load(std::memory_order_seq_cst);
+}
+
+void ring_doorbell(int sock) {
+    char byte = 0;
+    // A full socket already holds doorbells the peer hasn't read.
+    while (send(sock, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno == EINTR) {}
+}
+
+bool drain_doorbell(int sock) {
+    char buf[256];
+    while (true) {
+        ssize_t n = recv(sock, buf, sizeof buf, MSG_DONTWAIT);
+        if (n > 0) continue;
+        if (n == 0) return false;
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
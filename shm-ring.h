@@ -0,0 +1,64 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Prefix of server addresses of the shared memory transport.
+constexpr const char SHM_PREFIX[] = "shm:";
+
+// Size of a single ring, a power of two.
+constexpr uint32_t SHM_RING_SIZE = 1 << 18;
+
+// Single producer, single consumer byte ring in shared memory. Positions
+// only grow (modulo 2^32), the byte at position p is data[p % size].
+typedef struct {
+    // Written by the producer only.
+    alignas(64) std::atomic<uint32_t> head;
+    // Written by the consumer only.
+    alignas(64) std::atomic<uint32_t> tail;
+    // Set by the producer when the ring was full, the consumer rings
+    // the doorbell once it makes room.
+    alignas(64) std::atomic<uint32_t> full_waiting;
+    alignas(64) char data[SHM_RING_SIZE];
+} ShmRing;
+
+// Segment shared by a client and the server, created by the server.
+typedef struct {
+    uint32_t magic;
+    ShmRing to_server;
+    ShmRing to_client;
+} ShmSegment;
+
+// Creates and maps a new segment. Its memfd is stored in memfd.
+// Returns nullptr on error.
+ShmSegment* shm_create(int& memfd);
+
+// Maps the segment of memfd. Returns nullptr on error.
+ShmSegment* shm_map(int memfd);
+
+// Unmaps a segment.
+void shm_unmap(ShmSegment* seg);
+
+// Writes at most len bytes of data to r. Returns the number of bytes
+// written, was_empty is set if the consumer could have seen r empty and
+// needs the doorbell. If not everything fits, the consumer is asked to
+// ring the doorbell once there is room.
+size_t ring_write(ShmRing& r, const char* data, size_t len, bool& was_empty);
+
+// Reads at most len bytes from r to out. Returns the number of bytes read,
+// wake_producer is set if the producer waits for room and needs the doorbell.
+size_t ring_read(ShmRing& r, char* out, size_t len, bool& wake_producer);
+
+// Returns the number of bytes waiting in r.
+size_t ring_used(const ShmRing& r);
+
+// Rings the doorbell of the peer: a single byte on the socket sock.
+void ring_doorbell(int sock);
+
+// Reads the doorbells waiting on the socket sock without blocking.
+// Returns false if the peer closed the connection.
+bool drain_doorbell(int sock);
+
+#endif // SHM_RING_H
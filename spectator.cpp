@@ -0,0 +1,400 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "spectator.h"
+#include "common.h"
+#include "err.h"
+
+// Number of events kept for spectators that are behind. A spectator that
+// is further behind gets a snapshot instead, so a slow one costs neither
+// memory nor time of the game.
+#define BACKLOG_EVENTS 4096
+// Maximal number of events passed to a single sendmsg().
+#define MAX_IOV 64
+// The streaming thread waits this long after sending, so that the events
+// of that time go to every spectator in a single write.
+#define BATCH_MS 10
+
+// Player of the current game as the spectators see it.
+typedef struct {
+    std::string player_id;
+    int puts;
+    // Points that aren't 0, with their values in units of 1e-7.
+    std::map<int, int64_t> state;
+} Watched;
+
+// Connection of a spectator.
+typedef struct {
+    int fd;
+    // Sequence number of the next event to send.
+    uint64_t next;
+    // Message written in part, its rest starts at offset, or nullptr.
+    SharedMsg partial;
+    size_t offset;
+    // Its socket was full, it waits for POLLOUT.
+    bool blocked;
+    // Just connected, it starts with a snapshot.
+    bool fresh;
+} Spectator;
+
+static int listen_fd = -1;
+// Wakes up the streaming thread when there are new events.
+static int wake_fd = -1;
+static std::atomic<bool> wake_pending{false};
+
+// Guards the events that the streaming thread hasn't taken yet and the
+// game as the spectators see it, both written by the game loop.
+static std::mutex lock;
+static std::vector<SharedMsg> pending;
+static int game_K = 0, game_N = 0, game_M = 0;
+// Players of the current game by their descriptors.
+static std::unordered_map<int, Watched> watched;
+
+// Everything below belongs to the streaming thread.
+static std::vector<Spectator> spectators;
+// Recent events, backlog[0] has the sequence number first_seq.
+static std::deque<SharedMsg> backlog;
+static uint64_t first_seq = 0;
+// Snapshot of the game before the event snapshot_seq.
+static SharedMsg snapshot;
+static uint64_t snapshot_seq = 0;
+// Some spectator waits for a snapshot that isn't built yet.
+static bool snapshot_wanted = false;
+
+// Counters for spectator_print.
+static std::atomic<uint64_t> connected{0};
+static std::atomic<uint64_t> published{0};
+static std::atomic<uint64_t> snapshots{0};
+static std::atomic<uint64_t> lagged{0};
+
+// Sequence number of the next event.
+static uint64_t head_seq() {
+    return first_seq + backlog.size();
+}
+
+// Queues msg for the spectators, with lock held.
+static void publish(SharedMsg msg) {
+    pending.push_back(std::move(msg));
+    published++;
+}
+
+// Wakes up the streaming thread, unless it was woken already.
+static void wake_streamer() {
+    if (wake_pending.exchange(true)) return;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+        syserr("write(eventfd)");
+    }
+}
+
+// Appends " point value" to line.
+static void append_put(std::string& line, int point, int64_t value) {
+    char buf[FIXED_MAX_LEN];
+    line += ' ';
+    line += std::to_string(point);
+    line += ' ';
+    line.append(buf, format_fixed(value, buf, false));
+}
+
+void spectator_game(int K, int N, int M) {
+    if (listen_fd < 0) return;
+    auto msg = std::make_shared<const std::string>(
+        "GAME " + std::to_string(K) + " " + std::to_string(N) + " " +
+        std::to_string(M) + "\r\n");
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        game_K = K;
+        game_N = N;
+        game_M = M;
+        watched.clear();
+        publish(std::move(msg));
+    }
+    wake_streamer();
+}
+
+void spectator_join(int fd, const std::string& player_id) {
+    if (listen_fd < 0) return;
+    auto msg = std::make_shared<const std::string>("JOIN " + player_id + "\r\n");
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        watched[fd] = {player_id, 0, {}};
+        publish(std::move(msg));
+    }
+    wake_streamer();
+}
+
+void spectator_put(int fd, int point, int64_t value, const PutVerdict& verdict) {
+    if (listen_fd < 0) return;
+    std::string line;
+    if (verdict.penalty) {
+        line = "PENALTY ";
+    } else if (verdict.answer == TimerAction::BAD_PUT) {
+        line = "BAD_PUT ";
+    } else if (verdict.answer == TimerAction::SEND_STATE) {
+        line = "PUT ";
+    } else {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = watched.find(fd);
+        if (it == watched.end()) return;
+        Watched& w = it->second;
+        if (verdict.answer == TimerAction::SEND_STATE && !verdict.penalty) {
+            w.puts++;
+            int64_t& v = w.state[point];
+            v += value;
+            if (v == 0) w.state.erase(point);
+        }
+        line += w.player_id;
+        append_put(line, point, value);
+        line += "\r\n";
+        publish(std::make_shared<const std::string>(std::move(line)));
+    }
+    wake_streamer();
+}
+
+void spectator_leave(int fd) {
+    if (listen_fd < 0) return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = watched.find(fd);
+        if (it == watched.end()) return;
+        std::string line = "LEAVE " + it->second.player_id + "\r\n";
+        watched.erase(it);
+        publish(std::make_shared<const std::string>(std::move(line)));
+    }
+    wake_streamer();
+}
+
+void spectator_scoring(const SharedMsg& scoring) {
+    if (listen_fd < 0) return;
+    {
+        // The same buffer as the one written to the players.
+        std::lock_guard<std::mutex> guard(lock);
+        publish(scoring);
+    }
+    wake_streamer();
+}
+
+// Builds the snapshot of the game, with lock held.
+static void build_snapshot() {
+    int PUT_count = 0;
+    for (auto& entry : watched) PUT_count += entry.second.puts;
+    std::string text = "SNAPSHOT " + std::to_string(game_K) + " " +
+                       std::to_string(game_N) + " " + std::to_string(game_M) +
+                       " " + std::to_string(PUT_count) + " " +
+                       std::to_string(watched.size()) + "\r\n";
+    char buf[FIXED_MAX_LEN];
+    for (auto& entry : watched) {
+        const Watched& w = entry.second;
+        text += "PLAYER " + w.player_id + " " + std::to_string(w.puts);
+        for (auto& point : w.state) {
+            text += ' ';
+            text += std::to_string(point.first);
+            text += ':';
+            text.append(buf, format_fixed(point.second, buf, false));
+        }
+        text += "\r\n";
+    }
+    snapshot = std::make_shared<const std::string>(std::move(text));
+    snapshot_seq = head_seq();
+    snapshots++;
+}
+
+// Returns true if the snapshot shows the game before the next event.
+static bool snapshot_current() {
+    return snapshot && snapshot_seq == head_seq();
+}
+
+// Moves the queued events to the backlog, dropping the oldest ones, and
+// builds a snapshot if some spectator needs one.
+static void take_events() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (SharedMsg& msg : pending) backlog.push_back(std::move(msg));
+    pending.clear();
+    while (backlog.size() > BACKLOG_EVENTS) {
+        backlog.pop_front();
+        first_seq++;
+    }
+    bool needed = false;
+    for (const Spectator& s : spectators) {
+        needed |= s.fresh || (!s.partial && s.next < first_seq);
+    }
+    if (needed && !snapshot_current()) build_snapshot();
+}
+
+// Writes as much of the backlog to s as its socket takes. Returns false
+// if the connection is broken.
+static bool flush_spectator(Spectator& s) {
+    while (!s.blocked) {
+        if (!s.partial) {
+            if (s.fresh || s.next < first_seq) {
+                // Its events are gone (or it has none yet), it starts over
+                // from the snapshot. Only take_events builds it, so that it
+                // matches the backlog.
+                if (!snapshot_current()) {
+                    snapshot_wanted = true;
+                    return true;
+                }
+                if (!s.fresh) lagged++;
+                s.fresh = false;
+                s.partial = snapshot;
+                s.next = snapshot_seq;
+            } else if (s.next < head_seq()) {
+                s.partial = backlog[s.next++ - first_seq];
+            } else {
+                return true;
+            }
+            s.offset = 0;
+        }
+        struct iovec iov[MAX_IOV];
+        size_t count = 0;
+        size_t total = s.partial->size() - s.offset;
+        iov[count++] = {(void*)(s.partial->data() + s.offset), total};
+        // A lagging spectator only finishes the message it has begun.
+        uint64_t end = s.next < first_seq ? s.next : head_seq();
+        for (uint64_t seq = s.next; seq < end && count < MAX_IOV; seq++) {
+            const std::string& event = *backlog[seq - first_seq];
+            iov[count++] = {(void*)event.data(), event.size()};
+            total += event.size();
+        }
+        struct msghdr mh{};
+        mh.msg_iov = iov;
+        mh.msg_iovlen = count;
+        ssize_t n = sendmsg(s.fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+            s.blocked = errno != EINTR;
+            continue;
+        }
+        size_t left = (size_t)n;
+        if (left < iov[0].iov_len) {
+            s.offset += left;
+        } else {
+            left -= iov[0].iov_len;
+            s.partial.reset();
+            while (left > 0) {
+                const SharedMsg& event = backlog[s.next++ - first_seq];
+                if (left < event->size()) {
+                    s.partial = event;
+                    s.offset = left;
+                    break;
+                }
+                left -= event->size();
+            }
+        }
+        s.blocked = (size_t)n < total;
+    }
+    return true;
+}
+
+// Closes the connection of the i-th spectator.
+static void drop_spectator(size_t i) {
+    close(spectators[i].fd);
+    spectators.erase(spectators.begin() + i);
+    connected = spectators.size();
+}
+
+// Main loop of the streaming thread.
+static void streamer() {
+    std::vector<struct pollfd> fds;
+    while (true) {
+        fds.clear();
+        fds.push_back({wake_fd, POLLIN, 0});
+        fds.push_back({listen_fd, POLLIN, 0});
+        for (const Spectator& s : spectators) {
+            fds.push_back({s.fd, (short)(POLLIN | (s.blocked ? POLLOUT : 0)), 0});
+        }
+        if (poll(fds.data(), fds.size(), snapshot_wanted ? 0 : -1) < 0) {
+            if (errno == EINTR) continue;
+            syserr("poll()");
+        }
+        bool woken = fds[0].revents & POLLIN;
+        if (woken) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof count) < 0 && errno != EAGAIN) {
+                syserr("read(eventfd)");
+            }
+            wake_pending = false;
+        }
+
+        size_t polled = spectators.size();
+        for (size_t i = 0, f = 2; i < polled; i++, f++) {
+            short revents = fds[f].revents;
+            bool broken = revents & (POLLERR | POLLHUP | POLLNVAL);
+            if (!broken && (revents & POLLIN)) {
+                char buf[512];
+                ssize_t n = recv(spectators[i].fd, buf, sizeof buf, MSG_DONTWAIT);
+                broken = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                                    errno != EINTR);
+            }
+            if (revents & POLLOUT) spectators[i].blocked = false;
+            if (broken) {
+                drop_spectator(i);
+                i--;
+                polled--;
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+                spectators.push_back({fd, 0, nullptr, 0, false, true});
+            }
+            connected = spectators.size();
+        }
+
+        take_events();
+        snapshot_wanted = false;
+        for (size_t i = 0; i < spectators.size(); i++) {
+            if (!flush_spectator(spectators[i])) {
+                drop_spectator(i);
+                i--;
+            }
+        }
+        if (woken) std::this_thread::sleep_for(std::chrono::milliseconds(BATCH_MS));
+    }
+}
+
+void spectator_listen(int port) {
+    listen_fd = create_dual_stack(port);
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+    if (getsockname(listen_fd, (struct sockaddr*)&addr, &len) < 0) syserr("getsockname()");
+    int bound = addr.ss_family == AF_INET6 ?
+                ntohs(((struct sockaddr_in6*)&addr)->sin6_port) :
+                ntohs(((struct sockaddr_in*)&addr)->sin_port);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) syserr("eventfd()");
+    std::cout << "Spectators can connect to port " << bound << ".\n";
+    std::thread(streamer).detach();
+}
+
+bool spectator_enabled() {
+    return listen_fd >= 0;
+}
+
+void spectator_print(std::ostream& os) {
+    if (listen_fd < 0) return;
+    os << "spectators " << connected << "\n"
+       << "spectator_events " << published << "\n"
+       << "spectator_snapshots " << snapshots << "\n"
+       << "spectator_lagged " << lagged << "\n";
+}
@@ -0,0 +1,45 @@
+#ifndef SPECTATOR_H
+#define SPECTATOR_H
+
+#include <stdint.h>
+#include <ostream>
+#include <string>
+
+#include "engine.h"
+#include "server-utils.h"
+
+// Read-only stream of the games for spectators. Every event is one line,
+// serialized once and kept in a backlog that all spectators read from:
+//   GAME K N M                 a new game started
+//   JOIN player_id             a player sent HELLO
+//   PUT player_id point value  a PUT was applied, the state delta
+//   PENALTY player_id point value
+//   BAD_PUT player_id point value
+//   LEAVE player_id            a player disconnected during the game
+//   SCORING ...                the game ended, as sent to the players
+// A new spectator, and one that fell so far behind that its events left
+// the backlog, first gets a snapshot of the game instead:
+//   SNAPSHOT K N M PUT_count players
+//   PLAYER player_id puts point:value ...   (every point that isn't 0)
+// Lines end with \r\n, like the messages of the game. Whatever the
+// spectators send is ignored.
+
+// Starts listening for spectators on port and the thread that streams the
+// events to them. The game loop only queues the events, so it doesn't
+// slow down with more spectators. Exits with error on failure.
+void spectator_listen(int port);
+
+// Returns true if the server has a spectator endpoint.
+bool spectator_enabled();
+
+// Prints the number of spectators and events.
+void spectator_print(std::ostream& os);
+
+// Events of the game, the players are identified by their descriptors.
+void spectator_game(int K, int N, int M);
+void spectator_join(int fd, const std::string& player_id);
+void spectator_put(int fd, int point, int64_t value, const PutVerdict& verdict);
+void spectator_leave(int fd);
+void spectator_scoring(const SharedMsg& scoring);
+
+#endif // SPECTATOR_H
@@ -0,0 +1,145 @@
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "thread-pool.h"
+#include "err.h"
+#include "trace.h"
+
+// Task with the completion that is posted back once it is done.
+typedef struct {
+    Task work;
+    Task done;
+} Job;
+
+// Queue of a single worker. The owner takes jobs from the front, idle
+// workers steal from the back.
+typedef struct {
+    std::mutex lock;
+    std::deque<Job> jobs;
+} WorkQueue;
+
+// The workers run until the process exits, so what they use is never
+// destroyed: exit() would wait forever on the condition variable they
+// sleep on.
+static auto& queues = *new std::vector<std::unique_ptr<WorkQueue>>;
+// Worker the next job is given to.
+static size_t next_queue = 0;
+// Number of jobs in all queues, workers sleep while it is 0.
+static std::atomic<size_t> queued{0};
+static std::mutex& sleep_lock = *new std::mutex;
+static std::condition_variable& wake = *new std::condition_variable;
+
+// Completions waiting for the main thread.
+static std::mutex& done_lock = *new std::mutex;
+static auto& completions = *new std::vector<Task>;
+static int event_fd = -1;
+
+// Takes a job from queue q, from the front or from the back.
+static bool take_job(WorkQueue& q, bool front, Job& job) {
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.jobs.empty()) return false;
+    if (front) {
+        job = std::move(q.jobs.front());
+        q.jobs.pop_front();
+    } else {
+        job = std::move(q.jobs.back());
+        q.jobs.pop_back();
+    }
+    return true;
+}
+
+// Finds a job for worker self, in its own queue first.
+static bool find_job(size_t self, Job& job) {
+    if (take_job(*queues[self], true, job)) return true;
+    for (size_t i = 1; i < queues.size(); i++) {
+        if (take_job(*queues[(self + i) % queues.size()], false, job)) return true;
+    }
+    return false;
+}
+
+// Posts a completion to the main thread.
+static void post_completion(Task done) {
+    {
+        std::lock_guard<std::mutex> guard(done_lock);
+        completions.push_back(std::move(done));
+    }
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+        syserr("write(eventfd)");
+    }
+}
+
+static void worker_loop(size_t self) {
+    trace_thread_name("pool");
+    while (true) {
+        Job job;
+        if (!find_job(self, job)) {
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            wake.wait(guard, [] { return queued.load() > 0; });
+            continue;
+        }
+        queued--;
+        job.work();
+        if (job.done) post_completion(std::move(job.done));
+    }
+}
+
+void pool_start(int threads) {
+    if (threads <= 0) return;
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) syserr("eventfd()");
+    for (int i = 0; i < threads; i++) {
+        queues.push_back(std::make_unique<WorkQueue>());
+    }
+    // The workers run until the process exits.
+    for (int i = 0; i < threads; i++) {
+        std::thread(worker_loop, (size_t)i).detach();
+    }
+}
+
+int pool_threads() {
+    return (int)queues.size();
+}
+
+void pool_submit(Task work, Task done) {
+    if (queues.empty()) {
+        work();
+        if (done) done();
+        return;
+    }
+    WorkQueue& q = *queues[next_queue];
+    next_queue = (next_queue + 1) % queues.size();
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.jobs.push_back({std::move(work), std::move(done)});
+    }
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+int pool_event_fd() {
+    return event_fd;
+}
+
+void pool_run_completions() {
+    uint64_t count;
+    if (read(event_fd, &count, sizeof count) < 0 && errno != EAGAIN) {
+        syserr("read(eventfd)");
+    }
+    std::vector<Task> ready;
+    {
+        std::lock_guard<std::mutex> guard(done_lock);
+        ready.swap(completions);
+    }
+    for (Task& done : ready) done();
+}
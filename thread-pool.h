@@ -0,0 +1,28 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <functional>
+
+// Piece of work run by the pool or by the main thread.
+typedef std::function<void()> Task;
+
+// Starts the pool with the given number of worker threads. With 0 threads
+// every task is run at once by the thread that submits it.
+void pool_start(int threads);
+
+// Returns the number of worker threads of the pool.
+int pool_threads();
+
+// Runs work on one of the workers. Once it is done, done (if set) is run
+// by the main thread in pool_run_completions(). Must be called by the
+// main thread.
+void pool_submit(Task work, Task done = nullptr);
+
+// Descriptor that becomes readable when there are completions to run,
+// -1 if the pool has no workers.
+int pool_event_fd();
+
+// Runs the completions of the finished tasks, in the main thread.
+void pool_run_completions();
+
+#endif // THREAD_POOL_H
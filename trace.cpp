@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+
+// Number of spans kept by the ring of a thread.
+#define TRACE_RING_SPANS 65536
+// Oldest spans of a full ring that aren't written, a thread may still be
+// finishing a span there while the trace is written.
+#define TRACE_RING_SLACK 64
+
+std::atomic<bool> trace_on{false};
+
+// Span as recorded, times in nanoseconds.
+typedef struct {
+    const char* name;
+    int64_t start_ns;
+    int64_t dur_ns;
+    int64_t arg;
+} Span;
+
+// Ring of the spans of one thread. Only its thread writes the spans, head
+// is the number of spans it recorded so far.
+typedef struct {
+    long tid;
+    const char* name;
+    std::atomic<uint64_t> head;
+    Span spans[TRACE_RING_SPANS];
+} Ring;
+
+// Rings of all threads that recorded a span, they live as long as the
+// process.
+static std::mutex rings_lock;
+static std::vector<Ring*> rings;
+static thread_local Ring* own_ring = nullptr;
+static thread_local const char* own_name = nullptr;
+// When the current trace started.
+static int64_t started_ns = 0;
+
+int64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns the ring of the calling thread, created on its first span.
+static Ring& ring() {
+    if (!own_ring) {
+        own_ring = new Ring();
+        own_ring->tid = syscall(SYS_gettid);
+        own_ring->name = own_name;
+        own_ring->head = 0;
+        std::lock_guard<std::mutex> guard(rings_lock);
+        rings.push_back(own_ring);
+    }
+    return *own_ring;
+}
+
+void trace_record(const char* name, int64_t start_ns, int64_t arg) {
+    Ring& r = ring();
+    uint64_t head = r.head.load(std::memory_order_relaxed);
+    r.spans[head % TRACE_RING_SPANS] = {name, start_ns, trace_now_ns() - start_ns, arg};
+    r.head.store(head + 1, std::memory_order_release);
+}
+
+void trace_thread_name(const char* name) {
+    own_name = name;
+    if (own_ring) own_ring->name = name;
+}
+
+void trace_start() {
+    started_ns = trace_now_ns();
+    trace_on = true;
+}
+
+// Appends a time in nanoseconds as microseconds, the unit of the format.
+static void append_us(std::string& out, int64_t ns) {
+    char buf[32];
+    int len = snprintf(buf, sizeof buf, "%lld.%03d", (long long)(ns / 1000), (int)(ns % 1000));
+    out.append(buf, len);
+}
+
+bool trace_stop(const std::string& path, size_t& written) {
+    trace_on = false;
+    std::string pid = std::to_string(getpid());
+    std::string text = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    written = 0;
+    std::lock_guard<std::mutex> guard(rings_lock);
+    for (Ring* r : rings) {
+        std::string tid = std::to_string(r->tid);
+        text += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" + pid + ",\"tid\":" +
+                tid + ",\"args\":{\"name\":\"" + (r->name ? r->name : "thread") + "\"}},\n";
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_SPANS ?
+                         head - TRACE_RING_SPANS + TRACE_RING_SLACK : 0;
+        for (uint64_t i = first; i < head; i++) {
+            const Span& s = r->spans[i % TRACE_RING_SPANS];
+            if (s.start_ns < started_ns) continue;
+            text += "{\"ph\":\"X\",\"name\":\"";
+            text += s.name;
+            text += "\",\"pid\":" + pid + ",\"tid\":" + tid + ",\"ts\":";
+            append_us(text, s.start_ns - started_ns);
+            text += ",\"dur\":";
+            append_us(text, s.dur_ns);
+            if (s.arg >= 0) text += ",\"args\":{\"fd\":" + std::to_string(s.arg) + "}";
+            text += "},\n";
+            written++;
+        }
+    }
+    // The format allows no comma after the last event.
+    if (!rings.empty()) text.resize(text.size() - 2);
+    text += "\n]}\n";
+    std::ofstream out(path);
+    return out && (out << text) && out.flush();
+}